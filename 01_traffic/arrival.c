@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-heading vehicle arrival generators, arrival schedules (see schedule.h),
+ * and arrival traces.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "arrival.h"
+#include "rng.h"
+#include "sched.h"
+#include "schedule.h"
+#include "timerwheel.h"
+#include "traffic.h"
+
+/*
+ * The wheel starts at tick 0, which counts as already processed. So that
+ * arrivals at time 0 still fire, wheel ticks are offset from times by one.
+ * Arrival times are quantised to ARRIVAL_TICK.
+ */
+#define TIME_TO_TICK(time)	((uint64_t) ((time) / ARRIVAL_TICK) + 1)
+#define TICK_TO_TIME(tick)	((simtime_t) ((tick) - 1) * ARRIVAL_TICK)
+
+/*
+ * An arrival trace is a header followed by one 64-bit record per arrival, in
+ * the order they were handed out (so sorted by time, and by heading for
+ * simultaneous arrivals). Each record packs the arrival time (in units of
+ * ARRIVAL_TICK) and the heading:
+ *
+ *    63                                       4 3       0
+ *   +------------------------------------------+---------+
+ *   |          arrival time / ARRIVAL_TICK     | heading |
+ *   +------------------------------------------+---------+
+ *
+ * Everything is in host byte order, and the header is a multiple of the
+ * record size, so the records can be used straight out of the mapping.
+ */
+#define TRACE_MAGIC			"ARRTRACE"
+#define TRACE_VERSION		1
+#define TRACE_HEADING_BITS	4
+
+#define TRACE_RECORD(when, heading)											\
+	((uint64_t) ((when) / ARRIVAL_TICK) << TRACE_HEADING_BITS |				\
+	 (uint64_t) (heading))
+#define TRACE_WHEN(record)		((simtime_t) ((record) >> TRACE_HEADING_BITS) * ARRIVAL_TICK)
+#define TRACE_HEADING(record)	((heading_t) ((record) & ((1U << TRACE_HEADING_BITS) - 1)))
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	/* Length of ARRIVAL_TICK when the trace was recorded. */
+	uint32_t tick;
+	/* How many records follow? */
+	uint64_t count;
+};
+
+/* Every heading has to fit in a record (this won't compile otherwise). */
+typedef char trace_heading_check[NUM_HEADINGS <= 1U << TRACE_HEADING_BITS ? 1 : -1];
+
+/*
+ * A replayed trace is read once from start to end, so the pages that are done
+ * with are dropped every so often -- otherwise replaying a trace that is
+ * bigger than memory would push everything else out of the page cache.
+ */
+#define TRACE_DROP_BYTES	(64UL << 20)
+
+/* Records are written out this many at a time, rather than one by one. */
+#define TRACE_WRITE_CHUNK	256
+
+int arrival_trace_create(struct arrival_trace_t *trace, const char *path)
+{
+	struct trace_header header = {
+		.version = TRACE_VERSION,
+		.tick = ARRIVAL_TICK,
+	};
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	*trace = (struct arrival_trace_t) { 0 };
+	trace->out = fopen(path, "wb");
+	if (!trace->out)
+		return -1;
+	/* The count is filled in by arrival_trace_close(). */
+	if (fwrite(&header, sizeof(header), 1, trace->out) != 1) {
+		fclose(trace->out);
+		return -1;
+	}
+	return 0;
+}
+
+int arrival_trace_open(struct arrival_trace_t *trace, const char *path)
+{
+	const struct trace_header *header;
+	struct stat st;
+	int fd;
+
+	*trace = (struct arrival_trace_t) { 0 };
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		goto err_close;
+	if ((size_t) st.st_size < sizeof(*header)) {
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	trace->map_len = st.st_size;
+	trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace->map == MAP_FAILED)
+		goto err_close;
+	close(fd);
+	madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+
+	header = trace->map;
+	trace->records = (const uint64_t *) (header + 1);
+	trace->count = (trace->map_len - sizeof(*header)) / sizeof(*trace->records);
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+	    header->version != TRACE_VERSION || header->tick != ARRIVAL_TICK ||
+	    header->count != trace->count) {
+		munmap(trace->map, trace->map_len);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+
+err_close:
+	close(fd);
+	return -1;
+}
+
+int arrival_trace_close(struct arrival_trace_t *trace)
+{
+	int ret = 0;
+
+	if (trace->map)
+		ret = munmap(trace->map, trace->map_len);
+	if (trace->out) {
+		/* Now we know how many records there are. */
+		if (fflush(trace->out) || ferror(trace->out) ||
+		    fseek(trace->out, offsetof(struct trace_header, count), SEEK_SET) ||
+		    fwrite(&trace->written, sizeof(trace->written), 1, trace->out) != 1)
+			ret = -1;
+		if (fclose(trace->out))
+			ret = -1;
+	}
+	*trace = (struct arrival_trace_t) { 0 };
+	return ret;
+}
+
+/*
+ * Choose how many ticks to wait before the next arrival on a heading. The
+ * first vehicle can arrive immediately, but two vehicles with the same heading
+ * are always at least one tick apart.
+ *
+ * (rand() % RANGE) gives you bad random distribution, so we use a
+ * uniformly-distributed value in [0,1) and then multiply it to match the
+ * range.
+ */
+static uint64_t arrival_delay(struct arrival_gen_t *gen)
+{
+	uint64_t max_ticks = gen->max_gap / ARRIVAL_TICK;
+	double random = rng_double(gen->key, gen->draws++);
+
+	if (!gen->next_id)
+		/* No vehicle has arrived yet -- [0,max_gap]. */
+		return (1 + max_ticks) * random;
+	else
+		/* Last vehicle arrived just now -- [1,max_gap]. */
+		return 1 + (max_ticks * random);
+}
+
+int arrivals_init(struct arrivals_t *arrivals, const struct traffic_params *params,
+                  uint64_t stream)
+{
+	*arrivals = (struct arrivals_t) {
+		.remaining = params->num_vehicles,
+		.replay = params->replay,
+		.record = params->record,
+	};
+	wheel_init(&arrivals->wheel, 0);
+
+	if (!arrivals->replay && params->schedule) {
+		arrivals->schedule = malloc(sizeof(*arrivals->schedule));
+		if (!arrivals->schedule)
+			return -1;
+		if (schedule_init(arrivals->schedule, params->schedule, params, stream) < 0) {
+			free(arrivals->schedule);
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_LENGTH(arrivals->gens) &&
+	                   !arrivals->replay && !arrivals->schedule; i++) {
+		struct arrival_gen_t *gen = &arrivals->gens[i];
+
+		*gen = (struct arrival_gen_t) {
+			.heading = VALID_HEADINGS[i],
+			.max_gap = params->max_arrival_gap[VALID_HEADINGS[i]],
+			.key = rng_key(params->seed, stream * NUM_HEADINGS + VALID_HEADINGS[i]),
+		};
+
+		gen->timer.expires = TIME_TO_TICK(arrival_delay(gen));
+		wheel_add(&arrivals->wheel, &gen->timer);
+	}
+
+	arrivals->batch_cap = ARRAY_LENGTH(arrivals->gens);
+	arrivals->batch = malloc(arrivals->batch_cap * sizeof(*arrivals->batch));
+	if (!arrivals->batch)
+		return -1;
+	return 0;
+}
+
+void arrivals_free(struct arrivals_t *arrivals)
+{
+	if (arrivals->schedule) {
+		schedule_free(arrivals->schedule);
+		free(arrivals->schedule);
+		arrivals->schedule = NULL;
+	}
+	free(arrivals->batch);
+	arrivals->batch = NULL;
+}
+
+static int arrival_cmp(const void *a, const void *b)
+{
+	const struct arrival_t *x = a, *y = b;
+
+	if (x->when != y->when)
+		return x->when < y->when ? -1 : 1;
+	/* Break ties by heading, so batches don't depend on the wheel's order. */
+	return x->heading < y->heading ? -1 : x->heading > y->heading;
+}
+
+/* Append @arrival to the batch (of @len arrivals so far). */
+static void batch_push(struct arrivals_t *arrivals, size_t len, struct arrival_t arrival)
+{
+	if (len == arrivals->batch_cap) {
+		size_t newcap = 2 * arrivals->batch_cap;
+		struct arrival_t *newbatch;
+
+		newbatch = realloc(arrivals->batch, newcap * sizeof(*newbatch));
+		if (!newbatch)
+			bail("realloc(arrival batch) failed");
+		arrivals->batch = newbatch;
+		arrivals->batch_cap = newcap;
+	}
+	arrivals->batch[len] = arrival;
+}
+
+/* Take every record that is due at or before @now from the replayed trace. */
+static size_t replay_poll(struct arrivals_t *arrivals, simtime_t now)
+{
+	const struct arrival_trace_t *trace = arrivals->replay;
+	size_t len = 0, consumed;
+
+	while (arrivals->replay_pos < trace->count && (int) len < arrivals->remaining) {
+		uint64_t record = trace->records[arrivals->replay_pos];
+		heading_t heading = TRACE_HEADING(record);
+
+		if (TRACE_WHEN(record) > now)
+			break;
+		if (!HEADING_CONTROLLERS[heading] ||
+		    (arrivals->replay_pos && record < trace->records[arrivals->replay_pos - 1])) {
+			errno = EINVAL;
+			bail("arrival trace is corrupt at record %lu",
+			     (unsigned long) arrivals->replay_pos);
+		}
+		batch_push(arrivals, len++, (struct arrival_t) {
+			.when = TRACE_WHEN(record),
+			.heading = heading,
+			.id = arrivals->ids[heading]++,
+		});
+		arrivals->replay_pos++;
+	}
+
+	consumed = sizeof(struct trace_header) + arrivals->replay_pos * sizeof(uint64_t);
+	consumed -= consumed % TRACE_DROP_BYTES;
+	if (consumed > arrivals->replay_dropped) {
+		madvise((char *) trace->map + arrivals->replay_dropped,
+		        consumed - arrivals->replay_dropped, MADV_DONTNEED);
+		arrivals->replay_dropped = consumed;
+	}
+	return len;
+}
+
+/* Take every arrival that is due at or before @now from the schedule. */
+static size_t schedule_poll(struct arrivals_t *arrivals, simtime_t now)
+{
+	struct schedule_t *sched = arrivals->schedule;
+	size_t len = 0;
+
+	while ((int) len < arrivals->remaining && sched->when[sched->pos] <= now) {
+		batch_push(arrivals, len++, (struct arrival_t) {
+			.when = sched->when[sched->pos],
+			.heading = sched->heading[sched->pos],
+		});
+		if (++sched->pos == SCHEDULE_BATCH)
+			schedule_fill(sched);
+	}
+
+	/*
+	 * Simultaneous arrivals are handed out in heading order, as usual. The
+	 * schedule is in time order already, so an insertion sort only has the
+	 * ties to deal with.
+	 */
+	for (size_t i = 1; i < len; i++) {
+		struct arrival_t arrival = arrivals->batch[i];
+		size_t j = i;
+
+		for (; j && arrival_cmp(&arrival, &arrivals->batch[j - 1]) < 0; j--)
+			arrivals->batch[j] = arrivals->batch[j - 1];
+		arrivals->batch[j] = arrival;
+	}
+	for (size_t i = 0; i < len; i++)
+		arrivals->batch[i].id = arrivals->ids[arrivals->batch[i].heading]++;
+	return len;
+}
+
+size_t arrivals_poll(struct arrivals_t *arrivals, simtime_t now,
+                     struct arrival_t **batch)
+{
+	struct wheel_timer_t *fired;
+	size_t len = 0;
+
+	if (arrivals->remaining <= 0)
+		return 0;
+
+	if (arrivals->replay) {
+		len = replay_poll(arrivals, now);
+		goto out;
+	}
+	if (arrivals->schedule) {
+		len = schedule_poll(arrivals, now);
+		goto out;
+	}
+
+	fired = wheel_advance(&arrivals->wheel, TIME_TO_TICK(now));
+	while (fired) {
+		struct arrival_gen_t *gen = container_of(fired, struct arrival_gen_t, timer);
+		fired = fired->next;
+
+		/* A late poll might cover several arrivals from the same generator. */
+		while (gen->timer.expires <= TIME_TO_TICK(now)) {
+			batch_push(arrivals, len++, (struct arrival_t) {
+				.when = TICK_TO_TIME(gen->timer.expires),
+				.heading = gen->heading,
+				.id = gen->next_id++,
+			});
+			gen->timer.expires += arrival_delay(gen);
+		}
+		wheel_add(&arrivals->wheel, &gen->timer);
+	}
+	qsort(arrivals->batch, len, sizeof(*arrivals->batch), arrival_cmp);
+
+out:
+	if ((int) len > arrivals->remaining)
+		len = arrivals->remaining;
+	arrivals->remaining -= len;
+
+	for (size_t i = 0; i < len && arrivals->record; i += TRACE_WRITE_CHUNK) {
+		uint64_t records[TRACE_WRITE_CHUNK];
+		size_t n = len - i < TRACE_WRITE_CHUNK ? len - i : TRACE_WRITE_CHUNK;
+
+		for (size_t j = 0; j < n; j++)
+			records[j] = TRACE_RECORD(arrivals->batch[i + j].when,
+			                          arrivals->batch[i + j].heading);
+		if (fwrite(records, sizeof(*records), n, arrivals->record->out) != n)
+			bail("writing arrival trace failed");
+		arrivals->record->written += n;
+	}
+
+	*batch = arrivals->batch;
+	return len;
+}
+
+simtime_t arrivals_next(const struct arrivals_t *arrivals)
+{
+	uint64_t next;
+
+	if (arrivals->remaining <= 0)
+		return -1;
+	if (arrivals->replay)
+		return arrivals->replay_pos < arrivals->replay->count ?
+		       TRACE_WHEN(arrivals->replay->records[arrivals->replay_pos]) : -1;
+	if (arrivals->schedule)
+		return arrivals->schedule->when[arrivals->schedule->pos];
+	next = wheel_next(&arrivals->wheel);
+	return next == UINT64_MAX ? -1 : TICK_TO_TIME(next);
+}
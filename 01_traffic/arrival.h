@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARRIVAL_H
+#define ARRIVAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "eventq.h"
+#include "timerwheel.h"
+#include "traffic.h"
+
+/* Resolution of arrival times (1ms). */
+#define ARRIVAL_TICK	NSEC_PER_MSEC
+
+/* Arrival generator for a single heading. */
+struct arrival_gen_t {
+	heading_t heading;
+	/* Upper bound on the gap between two arrivals (in nanoseconds). */
+	simtime_t max_gap;
+	/* Next vehicle id for this heading. */
+	int next_id;
+	/*
+	 * Independent counter-based random stream (see rng.h), so headings don't
+	 * perturb each other, and how many values have been drawn from it.
+	 */
+	uint64_t key, draws;
+	/* Fires when the next vehicle arrives. */
+	struct wheel_timer_t timer;
+};
+
+/* A single vehicle arrival. */
+struct arrival_t {
+	simtime_t when;
+	heading_t heading;
+	int id;
+};
+
+/*
+ * A binary trace of arrivals (see arrival.c for the format), either being
+ * recorded or mapped for replay. Replaying a trace reproduces exactly the same
+ * workload regardless of the seed, the engine or the arrival rate.
+ */
+struct arrival_trace_t {
+	/* Replay -- the whole file is mapped read-only. */
+	void *map;
+	size_t map_len;
+	const uint64_t *records;
+	uint64_t count;
+	/* Recording. */
+	FILE *out;
+	uint64_t written;
+};
+
+/* Create a trace at @path to record arrivals to. */
+int arrival_trace_create(struct arrival_trace_t *trace, const char *path);
+/* Map the trace at @path for replay. */
+int arrival_trace_open(struct arrival_trace_t *trace, const char *path);
+/* Finish recording (or unmap) the trace. */
+int arrival_trace_close(struct arrival_trace_t *trace);
+
+struct schedule_t;
+
+/*
+ * The arrival subsystem. There is one independent generator for each of
+ * VALID_HEADINGS, and all of them are driven by a single timer wheel. A long
+ * gap on one heading therefore doesn't hold up arrivals on any other, and all
+ * of the arrivals that are due at the same tick are handed out as one batch.
+ */
+struct arrivals_t {
+	struct timerwheel_t wheel;
+	struct arrival_gen_t gens[NUM_VALID_HEADINGS];
+	/* How many vehicles are still to arrive? */
+	int remaining;
+	/* Buffer returned by arrivals_poll(). */
+	struct arrival_t *batch;
+	size_t batch_cap;
+
+	/*
+	 * If ->replay is set, arrivals come from the trace rather than the
+	 * generators (with our own position in it, so a trace can be replayed by
+	 * several arrivals_t at once), and if ->schedule is set, they come from
+	 * that (see schedule.h). Every arrival handed out is also appended to
+	 * ->record, if set.
+	 */
+	const struct arrival_trace_t *replay;
+	uint64_t replay_pos, replay_dropped;
+	struct schedule_t *schedule;
+	/* Next vehicle id for each heading, for a trace or a schedule. */
+	int ids[NUM_HEADINGS];
+	struct arrival_trace_t *record;
+};
+
+/*
+ * Set up the generators of stream @stream (one for each intersection), seeded
+ * from params->seed, or the schedule in @params, or replay and record the
+ * traces in @params.
+ */
+int arrivals_init(struct arrivals_t *arrivals, const struct traffic_params *params,
+                  uint64_t stream);
+void arrivals_free(struct arrivals_t *arrivals);
+
+/*
+ * Collect every arrival that is due at or before @now, ordered by arrival time
+ * (and VALID_HEADINGS order for simultaneous arrivals). The returned batch is
+ * owned by @arrivals and is only valid until the next call.
+ */
+size_t arrivals_poll(struct arrivals_t *arrivals, simtime_t now,
+                     struct arrival_t **batch);
+
+/*
+ * When should arrivals_poll() next be called? This is a lower bound -- the
+ * poll may come back empty. Returns -1 once all of the vehicles have arrived.
+ */
+simtime_t arrivals_next(const struct arrivals_t *arrivals);
+
+#endif /* !ARRIVAL_H */
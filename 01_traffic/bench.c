@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks for the synchronisation primitives in sync.c. This is built
+ * once per signal_mailbox_t implementation (bench-condvar and bench-futex),
+ * and prints one "key=value" line per result so that runs can be compared
+ * (and tracked over time with nothing more than grep and awk).
+ *
+ * Benchmarks that scale with the number of threads are run over a sweep of
+ * thread counts. Those that split a fixed amount of work between the threads
+ * (the arcsem_t ones) report the total across all of them.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sync.h"
+#include "timeutil.h"
+#include "traffic.h"
+
+#ifdef MAILBOX_FUTEX
+#	define MAILBOX_IMPL "futex"
+#else
+#	define MAILBOX_IMPL "condvar"
+#endif
+
+/* Thread counts to sweep over (capped per benchmark). */
+static const int THREAD_COUNTS[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+
+#define MAX_ADMIT_VEHICLES	16
+#define MAX_CHURN_THREADS	64
+#define MAX_BARRIER_THREADS	256
+
+static void report(const char *bench, int threads, long iters, int64_t elapsed)
+{
+	printf("impl=%s bench=%s threads=%d iters=%ld ns_per_op=%.1f ops_per_sec=%.0f\n",
+	       MAILBOX_IMPL, bench, threads, iters, (double) elapsed / iters,
+	       iters * (double) NSEC_PER_SEC / elapsed);
+	fflush(stdout);
+}
+
+/*
+ * Ping-pong: two threads bounce a signal between two mailboxes, so each
+ * iteration is two complete signal -> wait_lock -> unlock handoffs. This
+ * measures the handoff latency.
+ */
+static signal_mailbox_t ping = SIGNAL_MAILBOX_INITIALIZER;
+static signal_mailbox_t pong = SIGNAL_MAILBOX_INITIALIZER;
+
+static void *pingpong_start(void *arg)
+{
+	long iters = *(long *) arg;
+
+	for (long i = 0; i < iters; i++) {
+		mailbox_wait_lock(&ping);
+		mailbox_unlock(&ping);
+		mailbox_signal(&pong, NULL);
+	}
+	return NULL;
+}
+
+static void bench_pingpong(long iters)
+{
+	pthread_t thread;
+	int64_t start;
+
+	if ((errno = pthread_create(&thread, NULL, pingpong_start, &iters)))
+		bail("pthread_create(pingpong) failed");
+
+	start = monotonic_now();
+	for (long i = 0; i < iters; i++) {
+		mailbox_signal(&ping, NULL);
+		mailbox_wait_lock(&pong);
+		mailbox_unlock(&pong);
+	}
+	/* Each iteration is two one-way handoffs. */
+	report("pingpong", 2, 2 * iters, monotonic_now() - start);
+
+	pthread_join(thread, NULL);
+}
+
+/*
+ * Admission: the light_start() crossing loop against a number of vehicle
+ * threads contending for one lane. Each iteration takes a receipt from the
+ * pool, signals the lane and waits for a vehicle to go through. This measures the
+ * throughput of a single green lane. With a platoon, each signal lets that many
+ * vehicles through before the controller is woken up (light_start() with -P).
+ *
+ * Every vehicle goes straight back to the lane once it's through, so how long
+ * each admission waited shows how fairly the lane is shared -- with perfect
+ * FIFO admission (mailbox_wait_fifo(), traffic -F) every wait is the same
+ * nvehicles handoffs, while an unfair lane has a long tail.
+ */
+#define ADMIT_PLATOON	8
+
+static signal_mailbox_t lane = SIGNAL_MAILBOX_INITIALIZER;
+static arcsem_pool_t receipts = ARCSEM_POOL_INITIALIZER;
+static bool admit_stop;
+static int admit_alive;
+/* How long each admission waited for the lane (the first admit_cap of them). */
+static int64_t *admit_waits;
+static long admit_count, admit_cap;
+
+static void *admit_start(void *arg)
+{
+	bool fifo = *(bool *) arg;
+
+	for (;;) {
+		int64_t start = monotonic_now();
+		long i;
+
+		if (fifo)
+			mailbox_wait_fifo(&lane);
+		else
+			mailbox_wait_lock(&lane);
+		i = __atomic_fetch_add(&admit_count, 1, __ATOMIC_RELAXED);
+		if (i < admit_cap)
+			admit_waits[i] = monotonic_now() - start;
+		if (fifo)
+			mailbox_release(&lane);
+		else
+			mailbox_unlock(&lane);
+		if (__atomic_load_n(&admit_stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+	__atomic_sub_fetch(&admit_alive, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int compare_waits(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Print the distribution of the @n waits in admit_waits (sorting them). */
+static void report_waits(const char *bench, int threads, long n)
+{
+	if (n > admit_cap)
+		n = admit_cap;
+	qsort(admit_waits, n, sizeof(*admit_waits), compare_waits);
+	printf("impl=%s bench=%s threads=%d waits=%ld p50_wait_ns=%" PRId64
+	       " p99_wait_ns=%" PRId64 " max_wait_ns=%" PRId64 "\n",
+	       MAILBOX_IMPL, bench, threads, n, admit_waits[n / 2], admit_waits[n * 99 / 100],
+	       admit_waits[n - 1]);
+	fflush(stdout);
+}
+
+static void bench_admit(const char *bench, int nvehicles, long iters, unsigned int platoon,
+                        bool fifo)
+{
+	pthread_t *vehicles = calloc(nvehicles, sizeof(*vehicles));
+	int64_t start;
+
+	admit_cap = iters;
+	admit_waits = calloc(admit_cap, sizeof(*admit_waits));
+	if (!vehicles || !admit_waits)
+		bail("calloc(vehicles) failed");
+
+	admit_stop = false;
+	admit_alive = nvehicles;
+	admit_count = 0;
+	for (int i = 0; i < nvehicles; i++)
+		if ((errno = pthread_create(&vehicles[i], NULL, admit_start, &fifo)))
+			bail("pthread_create(vehicle[%d]) failed", i);
+
+	start = monotonic_now();
+	for (long i = 0; i < iters; i += platoon) {
+		arcsem_t *receipt = arcsem_pool_get(&receipts);
+		if (!receipt)
+			bail("arcsem_pool_get failed");
+		mailbox_signal_many(&lane, receipt, iters - i < platoon ? iters - i : platoon);
+		while (sem_wait(&receipt->inner) < 0 && errno == EINTR)
+			;
+		arcsem_put(receipt);
+	}
+	report(bench, nvehicles + 1, iters, monotonic_now() - start);
+	report_waits(bench, nvehicles + 1, __atomic_load_n(&admit_count, __ATOMIC_RELAXED));
+
+	/* Keep signalling until every vehicle has noticed it should stop. */
+	__atomic_store_n(&admit_stop, true, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&admit_alive, __ATOMIC_ACQUIRE) > 0) {
+		mailbox_signal(&lane, NULL);
+		sched_yield();
+	}
+	for (int i = 0; i < nvehicles; i++)
+		pthread_join(vehicles[i], NULL);
+	mailbox_retract(&lane);
+	arcsem_pool_drain(&receipts);
+	free(admit_waits);
+	free(vehicles);
+}
+
+/*
+ * Run @fn on @nthreads threads at once, returning how long it took from the
+ * moment the first one was released until the last one finished. Each thread
+ * has to call bench_go() before starting and bench_done() once it's finished.
+ * The threads take their own timestamps, because with fewer CPUs than threads
+ * the main thread might only be scheduled once the work is already done.
+ */
+static barrier_t start_line;
+static int64_t first_start, last_end;
+
+static void bench_go(void)
+{
+	int64_t now, old;
+
+	barrier_wait(&start_line);
+	now = monotonic_now();
+	old = __atomic_load_n(&first_start, __ATOMIC_RELAXED);
+	while (now < old && !__atomic_compare_exchange_n(&first_start, &old, now, true,
+	                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void bench_done(void)
+{
+	int64_t now = monotonic_now(), old;
+
+	old = __atomic_load_n(&last_end, __ATOMIC_RELAXED);
+	while (now > old && !__atomic_compare_exchange_n(&last_end, &old, now, true,
+	                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static int64_t run_threads(int nthreads, void *(*fn)(void *), void *arg)
+{
+	pthread_t *threads = calloc(nthreads, sizeof(*threads));
+
+	if (!threads)
+		bail("calloc(threads) failed");
+
+	first_start = INT64_MAX;
+	last_end = 0;
+	if (barrier_init(&start_line, nthreads) < 0)
+		bail("barrier_init(start_line) failed");
+	for (int i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, fn, arg)))
+			bail("pthread_create(thread[%d]) failed", i);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	barrier_destroy(&start_line);
+	free(threads);
+	return last_end - first_start;
+}
+
+/*
+ * Barriers: every thread goes through the same barrier over and over again.
+ * This measures the cost of one round across all of the threads, for each of
+ * the implementations ("barrier" is the original condvar one).
+ */
+struct barrier_arg {
+	void *barrier;
+	long rounds;
+};
+
+#define BARRIER_BENCH(name, type)												\
+static void *type##_start(void *arg)											\
+{																				\
+	struct barrier_arg *args = arg;												\
+																				\
+	bench_go();																	\
+	for (long i = 0; i < args->rounds; i++)										\
+		type##_wait(args->barrier);												\
+	bench_done();																\
+	return NULL;																\
+}																				\
+																				\
+static void bench_##type(int nthreads, long rounds)								\
+{																				\
+	type##_t barrier;															\
+	struct barrier_arg args = {													\
+		.barrier = &barrier,													\
+		.rounds = rounds,														\
+	};																			\
+																				\
+	if (type##_init(&barrier, nthreads) < 0)									\
+		bail(#type "_init failed");												\
+	report(name, nthreads, rounds, run_threads(nthreads, type##_start, &args));	\
+	type##_destroy(&barrier);													\
+}
+
+BARRIER_BENCH("barrier", condvar_barrier)
+BARRIER_BENCH("barrier_sense", sense_barrier)
+BARRIER_BENCH("barrier_tree", tree_barrier)
+
+/*
+ * arcsem_t churn, split evenly between the threads:
+ *
+ *  - "arcsem_new": arcsem_new(), arcsem_get() and two arcsem_put()s (the
+ *    lifecycle of a receipt before pooling), so this is mostly malloc().
+ *  - "arcsem_pool": the same lifecycle with a per-thread arcsem_pool_t.
+ *  - "arcsem_shared": arcsem_get() and arcsem_put() on one semaphore shared by
+ *    every thread, which measures contention on the reference count.
+ */
+struct churn_arg {
+	long iters;
+	arcsem_t *shared;
+};
+
+static void *churn_new_start(void *arg)
+{
+	struct churn_arg *args = arg;
+
+	bench_go();
+	for (long i = 0; i < args->iters; i++) {
+		arcsem_t *sem = arcsem_new(0);
+		if (!sem)
+			bail("arcsem_new failed");
+		arcsem_put(arcsem_get(sem));
+		arcsem_put(sem);
+	}
+	bench_done();
+	return NULL;
+}
+
+static void *churn_pool_start(void *arg)
+{
+	struct churn_arg *args = arg;
+	arcsem_pool_t pool = ARCSEM_POOL_INITIALIZER;
+
+	bench_go();
+	for (long i = 0; i < args->iters; i++) {
+		arcsem_t *sem = arcsem_pool_get(&pool);
+		if (!sem)
+			bail("arcsem_pool_get failed");
+		arcsem_put(arcsem_get(sem));
+		arcsem_put(sem);
+	}
+	bench_done();
+	arcsem_pool_drain(&pool);
+	return NULL;
+}
+
+static void *churn_shared_start(void *arg)
+{
+	struct churn_arg *args = arg;
+
+	bench_go();
+	for (long i = 0; i < args->iters; i++)
+		arcsem_put(arcsem_get(args->shared));
+	bench_done();
+	return NULL;
+}
+
+static void bench_churn(const char *bench, void *(*fn)(void *), int nthreads, long iters)
+{
+	struct churn_arg args = {
+		.iters = iters / nthreads,
+		.shared = arcsem_new(0),
+	};
+
+	if (!args.shared)
+		bail("arcsem_new(shared) failed");
+	report(bench, nthreads, args.iters * nthreads, run_threads(nthreads, fn, &args));
+	arcsem_put(args.shared);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-b <bench>]... [<iterations>]\n", argv0);
+	fprintf(stderr, "  -b  only run the given benchmark (pingpong, admit, admit_platoon,\n"
+	                "      admit_fifo, barrier, barrier_sense, barrier_tree, arcsem_new,\n"
+	                "      arcsem_pool or arcsem_shared)\n");
+	exit(1);
+}
+
+static const char *BENCHES[] = {
+	"pingpong", "admit", "admit_platoon", "admit_fifo", "barrier", "barrier_sense",
+	"barrier_tree", "arcsem_new", "arcsem_pool", "arcsem_shared",
+};
+
+int main(int argc, char **argv)
+{
+	long iters = 200000;
+	bool selected[ARRAY_LENGTH(BENCHES)] = { 0 }, any_selected = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		size_t i;
+
+		switch (opt) {
+		case 'b':
+			for (i = 0; i < ARRAY_LENGTH(BENCHES); i++)
+				if (!strcmp(optarg, BENCHES[i]))
+					break;
+			if (i == ARRAY_LENGTH(BENCHES))
+				usage(argv[0]);
+			selected[i] = any_selected = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		iters = atol(argv[optind]);
+	if (iters < 1)
+		usage(argv[0]);
+	if (!any_selected)
+		for (size_t i = 0; i < ARRAY_LENGTH(selected); i++)
+			selected[i] = true;
+
+	if (selected[0])
+		bench_pingpong(iters);
+	for (size_t i = 0; i < ARRAY_LENGTH(THREAD_COUNTS); i++) {
+		int nthreads = THREAD_COUNTS[i];
+
+		if (nthreads > MAX_ADMIT_VEHICLES)
+			break;
+		if (selected[1])
+			bench_admit("admit", nthreads, iters, 1, false);
+		if (selected[2])
+			bench_admit("admit_platoon", nthreads, iters, ADMIT_PLATOON, false);
+		if (selected[3])
+			bench_admit("admit_fifo", nthreads, iters, 1, true);
+	}
+	/* Every barrier round wakes up every thread, so use fewer rounds. */
+	for (size_t i = 0; i < ARRAY_LENGTH(THREAD_COUNTS); i++) {
+		int nthreads = THREAD_COUNTS[i];
+
+		long rounds = iters / 100 ? iters / 100 : 1;
+
+		if (nthreads < 2 || nthreads > MAX_BARRIER_THREADS)
+			continue;
+		if (selected[4])
+			bench_condvar_barrier(nthreads, rounds);
+		if (selected[5])
+			bench_sense_barrier(nthreads, rounds);
+		if (selected[6])
+			bench_tree_barrier(nthreads, rounds);
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(THREAD_COUNTS); i++) {
+		int nthreads = THREAD_COUNTS[i];
+
+		if (nthreads > MAX_CHURN_THREADS || nthreads > iters)
+			break;
+		if (selected[7])
+			bench_churn("arcsem_new", churn_new_start, nthreads, iters);
+		if (selected[8])
+			bench_churn("arcsem_pool", churn_pool_start, nthreads, iters);
+		if (selected[9])
+			bench_churn("arcsem_shared", churn_shared_start, nthreads, iters);
+	}
+	return 0;
+}
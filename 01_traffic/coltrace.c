@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Columnar event trace writer and reader (see coltrace.h for the format). */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coltrace.h"
+
+/* How wide is each column (unpacked)? */
+static const size_t COLUMN_WIDTH[NUM_COLTRACE_COLUMNS] = {
+	[COLTRACE_WHEN] = sizeof(int64_t),
+	[COLTRACE_THREAD] = sizeof(uint32_t),
+	[COLTRACE_ID] = sizeof(int32_t),
+	[COLTRACE_HEADING0] = sizeof(uint8_t),
+	[COLTRACE_HEADING1] = sizeof(uint8_t),
+};
+
+/* A packed varint is at most this long. */
+#define VARINT_MAX	10
+
+static int64_t column_get(const struct coltrace_event_t *event, int column)
+{
+	switch (column) {
+	case COLTRACE_WHEN:
+		return event->when;
+	case COLTRACE_THREAD:
+		return event->thread;
+	case COLTRACE_ID:
+		return event->id;
+	case COLTRACE_HEADING0:
+		return event->heading[0];
+	case COLTRACE_HEADING1:
+		return event->heading[1];
+	}
+	return 0;
+}
+
+static void column_set(struct coltrace_event_t *event, int column, int64_t value)
+{
+	switch (column) {
+	case COLTRACE_WHEN:
+		event->when = value;
+		break;
+	case COLTRACE_THREAD:
+		event->thread = value;
+		break;
+	case COLTRACE_ID:
+		event->id = value;
+		break;
+	case COLTRACE_HEADING0:
+		event->heading[0] = value;
+		break;
+	case COLTRACE_HEADING1:
+		event->heading[1] = value;
+		break;
+	}
+}
+
+static size_t put_varint(uint8_t *buf, int64_t value)
+{
+	/* Zigzag, so that small negative deltas stay short too. */
+	uint64_t zz = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+	size_t len = 0;
+
+	do {
+		buf[len++] = (zz & 0x7f) | (zz > 0x7f ? 0x80 : 0);
+		zz >>= 7;
+	} while (zz);
+	return len;
+}
+
+static size_t get_varint(const uint8_t *buf, size_t size, int64_t *value)
+{
+	uint64_t zz = 0;
+
+	for (size_t len = 0; len < size && len < VARINT_MAX; len++) {
+		zz |= (uint64_t) (buf[len] & 0x7f) << (7 * len);
+		if (!(buf[len] & 0x80)) {
+			*value = (int64_t) (zz >> 1) ^ -(int64_t) (zz & 1);
+			return len + 1;
+		}
+	}
+	return 0;
+}
+
+static int grow(uint8_t **buf, size_t *cap, size_t size)
+{
+	uint8_t *newbuf;
+
+	if (size <= *cap)
+		return 0;
+	newbuf = realloc(*buf, size);
+	if (!newbuf)
+		return -1;
+	*buf = newbuf;
+	*cap = size;
+	return 0;
+}
+
+int coltrace_writer_init(struct coltrace_writer_t *writer, FILE *out, uint32_t flags,
+                         const uint8_t columns[COLTRACE_MAX_TYPES])
+{
+	struct coltrace_header_t header = {
+		.version = COLTRACE_VERSION,
+		.flags = flags,
+	};
+
+	*writer = (struct coltrace_writer_t) {
+		.out = out,
+		.flags = flags,
+	};
+	memcpy(writer->columns, columns, sizeof(writer->columns));
+	memcpy(header.magic, COLTRACE_MAGIC, sizeof(header.magic));
+	return fwrite(&header, sizeof(header), 1, out) == 1 ? 0 : -1;
+}
+
+int coltrace_writer_add(struct coltrace_writer_t *writer, const struct coltrace_event_t *event)
+{
+	struct coltrace_events_t *pending;
+
+	if (event->type >= COLTRACE_MAX_TYPES) {
+		errno = EINVAL;
+		return -1;
+	}
+	pending = &writer->pending[event->type];
+	if (pending->count == pending->cap) {
+		size_t newcap = pending->cap ? 2 * pending->cap : 1024;
+		struct coltrace_event_t *newevents;
+
+		newevents = realloc(pending->events, newcap * sizeof(*newevents));
+		if (!newevents)
+			return -1;
+		pending->events = newevents;
+		pending->cap = newcap;
+	}
+	pending->events[pending->count++] = *event;
+
+	if (++writer->npending >= COLTRACE_BLOCK_EVENTS)
+		return coltrace_writer_flush(writer);
+	return 0;
+}
+
+/* Lay out the columns of @pending (with @columns) in writer->buf. */
+static size_t encode_section(struct coltrace_writer_t *writer,
+                             const struct coltrace_events_t *pending, uint8_t columns)
+{
+	size_t size = 0;
+
+	for (int column = 0; column < NUM_COLTRACE_COLUMNS; column++) {
+		int64_t prev = 0;
+
+		if (!(columns & COLTRACE_COLUMN(column)))
+			continue;
+		for (size_t i = 0; i < pending->count; i++) {
+			int64_t value = column_get(&pending->events[i], column);
+			uint8_t *out = writer->buf + size;
+
+			if (writer->flags & COLTRACE_PACKED) {
+				size += put_varint(out, value - prev);
+				prev = value;
+				continue;
+			}
+			switch (COLUMN_WIDTH[column]) {
+			case sizeof(uint8_t):
+				*out = value;
+				break;
+			case sizeof(uint32_t):
+				memcpy(out, &(uint32_t) { value }, sizeof(uint32_t));
+				break;
+			case sizeof(uint64_t):
+				memcpy(out, &(uint64_t) { value }, sizeof(uint64_t));
+				break;
+			}
+			size += COLUMN_WIDTH[column];
+		}
+	}
+	return size;
+}
+
+int coltrace_writer_flush(struct coltrace_writer_t *writer)
+{
+	struct coltrace_block_t block = { .magic = COLTRACE_BLOCK_MAGIC };
+
+	if (!writer->npending)
+		return 0;
+	for (int type = 0; type < COLTRACE_MAX_TYPES; type++)
+		if (writer->pending[type].count)
+			block.nsections++;
+	if (fwrite(&block, sizeof(block), 1, writer->out) != 1)
+		return -1;
+
+	for (int type = 0; type < COLTRACE_MAX_TYPES; type++) {
+		struct coltrace_events_t *pending = &writer->pending[type];
+		struct coltrace_section_t section = {
+			.type = type,
+			.columns = writer->columns[type],
+			.count = pending->count,
+		};
+
+		if (!pending->count)
+			continue;
+		/* Enough for the widest encoding of every column. */
+		if (grow(&writer->buf, &writer->buf_cap,
+		         pending->count * NUM_COLTRACE_COLUMNS * VARINT_MAX) < 0)
+			return -1;
+		section.size = encode_section(writer, pending, section.columns);
+		if (fwrite(&section, sizeof(section), 1, writer->out) != 1 ||
+		    fwrite(writer->buf, 1, section.size, writer->out) != section.size)
+			return -1;
+		pending->count = 0;
+	}
+	writer->npending = 0;
+	return 0;
+}
+
+int coltrace_writer_finish(struct coltrace_writer_t *writer)
+{
+	int ret = coltrace_writer_flush(writer);
+
+	if (fflush(writer->out) == EOF)
+		ret = -1;
+	for (int type = 0; type < COLTRACE_MAX_TYPES; type++)
+		free(writer->pending[type].events);
+	free(writer->buf);
+	*writer = (struct coltrace_writer_t) { 0 };
+	return ret;
+}
+
+int coltrace_reader_init(struct coltrace_reader_t *reader, FILE *in)
+{
+	*reader = (struct coltrace_reader_t) { .in = in };
+	if (fread(&reader->header, sizeof(reader->header), 1, in) != 1 ||
+	    memcmp(reader->header.magic, COLTRACE_MAGIC, sizeof(reader->header.magic)) ||
+	    reader->header.version != COLTRACE_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Decode the columns of @section (in reader->buf) into @events. */
+static int decode_section(struct coltrace_reader_t *reader,
+                          const struct coltrace_section_t *section,
+                          struct coltrace_event_t *events)
+{
+	size_t pos = 0;
+
+	for (size_t i = 0; i < section->count; i++)
+		events[i] = (struct coltrace_event_t) { .type = section->type };
+
+	for (int column = 0; column < NUM_COLTRACE_COLUMNS; column++) {
+		int64_t value = 0;
+
+		if (!(section->columns & COLTRACE_COLUMN(column)))
+			continue;
+		for (size_t i = 0; i < section->count; i++) {
+			const uint8_t *in = reader->buf + pos;
+
+			if (reader->header.flags & COLTRACE_PACKED) {
+				int64_t delta;
+				size_t len = get_varint(in, section->size - pos, &delta);
+
+				if (!len)
+					return -1;
+				value += delta;
+				pos += len;
+				column_set(&events[i], column, value);
+				continue;
+			}
+			if (section->size - pos < COLUMN_WIDTH[column])
+				return -1;
+			switch (COLUMN_WIDTH[column]) {
+			case sizeof(uint8_t):
+				value = *in;
+				break;
+			case sizeof(uint32_t): {
+				uint32_t raw;
+				memcpy(&raw, in, sizeof(raw));
+				value = column == COLTRACE_ID ? (int64_t) (int32_t) raw : raw;
+				break;
+			}
+			case sizeof(uint64_t):
+				memcpy(&value, in, sizeof(value));
+				break;
+			}
+			pos += COLUMN_WIDTH[column];
+			column_set(&events[i], column, value);
+		}
+	}
+	return pos == section->size ? 0 : -1;
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+	const struct coltrace_event_t *x = a, *y = b;
+
+	if (x->when != y->when)
+		return x->when < y->when ? -1 : 1;
+	/* Simultaneous events of one thread are in type order. */
+	return (x->type > y->type) - (x->type < y->type);
+}
+
+ssize_t coltrace_reader_block(struct coltrace_reader_t *reader,
+                              struct coltrace_event_t **events, size_t *cap)
+{
+	struct coltrace_block_t block;
+	size_t count = 0;
+
+	if (fread(&block, sizeof(block), 1, reader->in) != 1)
+		return feof(reader->in) ? 0 : -1;
+	if (block.magic != COLTRACE_BLOCK_MAGIC)
+		goto corrupt;
+
+	for (uint32_t i = 0; i < block.nsections; i++) {
+		struct coltrace_section_t section;
+
+		if (fread(&section, sizeof(section), 1, reader->in) != 1 ||
+		    section.type >= COLTRACE_MAX_TYPES)
+			goto corrupt;
+		if (count + section.count > *cap) {
+			size_t newcap = 2 * (count + section.count);
+			struct coltrace_event_t *newevents = realloc(*events, newcap * sizeof(*newevents));
+
+			if (!newevents)
+				return -1;
+			*events = newevents;
+			*cap = newcap;
+		}
+		if (grow(&reader->buf, &reader->buf_cap, section.size) < 0)
+			return -1;
+		if (fread(reader->buf, 1, section.size, reader->in) != section.size ||
+		    decode_section(reader, &section, *events + count) < 0)
+			goto corrupt;
+		count += section.count;
+	}
+
+	qsort(*events, count, sizeof(**events), event_cmp);
+	return count;
+
+corrupt:
+	errno = EINVAL;
+	return -1;
+}
+
+void coltrace_reader_free(struct coltrace_reader_t *reader)
+{
+	free(reader->buf);
+	*reader = (struct coltrace_reader_t) { 0 };
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COLTRACE_H
+#define COLTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Columnar event trace (traffic -L coltrace), for offline analysis of runs far
+ * too big to pick apart from the text narration -- see tracejson.c for turning
+ * one into a Chrome trace.
+ *
+ * A trace is a header followed by blocks of events. Each block covers a stretch
+ * of the run, and holds one section per event type with each field of that
+ * type stored as its own fixed-width column (so, for instance, the timestamps
+ * of every arrival in a block are one contiguous array). Only the fields that
+ * the event type uses have a column, as given by the section's column mask.
+ *
+ * With COLTRACE_PACKED, every column is instead delta-coded (zigzag varints of
+ * the difference from the previous value), which is what takes the space out
+ * of timestamps and identifiers that only ever creep upwards.
+ *
+ * Everything is in host byte order.
+ */
+#define COLTRACE_MAGIC		"COLTRACE"
+#define COLTRACE_VERSION	1
+#define COLTRACE_BLOCK_MAGIC	0x4b4c4254U	/* "TBLK" */
+
+/* How many event types can a trace hold? */
+#define COLTRACE_MAX_TYPES	16
+/* How many events are gathered before a block is written out? */
+#define COLTRACE_BLOCK_EVENTS	65536
+
+/* Header flags. */
+#define COLTRACE_PACKED		(1U << 0)
+
+enum coltrace_column_t {
+	/* int64_t: nanoseconds since the start of the run. */
+	COLTRACE_WHEN,
+	/* uint32_t: which thread logged the event. */
+	COLTRACE_THREAD,
+	/* int32_t: the event's identifier (see log.h). */
+	COLTRACE_ID,
+	/* uint8_t: the event's heading(s). */
+	COLTRACE_HEADING0,
+	COLTRACE_HEADING1,
+	NUM_COLTRACE_COLUMNS,
+};
+#define COLTRACE_COLUMN(column)	(1U << (column))
+
+struct coltrace_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+};
+
+struct coltrace_block_t {
+	uint32_t magic;
+	/* How many sections (event types with any events) follow? */
+	uint32_t nsections;
+};
+
+struct coltrace_section_t {
+	uint8_t type;
+	/* Which columns follow (a mask of COLTRACE_COLUMN()), in column order. */
+	uint8_t columns;
+	uint16_t reserved;
+	/* How many events, and how many bytes of columns? */
+	uint32_t count;
+	uint64_t size;
+};
+
+/* One event, as handed to the writer and back out of the reader. */
+struct coltrace_event_t {
+	int64_t when;
+	uint32_t thread;
+	int32_t id;
+	uint8_t type;
+	uint8_t heading[2];
+};
+
+struct coltrace_writer_t {
+	FILE *out;
+	uint32_t flags;
+	/* Which columns does each event type have? */
+	uint8_t columns[COLTRACE_MAX_TYPES];
+	/* The block being gathered, one set of columns per event type. */
+	struct coltrace_events_t {
+		struct coltrace_event_t *events;
+		size_t count, cap;
+	} pending[COLTRACE_MAX_TYPES];
+	size_t npending;
+	/* Scratch space for encoding a section. */
+	uint8_t *buf;
+	size_t buf_cap;
+};
+
+/*
+ * Start writing a trace (with @flags) to @out, where @columns gives the mask of
+ * columns to store for each event type. Returns -1 if the header couldn't be
+ * written.
+ */
+int coltrace_writer_init(struct coltrace_writer_t *writer, FILE *out, uint32_t flags,
+                         const uint8_t columns[COLTRACE_MAX_TYPES]);
+/* Add an event, writing out a block if enough have been gathered. */
+int coltrace_writer_add(struct coltrace_writer_t *writer, const struct coltrace_event_t *event);
+/* Write out whatever has been gathered as a (short) block. */
+int coltrace_writer_flush(struct coltrace_writer_t *writer);
+/* Flush and free the writer (@out is left open). */
+int coltrace_writer_finish(struct coltrace_writer_t *writer);
+
+struct coltrace_reader_t {
+	FILE *in;
+	struct coltrace_header_t header;
+	uint8_t *buf;
+	size_t buf_cap;
+};
+
+/* Start reading the trace from @in, checking its header. */
+int coltrace_reader_init(struct coltrace_reader_t *reader, FILE *in);
+/*
+ * Read the next block into *@events (grown as needed, *@cap is its size),
+ * sorted by time. Returns the number of events, 0 at the end of the trace, or
+ * -1 (with errno set) if the trace is corrupt.
+ */
+ssize_t coltrace_reader_block(struct coltrace_reader_t *reader,
+                              struct coltrace_event_t **events, size_t *cap);
+void coltrace_reader_free(struct coltrace_reader_t *reader);
+
+#endif /* !COLTRACE_H */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Binary-heap event queue for the virtual-time engine. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "eventq.h"
+
+#define EVENTQ_INITIAL_CAP 64
+
+/* Is @a strictly earlier than @b? */
+static bool event_before(const struct event_t *a, const struct event_t *b)
+{
+	if (a->when != b->when)
+		return a->when < b->when;
+	return a->seq < b->seq;
+}
+
+static void event_swap(struct event_t *a, struct event_t *b)
+{
+	struct event_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+int eventq_init(struct eventq_t *queue)
+{
+	*queue = (struct eventq_t) { 0 };
+
+	queue->heap = malloc(EVENTQ_INITIAL_CAP * sizeof(*queue->heap));
+	if (!queue->heap)
+		return -1;
+	queue->cap = EVENTQ_INITIAL_CAP;
+	return 0;
+}
+
+void eventq_free(struct eventq_t *queue)
+{
+	free(queue->heap);
+	*queue = (struct eventq_t) { 0 };
+}
+
+int eventq_push(struct eventq_t *queue, simtime_t when, int type, void *data)
+{
+	size_t idx;
+
+	if (queue->len == queue->cap) {
+		size_t newcap = 2 * queue->cap;
+		struct event_t *newheap;
+
+		newheap = realloc(queue->heap, newcap * sizeof(*newheap));
+		if (!newheap)
+			return -1;
+		queue->heap = newheap;
+		queue->cap = newcap;
+	}
+
+	idx = queue->len++;
+	queue->heap[idx] = (struct event_t) {
+		.when = when,
+		.seq = queue->seq++,
+		.type = type,
+		.data = data,
+	};
+
+	/* Sift up. */
+	while (idx > 0) {
+		size_t parent = (idx - 1) / 2;
+		if (!event_before(&queue->heap[idx], &queue->heap[parent]))
+			break;
+		event_swap(&queue->heap[idx], &queue->heap[parent]);
+		idx = parent;
+	}
+	return 0;
+}
+
+bool eventq_pop(struct eventq_t *queue, struct event_t *event)
+{
+	size_t idx = 0;
+
+	if (!queue->len)
+		return false;
+
+	*event = queue->heap[0];
+	queue->heap[0] = queue->heap[--queue->len];
+
+	/* Sift down. */
+	for (;;) {
+		size_t left = 2*idx + 1, right = 2*idx + 2, min = idx;
+
+		if (left < queue->len && event_before(&queue->heap[left], &queue->heap[min]))
+			min = left;
+		if (right < queue->len && event_before(&queue->heap[right], &queue->heap[min]))
+			min = right;
+		if (min == idx)
+			break;
+		event_swap(&queue->heap[idx], &queue->heap[min]);
+		idx = min;
+	}
+	return true;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTQ_H
+#define EVENTQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timeutil.h"
+
+/* A single timestamped event. */
+struct event_t {
+	/* When does this event fire? */
+	simtime_t when;
+	/*
+	 * Insertion order, used to break ties between events with the same
+	 * timestamp. Without this the heap would fire simultaneous events in an
+	 * arbitrary order, and runs would no longer be reproducible.
+	 */
+	uint64_t seq;
+	/* What kind of event is this (interpretation is up to the user)? */
+	int type;
+	void *data;
+};
+
+/*
+ * A priority queue of events, ordered by (when, seq). This is a plain binary
+ * min-heap stored in a growable array -- events are stored by value so that
+ * pushing an event doesn't require an allocation (except when the heap needs
+ * to grow).
+ */
+struct eventq_t {
+	struct event_t *heap;
+	size_t len, cap;
+	/* Next sequence number to hand out. */
+	uint64_t seq;
+};
+
+int eventq_init(struct eventq_t *queue);
+void eventq_free(struct eventq_t *queue);
+
+/* Schedule an event. Returns -1 (with errno set) on allocation failure. */
+int eventq_push(struct eventq_t *queue, simtime_t when, int type, void *data);
+/* Remove the earliest event (returning false if the queue is empty). */
+bool eventq_pop(struct eventq_t *queue, struct event_t *event);
+
+static inline bool eventq_empty(const struct eventq_t *queue)
+{
+	return queue->len == 0;
+}
+
+#endif /* !EVENTQ_H */
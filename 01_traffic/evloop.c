@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* epoll reactor with timerfd and eventfd sources (see evloop.h). */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+#include "timeutil.h"
+
+/* How many ready sources to take from epoll_wait() at once. */
+#define EVLOOP_BATCH	16
+
+static void evloop_stop_ready(struct evloop_source_t *source)
+{
+	struct evloop_t *loop = (struct evloop_t *) ((char *) source - offsetof(struct evloop_t, stop));
+
+	evloop_source_take(source);
+	loop->stopping = true;
+}
+
+int evloop_init(struct evloop_t *loop)
+{
+	*loop = (struct evloop_t) { 0 };
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0)
+		return -1;
+	if (evloop_event_init(&loop->stop, evloop_stop_ready) < 0)
+		goto err_epoll;
+	if (evloop_add(loop, &loop->stop) < 0)
+		goto err_stop;
+	return 0;
+
+err_stop:
+	evloop_source_free(&loop->stop);
+err_epoll:
+	close(loop->epfd);
+	return -1;
+}
+
+void evloop_free(struct evloop_t *loop)
+{
+	evloop_source_free(&loop->stop);
+	close(loop->epfd);
+}
+
+int evloop_add(struct evloop_t *loop, struct evloop_source_t *source)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = source,
+	};
+
+	return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, source->fd, &event);
+}
+
+void evloop_run(struct evloop_t *loop)
+{
+	struct epoll_event events[EVLOOP_BATCH];
+
+	while (!loop->stopping) {
+		int n = epoll_wait(loop->epfd, events, EVLOOP_BATCH, -1);
+
+		/* EINTR is the only error we can get with a valid epoll fd. */
+		for (int i = 0; i < n; i++) {
+			struct evloop_source_t *source = events[i].data.ptr;
+			source->ready(source);
+		}
+	}
+}
+
+void evloop_stop(struct evloop_t *loop)
+{
+	evloop_event_post(&loop->stop);
+}
+
+int evloop_timer_init(struct evloop_source_t *source,
+                      void (*ready)(struct evloop_source_t *source))
+{
+	source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	source->ready = ready;
+	return source->fd < 0 ? -1 : 0;
+}
+
+int evloop_event_init(struct evloop_source_t *source,
+                      void (*ready)(struct evloop_source_t *source))
+{
+	source->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	source->ready = ready;
+	return source->fd < 0 ? -1 : 0;
+}
+
+void evloop_source_free(struct evloop_source_t *source)
+{
+	if (source->fd >= 0)
+		close(source->fd);
+	source->fd = -1;
+}
+
+void evloop_timer_arm(struct evloop_source_t *source, simtime_t deadline)
+{
+	struct itimerspec spec = {
+		.it_value = simtime_to_timespec(deadline),
+	};
+
+	/* A zero it_value would disarm the timer, rather than fire it at once. */
+	if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+		spec.it_value.tv_nsec = 1;
+	timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void evloop_timer_disarm(struct evloop_source_t *source)
+{
+	struct itimerspec spec = { 0 };
+
+	timerfd_settime(source->fd, 0, &spec, NULL);
+	/* Drop an expiry that may already be pending. */
+	evloop_source_take(source);
+}
+
+void evloop_event_post(struct evloop_source_t *source)
+{
+	uint64_t one = 1;
+
+	/* Only fails (EAGAIN) if the counter is saturated, which is still a post. */
+	while (write(source->fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+uint64_t evloop_source_take(struct evloop_source_t *source)
+{
+	uint64_t count;
+
+	if (read(source->fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timeutil.h"
+
+/*
+ * A minimal epoll reactor. Everything the loop waits for is a file descriptor
+ * -- timerfd deadlines and eventfd notifications -- so a single thread can
+ * multiplex any number of them, and sleeps in exactly one place.
+ */
+struct evloop_source_t {
+	int fd;
+	/* Called (on the loop thread) whenever ->fd is readable. */
+	void (*ready)(struct evloop_source_t *source);
+};
+
+struct evloop_t {
+	int epfd;
+	/* evloop_stop() posts this. */
+	struct evloop_source_t stop;
+	bool stopping;
+};
+
+int evloop_init(struct evloop_t *loop);
+void evloop_free(struct evloop_t *loop);
+/* Call @source->ready whenever @source->fd becomes readable. */
+int evloop_add(struct evloop_t *loop, struct evloop_source_t *source);
+/* Dispatch sources until evloop_stop() is called. */
+void evloop_run(struct evloop_t *loop);
+/* Make evloop_run() return, once it has finished the current batch (any thread). */
+void evloop_stop(struct evloop_t *loop);
+
+/* Set up @source as a CLOCK_MONOTONIC timerfd, or as an eventfd. */
+int evloop_timer_init(struct evloop_source_t *source,
+                      void (*ready)(struct evloop_source_t *source));
+int evloop_event_init(struct evloop_source_t *source,
+                      void (*ready)(struct evloop_source_t *source));
+/* Close the descriptor of a timer or event source. */
+void evloop_source_free(struct evloop_source_t *source);
+
+/* Fire the timer @source at the absolute CLOCK_MONOTONIC time @deadline. */
+void evloop_timer_arm(struct evloop_source_t *source, simtime_t deadline);
+void evloop_timer_disarm(struct evloop_source_t *source);
+/* Add one to the event @source (safe from any thread, never blocks). */
+void evloop_event_post(struct evloop_source_t *source);
+/*
+ * Take the pending expirations (timer) or posts (event) of @source, returning
+ * how many there were (0 if it wasn't actually ready).
+ */
+uint64_t evloop_source_take(struct evloop_source_t *source);
+
+#endif /* !EVLOOP_H */
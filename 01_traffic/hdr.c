@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "hdr.h"
+
+#define HDR_HALF_COUNT	(HDR_SUB_COUNT / 2)
+
+/*
+ * Values below HDR_SUB_COUNT get a bucket each. Above that, a value with its
+ * top bit at position msb is shifted right so that only its top HDR_SUB_BITS
+ * bits remain (which lie in [HDR_HALF_COUNT, HDR_SUB_COUNT)), and the shift
+ * picks the group of HDR_HALF_COUNT buckets.
+ */
+static int bucket_index(int64_t value)
+{
+	int msb, shift;
+
+	if (value < HDR_SUB_COUNT)
+		return value;
+	if (value >= INT64_C(1) << HDR_MAX_BITS)
+		return HDR_NUM_BUCKETS - 1;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - (HDR_SUB_BITS - 1);
+	return shift * HDR_HALF_COUNT + (int) (value >> shift);
+}
+
+/* Largest value that lands in bucket @index. */
+static int64_t bucket_highest(int index)
+{
+	int shift;
+	int64_t sub;
+
+	if (index < HDR_SUB_COUNT)
+		return index;
+	shift = index / HDR_HALF_COUNT - 1;
+	sub = index - shift * HDR_HALF_COUNT;
+	return ((sub + 1) << shift) - 1;
+}
+
+void hdr_record(struct hdr_hist_t *hist, int64_t value)
+{
+	if (value < 0)
+		value = 0;
+
+	if (!hist->count || value < hist->min)
+		hist->min = value;
+	if (!hist->count || value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[bucket_index(value)]++;
+}
+
+void hdr_merge(struct hdr_hist_t *dst, const struct hdr_hist_t *src)
+{
+	if (!src->count)
+		return;
+
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (!dst->count || src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (int i = 0; i < HDR_NUM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+int64_t hdr_percentile(const struct hdr_hist_t *hist, double percentile)
+{
+	uint64_t target, seen = 0;
+
+	if (!hist->count)
+		return 0;
+
+	target = ceil(percentile / 100.0 * hist->count);
+	if (target < 1)
+		target = 1;
+	for (int i = 0; i < HDR_NUM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			int64_t value = bucket_highest(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+double hdr_mean(const struct hdr_hist_t *hist)
+{
+	return hist->count ? (double) hist->sum / hist->count : 0;
+}
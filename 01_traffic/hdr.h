@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HDR_H
+#define HDR_H
+
+#include <stdint.h>
+
+/*
+ * A high dynamic range histogram (in the style of Gil Tene's HdrHistogram).
+ * Every power of two is split into HDR_SUB_COUNT / 2 linear buckets, so any
+ * recorded value is accurate to within 1 part in 32 (about 3%) no matter how
+ * large it is, and recording is just a couple of shifts and an increment.
+ *
+ * Values must be non-negative. Anything at or above 2^HDR_MAX_BITS (about 18
+ * minutes, if the values are nanoseconds) ends up in the last bucket, though
+ * ->max is still exact.
+ */
+#define HDR_SUB_BITS	6
+#define HDR_SUB_COUNT	(1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS	40
+#define HDR_NUM_BUCKETS	((HDR_MAX_BITS - HDR_SUB_BITS + 2) * (HDR_SUB_COUNT / 2))
+
+struct hdr_hist_t {
+	uint64_t count;
+	int64_t sum, min, max;
+	uint64_t buckets[HDR_NUM_BUCKETS];
+};
+
+/* Histograms are zero-initialised (calloc or = { 0 }) before use. */
+void hdr_record(struct hdr_hist_t *hist, int64_t value);
+/* Add all of the values recorded in @src to @dst. */
+void hdr_merge(struct hdr_hist_t *dst, const struct hdr_hist_t *src);
+/*
+ * Return the smallest value v such that at least @percentile percent of the
+ * recorded values are <= v (to within the histogram's precision).
+ */
+int64_t hdr_percentile(const struct hdr_hist_t *hist, double percentile);
+double hdr_mean(const struct hdr_hist_t *hist);
+
+#endif /* !HDR_H */
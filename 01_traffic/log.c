@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous logging. Rather than every thread calling printf() (and
+ * serialising on the stdio lock, or stalling on a slow terminal while it's
+ * holding a lane), each thread appends fixed-size binary records to its own
+ * single-producer single-consumer ring. A single writer thread drains all of
+ * the rings, sorts each batch by timestamp and formats it in one go.
+ *
+ * Rings are never freed until log_shutdown(). When a thread exits its ring is
+ * released and handed to the next thread that starts logging (see struct
+ * claim_list_t), so the number of rings is bounded by the number of threads
+ * alive at once rather than the number of vehicles.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coltrace.h"
+#include "log.h"
+#include "sched.h"
+
+/* Number of records in each ring (must be a power of two). */
+#define LOG_RING_SIZE	1024
+#define LOG_RING_MASK	(LOG_RING_SIZE - 1)
+
+/* How long does the writer nap when every ring is empty? */
+#define LOG_IDLE_NAP	NSEC_PER_MSEC
+
+/* Size of the writer's output buffer. */
+#define LOG_OUT_SIZE	(64 * 1024)
+/* Longest formatted record (with plenty of slack). */
+#define LOG_LINE_MAX	256
+
+#define CACHELINE		64
+
+struct log_ring {
+	/* Next slot to be written (only written by the owning thread). */
+	uint64_t head __attribute__((aligned(CACHELINE)));
+	/* Next slot to be read (only written by the writer thread). */
+	uint64_t tail __attribute__((aligned(CACHELINE)));
+
+	/*
+	 * A ring only belongs to one thread at a time, so its index (in order of
+	 * creation) doubles as the thread of a trace event.
+	 */
+	struct claim_node_t claim;
+
+	struct log_record_t records[LOG_RING_SIZE];
+};
+
+/* A record collected by the writer, with its collection order and ring. */
+struct log_entry {
+	struct log_record_t record;
+	uint64_t seq;
+	uint32_t ring;
+};
+
+static struct {
+	enum log_format_t format;
+	simtime_t epoch;
+
+	struct claim_list_t rings;
+
+	pthread_t writer;
+	bool stopping;
+
+	/* Writer-only state. */
+	struct log_entry *batch;
+	size_t batch_cap;
+	char out[LOG_OUT_SIZE];
+	size_t out_len;
+	struct coltrace_writer_t trace;
+} logger;
+
+static __thread struct log_ring *current_ring;
+
+static const char *FORMAT_NAMES[] = {
+	[LOG_FORMAT_TEXT] = "text",
+	[LOG_FORMAT_BINARY] = "binary",
+	[LOG_FORMAT_COLTRACE] = "coltrace",
+	[LOG_FORMAT_COLTRACE_PACKED] = "coltrace-packed",
+	[LOG_FORMAT_NONE] = "none",
+};
+
+bool log_format_from_string(const char *name, enum log_format_t *format)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(FORMAT_NAMES); i++) {
+		if (!strcmp(name, FORMAT_NAMES[i])) {
+			*format = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+simtime_t log_clock(void)
+{
+	return monotonic_now() - logger.epoch;
+}
+
+/* Which columns does each event have in a trace (see log_event_t)? */
+#define COLUMNS_BASE		(COLTRACE_COLUMN(COLTRACE_WHEN) |				\
+							 COLTRACE_COLUMN(COLTRACE_THREAD))
+#define COLUMNS_HEADINGS	(COLTRACE_COLUMN(COLTRACE_HEADING0) |			\
+							 COLTRACE_COLUMN(COLTRACE_HEADING1))
+#define COLUMNS_CONTROLLER	(COLUMNS_BASE | COLUMNS_HEADINGS)
+#define COLUMNS_VEHICLE		(COLUMNS_BASE | COLTRACE_COLUMN(COLTRACE_ID) |	\
+							 COLTRACE_COLUMN(COLTRACE_HEADING0))
+
+static const uint8_t TRACE_COLUMNS[COLTRACE_MAX_TYPES] = {
+	[LOG_CONTROLLER_READY] = COLUMNS_CONTROLLER,
+	[LOG_CONTROLLER_GREEN] = COLUMNS_CONTROLLER,
+	[LOG_CONTROLLER_RED] = COLUMNS_CONTROLLER,
+	[LOG_VEHICLE_ARRIVED] = COLUMNS_VEHICLE,
+	[LOG_VEHICLE_PROCEEDING] = COLUMNS_VEHICLE,
+	[LOG_VEHICLE_LEFT] = COLUMNS_VEHICLE,
+	[LOG_ALL_RED] = COLUMNS_CONTROLLER,
+	[LOG_LANE_WAIT] = COLUMNS_VEHICLE,
+	[LOG_WAKE_WAIT] = COLUMNS_CONTROLLER | COLTRACE_COLUMN(COLTRACE_ID),
+};
+
+/* Every event type has to fit in a trace (this won't compile otherwise). */
+typedef char log_trace_types_check[NUM_LOG_EVENTS <= COLTRACE_MAX_TYPES ? 1 : -1];
+
+static bool format_is_trace(enum log_format_t format)
+{
+	return format == LOG_FORMAT_COLTRACE || format == LOG_FORMAT_COLTRACE_PACKED;
+}
+
+static struct claim_node_t *ring_alloc(void)
+{
+	struct log_ring *ring;
+
+	if ((errno = posix_memalign((void **) &ring, CACHELINE, sizeof(*ring))))
+		bail("posix_memalign(log ring) failed");
+	memset(ring, 0, sizeof(*ring));
+	return &ring->claim;
+}
+
+static void ring_free(struct claim_node_t *node)
+{
+	free(container_of(node, struct log_ring, claim));
+}
+
+void log_emit(simtime_t when, enum log_event_t type, heading_t heading0,
+              heading_t heading1, int id)
+{
+	struct log_ring *ring = current_ring;
+	uint64_t head;
+
+	if (logger.format == LOG_FORMAT_NONE)
+		return;
+	/* The narration doesn't cover these, so don't waste ring space on them. */
+	if (type >= LOG_VEHICLE_LEFT && !format_is_trace(logger.format))
+		return;
+	if (!ring)
+		ring = current_ring = container_of(claim_list_claim(&logger.rings, ring_alloc),
+		                                   struct log_ring, claim);
+
+	/* Wait for the writer to make room. */
+	head = ring->head;
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+		sched_yield();
+
+	ring->records[head & LOG_RING_MASK] = (struct log_record_t) {
+		.when = when,
+		.id = id,
+		.type = type,
+		.heading = { heading0, heading1 },
+	};
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int format_text(char *buf, size_t size, const struct log_record_t *record)
+{
+	const char *heading0 = heading_to_string(record->heading[0]);
+	const char *heading1 = heading_to_string(record->heading[1]);
+
+	switch (record->type) {
+	case LOG_CONTROLLER_READY:
+		return snprintf(buf, size, "Traffic light mini-controller (%s, %s): "
+		                "Initialization complete. I am ready.\n", heading0, heading1);
+	case LOG_CONTROLLER_GREEN:
+		return snprintf(buf, size, "The traffic lights (%s, %s) "
+		                "have changed to green.\n", heading0, heading1);
+	case LOG_CONTROLLER_RED:
+		return snprintf(buf, size, "The traffic lights (%s, %s) "
+		                "will change to red now.\n", heading0, heading1);
+	case LOG_VEHICLE_ARRIVED:
+		return snprintf(buf, size, "Vehicle %d %s has arrived at the intersection.\n",
+		                record->id, heading0);
+	case LOG_VEHICLE_PROCEEDING:
+		return snprintf(buf, size, "Vehicle %d %s is proceeding through the intersection.\n",
+		                record->id, heading0);
+	}
+	/* Trace-only events. */
+	return 0;
+}
+
+static void out_flush(void)
+{
+	if (logger.out_len && fwrite(logger.out, 1, logger.out_len, stdout) != logger.out_len)
+		bail("fwrite(log) failed");
+	logger.out_len = 0;
+}
+
+static void out_record(const struct log_entry *entry)
+{
+	const struct log_record_t *record = &entry->record;
+
+	if (format_is_trace(logger.format)) {
+		struct coltrace_event_t event = {
+			.when = record->when,
+			.thread = entry->ring,
+			.id = record->id,
+			.type = record->type,
+			.heading = { record->heading[0], record->heading[1] },
+		};
+
+		if (coltrace_writer_add(&logger.trace, &event) < 0)
+			bail("writing trace failed");
+		return;
+	}
+
+	if (LOG_OUT_SIZE - logger.out_len < LOG_LINE_MAX)
+		out_flush();
+
+	switch (logger.format) {
+	case LOG_FORMAT_TEXT:
+		logger.out_len += format_text(logger.out + logger.out_len,
+		                              LOG_OUT_SIZE - logger.out_len, record);
+		break;
+	case LOG_FORMAT_BINARY:
+		memcpy(logger.out + logger.out_len, record, sizeof(*record));
+		logger.out_len += sizeof(*record);
+		break;
+	case LOG_FORMAT_COLTRACE:
+	case LOG_FORMAT_COLTRACE_PACKED:
+	case LOG_FORMAT_NONE:
+		break;
+	}
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct log_entry *x = a, *y = b;
+
+	if (x->record.when != y->record.when)
+		return x->record.when < y->record.when ? -1 : 1;
+	/* Records from the same ring keep their order. */
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Drain every ring into logger.batch, returning the number of records. */
+static size_t collect(void)
+{
+	struct claim_node_t *node = claim_list_first(&logger.rings);
+	size_t len = 0;
+
+	for (; node; node = node->next) {
+		struct log_ring *ring = container_of(node, struct log_ring, claim);
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+
+		if (head == tail)
+			continue;
+		if (len + (head - tail) > logger.batch_cap) {
+			size_t newcap = 2 * (len + (head - tail));
+			struct log_entry *newbatch;
+
+			newbatch = realloc(logger.batch, newcap * sizeof(*newbatch));
+			if (!newbatch)
+				bail("realloc(log batch) failed");
+			logger.batch = newbatch;
+			logger.batch_cap = newcap;
+		}
+		for (; tail != head; tail++, len++) {
+			logger.batch[len].record = ring->records[tail & LOG_RING_MASK];
+			logger.batch[len].seq = len;
+			logger.batch[len].ring = ring->claim.index;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	return len;
+}
+
+static void *writer_start(void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		/* Read the flag first, so the final collect() sees everything. */
+		bool stopping = __atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE);
+		size_t len = collect();
+
+		if (len) {
+			qsort(logger.batch, len, sizeof(*logger.batch), entry_cmp);
+			for (size_t i = 0; i < len; i++)
+				out_record(&logger.batch[i]);
+			/* Traces are only written a whole block at a time. */
+			if (!format_is_trace(logger.format)) {
+				out_flush();
+				fflush(stdout);
+			}
+			continue;
+		}
+		if (stopping)
+			break;
+		sleep_for(LOG_IDLE_NAP);
+	}
+	if (format_is_trace(logger.format) && coltrace_writer_finish(&logger.trace) < 0)
+		bail("writing trace failed");
+	return NULL;
+}
+
+int log_init(enum log_format_t format)
+{
+	logger.format = format;
+	logger.epoch = monotonic_now();
+	if (format == LOG_FORMAT_NONE)
+		return 0;
+
+	if (format_is_trace(format) &&
+	    coltrace_writer_init(&logger.trace, stdout,
+	                         format == LOG_FORMAT_COLTRACE_PACKED ? COLTRACE_PACKED : 0,
+	                         TRACE_COLUMNS) < 0)
+		return -1;
+	if (claim_list_init(&logger.rings) < 0)
+		return -1;
+	if ((errno = pthread_create(&logger.writer, NULL, writer_start, NULL)))
+		return -1;
+	return 0;
+}
+
+void log_shutdown(void)
+{
+	if (logger.format == LOG_FORMAT_NONE)
+		return;
+
+	__atomic_store_n(&logger.stopping, true, __ATOMIC_RELEASE);
+	pthread_join(logger.writer, NULL);
+
+	claim_list_destroy(&logger.rings, ring_free);
+	current_ring = NULL;
+
+	free(logger.batch);
+	logger.batch = NULL;
+	logger.batch_cap = 0;
+}
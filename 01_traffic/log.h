@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timeutil.h"
+#include "traffic.h"
+
+/* Everything that the simulation narrates. */
+enum log_event_t {
+	/* Controller (heading[0], heading[1]) has started up. */
+	LOG_CONTROLLER_READY,
+	/* Controller (heading[0], heading[1]) has changed to green. */
+	LOG_CONTROLLER_GREEN,
+	/* Controller (heading[0], heading[1]) is about to change to red. */
+	LOG_CONTROLLER_RED,
+	/* Vehicle (id, heading[0]) has arrived at the intersection. */
+	LOG_VEHICLE_ARRIVED,
+	/* Vehicle (id, heading[0]) has been let into the intersection. */
+	LOG_VEHICLE_PROCEEDING,
+
+	/*
+	 * Only in traces (-L coltrace), not the narration. Vehicle (id,
+	 * heading[0]) has left the intersection again, and controller
+	 * (heading[0], heading[1]) was the last to turn red so every light is now
+	 * red until the next green.
+	 */
+	LOG_VEHICLE_LEFT,
+	LOG_ALL_RED,
+	/*
+	 * The logging thread spent id microseconds blocked on the mailbox of lane
+	 * heading[0] (a vehicle waiting for the lights), or on the wake mailbox of
+	 * controller (heading[0], heading[1]) (waiting for its turn), starting at
+	 * ->when.
+	 */
+	LOG_LANE_WAIT,
+	LOG_WAKE_WAIT,
+	NUM_LOG_EVENTS,
+};
+
+/*
+ * A single log record. These are fixed-size and binary so that logging from
+ * the crossing path is just a copy into a ring buffer -- turning them into
+ * text is left to the writer thread.
+ */
+struct log_record_t {
+	/* Nanoseconds since the start of the run (see log_clock()). */
+	simtime_t when;
+	int32_t id;
+	uint8_t type;
+	uint8_t heading[2];
+};
+
+/* How the writer thread outputs records. */
+enum log_format_t {
+	/* The original human-readable narration. */
+	LOG_FORMAT_TEXT,
+	/* Raw struct log_record_t, in native byte order. */
+	LOG_FORMAT_BINARY,
+	/* Columnar trace (see coltrace.h), plain or delta-coded. */
+	LOG_FORMAT_COLTRACE,
+	LOG_FORMAT_COLTRACE_PACKED,
+	/* Discard everything. */
+	LOG_FORMAT_NONE,
+};
+
+bool log_format_from_string(const char *name, enum log_format_t *format);
+
+/* Start the writer thread. Records are written to stdout. */
+int log_init(enum log_format_t format);
+/*
+ * Write out every outstanding record and stop the writer thread. All of the
+ * threads that log must have stopped logging by now.
+ */
+void log_shutdown(void);
+
+/* Nanoseconds (CLOCK_MONOTONIC) since log_init(). */
+simtime_t log_clock(void);
+
+/*
+ * Log an event. Each thread gets its own single-producer ring buffer, so this
+ * never takes a lock -- it only waits if the writer has fallen a whole ring
+ * behind.
+ */
+void log_emit(simtime_t when, enum log_event_t type, heading_t heading0,
+              heading_t heading1, int id);
+
+static inline void log_controller(simtime_t when, enum log_event_t type,
+                                  const struct light_controller_t *controller)
+{
+	log_emit(when, type, controller->id[0], controller->id[1], 0);
+}
+
+static inline void log_vehicle(simtime_t when, enum log_event_t type,
+                               vehicle_t vehicle)
+{
+	log_emit(when, type, VEHICLES.heading[vehicle], 0, VEHICLES.id[vehicle]);
+}
+
+/* Log a wait on a mailbox (LOG_LANE_WAIT or LOG_WAKE_WAIT) that began at @start. */
+static inline void log_wait(simtime_t start, enum log_event_t type, heading_t heading0,
+                            heading_t heading1)
+{
+	simtime_t waited = (log_clock() - start) / NSEC_PER_USEC;
+
+	log_emit(start, type, heading0, heading1, waited > INT32_MAX ? INT32_MAX : waited);
+}
+
+#endif /* !LOG_H */
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Live monitor for a real-time run published with traffic -M <name> (see
+ * snapshot.h). The segment is mapped read-only, and every refresh just copies
+ * the state out under the seqlock, so watching a run never slows it down.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "timeutil.h"
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-i <interval>] [-1] <name>\n", argv0);
+	fprintf(stderr, "  -i  seconds between refreshes (default: 1)\n");
+	fprintf(stderr, "  -1  print the state once and exit\n");
+	exit(1);
+}
+
+static void print_state(const struct snapshot_t *snapshot, const struct snapshot_state_t *state,
+                        bool clear)
+{
+	uint64_t passed = 0;
+
+	for (int i = 0; i < state->num_controllers; i++)
+		passed += state->controllers[i].passed;
+
+	/* Redraw in place when we're on a terminal. */
+	if (clear)
+		printf("\033[H\033[2J");
+	printf("traffic (pid %" PRId32 "): %.1fs, %" PRIu64 " of %" PRIu64 " vehicles spawned, "
+	       "%" PRIu64 " through%s\n", snapshot->pid, TO_SECONDS(state->elapsed),
+	       state->spawned, state->total, passed, state->finished ? " (finished)" : "");
+	printf("  %-12s %5s %8s %7s %8s %7s", "controller", "light", "left", "phases", "vehicles",
+	       "through");
+	for (int j = 0; j < SNAPSHOT_LANES; j++)
+		printf("  %-5s %7s %8s", "lane", "waiting", "crossing");
+	printf("\n");
+
+	for (int i = 0; i < state->num_controllers; i++) {
+		const struct snapshot_controller_t *controller = &state->controllers[i];
+
+		printf("  %-12s %5s %7.2fs %7" PRIu64 " %8" PRId32 " %7" PRIu64, controller->name,
+		       controller->green ? "green" : "red", TO_SECONDS(controller->green_left),
+		       controller->phases, controller->phase_vehicles, controller->passed);
+		for (int j = 0; j < SNAPSHOT_LANES; j++)
+			printf("  %-5s %7" PRId32 " %8" PRId32, controller->lanes[j].name,
+			       controller->lanes[j].waiting, controller->lanes[j].crossing);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	simtime_t interval = SECONDS(1);
+	bool once = false, clear = isatty(STDOUT_FILENO);
+	const struct snapshot_t *snapshot;
+	struct snapshot_state_t state;
+	char name[64];
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "i:1")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = SECONDS(atof(optarg));
+			if (interval <= 0)
+				usage(argv[0]);
+			break;
+		case '1':
+			once = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	snprintf(name, sizeof(name), "/%s", argv[optind][0] == '/' ? argv[optind] + 1 : argv[optind]);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "shm_open(%s) failed: %s\n", name, strerror(errno));
+		return 1;
+	}
+	snapshot = mmap(NULL, sizeof(*snapshot), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (snapshot == MAP_FAILED) {
+		fprintf(stderr, "mmap(%s) failed: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	/* The publisher writes the magic last, once the first state is in. */
+	while (memcmp((const void *) snapshot->magic, SNAPSHOT_MAGIC, sizeof(snapshot->magic)))
+		sleep_for(SNAPSHOT_PERIOD);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (snapshot->version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "%s: unsupported snapshot version %" PRIu32 "\n", name,
+		        snapshot->version);
+		return 1;
+	}
+
+	for (;;) {
+		snapshot_read(snapshot, &state);
+		print_state(snapshot, &state, clear && !once);
+		if (once || state.finished)
+			break;
+		sleep_for(interval);
+	}
+	munmap((void *) snapshot, sizeof(*snapshot));
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Road network engine. A grid of intersections (each one a struct
+ * vintersection from virtual.c, with its own controller ring and arrivals) is
+ * connected by roads -- a vehicle that leaves an intersection heading
+ * HEADING_END() arrives at the opposite approach of the neighbouring
+ * intersection NETWORK_LINK_TIME later, picks a new heading there, and so on
+ * until it drives off the edge of the grid or reaches its destination.
+ *
+ * The grid is split into contiguous blocks of intersections ("partitions"),
+ * each simulated by its own thread with its own event queue. Vehicles crossing
+ * into another partition are pushed onto that partition's lock-free inbox.
+ *
+ * Partitions are kept in step conservatively (Chandy and Misra, with each
+ * partition's clock published in shared memory rather than sent as null
+ * messages). Every partition publishes a lower bound on the timestamp of
+ * anything it will still process. Anything it sends is at least
+ * NETWORK_LINK_TIME after that, so a partition can safely process every event
+ * earlier than the smallest of its neighbours' clocks plus NETWORK_LINK_TIME.
+ * Partitions only ever wait for their direct neighbours, so there's no global
+ * barrier -- which is what lets large grids scale with the number of cores.
+ *
+ * The run ends with the last vehicle to leave the network, and every partition
+ * is run up to exactly that point (so the phases counted don't depend on how
+ * the grid was split up). A partition that still has vehicles of its own can't
+ * be past it yet, but one that has none mustn't run ahead on its controllers
+ * alone, so it only goes as far as the clock of some partition that does.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eventq.h"
+#include "rng.h"
+#include "sched.h"
+#include "traffic.h"
+#include "virtual.h"
+
+/*
+ * How long does it take to drive from one intersection to the next? This is
+ * also the lookahead between partitions, so shorter links mean more waiting.
+ */
+#define NETWORK_LINK_TIME	SECONDS(10)
+
+/*
+ * After each intersection, a vehicle carries on with probability
+ * 1 - 1/NETWORK_MEAN_HOPS (so trips are geometrically distributed) up to a
+ * total of NETWORK_MAX_HOPS intersections.
+ */
+#define NETWORK_MEAN_HOPS	4
+#define NETWORK_MAX_HOPS	16
+
+/* Random stream for routing (the arrivals of each intersection have their own). */
+#define NETWORK_ROUTE_STREAM	UINT64_MAX
+
+/* How many events to process before checking in with the other partitions. */
+#define NETWORK_BATCH		4096
+
+#define CACHELINE			64
+
+enum {
+	/* Vehicle has driven down a road and arrived at an intersection. */
+	EV_ENTER = NUM_VSIM_EVENTS,
+};
+
+struct partition {
+	pthread_t thread;
+	struct vsim sim;
+	/* The partition owns intersections [first, last). */
+	int first, last;
+	/* Neighbouring partitions (the ones we can receive vehicles from). */
+	struct partition **neighbours;
+	int num_neighbours;
+	/* Number of events processed (for the report). */
+	uint64_t events;
+	/*
+	 * How many vehicles are still to arrive at our intersections or to
+	 * finish their journey in them? And when did the last one finish?
+	 */
+	long pending;
+	simtime_t last_departure;
+
+	/*
+	 * Lower bound on the timestamp of any event we will still process.
+	 * Only written by the owner, read by the neighbours.
+	 */
+	simtime_t clock __attribute__((aligned(CACHELINE)));
+	/*
+	 * The clock as of when we last had pending vehicles (or INT64_MIN), which
+	 * is a lower bound on the last departure of the whole run.
+	 */
+	simtime_t horizon;
+	/*
+	 * Vehicles handed over by other partitions (lock-free stack, linked
+	 * through VEHICLES.next).
+	 */
+	vehicle_t inbox __attribute__((aligned(CACHELINE)));
+};
+
+static struct {
+	int width, height;
+	struct vintersection *intersections;
+	/* Which partition owns each intersection? */
+	struct partition **owner;
+
+	struct partition *partitions;
+	int num_partitions;
+	/* Key of the routing random stream (see route_hash()). */
+	uint64_t route_key;
+
+	/* How many vehicles have finished their journey (out of total)? */
+	long finished __attribute__((aligned(CACHELINE)));
+	long total;
+} net;
+
+/* Valid headings for each approach. */
+static heading_t approach_headings[NUM_DIRECTIONS][NUM_VALID_HEADINGS];
+static int num_approach_headings[NUM_DIRECTIONS];
+
+/* Index of the neighbour of @index in direction @dir (or -1 at the edge). */
+static int neighbour(int index, dir_t dir)
+{
+	int x = index % net.width, y = index / net.width;
+
+	switch (dir) {
+	case NORTH:
+		y--;
+		break;
+	case SOUTH:
+		y++;
+		break;
+	case EAST:
+		x++;
+		break;
+	case WEST:
+		x--;
+		break;
+	}
+	if (x < 0 || x >= net.width || y < 0 || y >= net.height)
+		return -1;
+	return y * net.width + x;
+}
+
+/*
+ * Counter-based randomness for routing decisions (see rng.h), so a vehicle's
+ * route doesn't depend on how the grid was split up or in which order the
+ * partitions happened to run. Each vehicle has a stream of its own, keyed on
+ * where it entered the network -- ids are only unique for a heading of an
+ * intersection -- with the number of hops so far as the counter.
+ */
+#define ROUTE_ID_BITS		32
+#define ROUTE_HEADING_BITS	4
+#define ROUTE_ORIGIN_BITS	(64 - ROUTE_ID_BITS - ROUTE_HEADING_BITS)
+
+typedef char route_heading_check[NUM_HEADINGS <= 1U << ROUTE_HEADING_BITS ? 1 : -1];
+
+static uint64_t route_hash(vehicle_t vehicle)
+{
+	uint64_t origin = (uint64_t) VEHICLES.origin[vehicle];
+
+	origin = (origin << ROUTE_HEADING_BITS) | VEHICLES.origin_heading[vehicle];
+	origin = (origin << ROUTE_ID_BITS) | (uint32_t) VEHICLES.id[vehicle];
+
+	return rng_u64(rng_key(net.route_key, origin), VEHICLES.hops[vehicle]);
+}
+
+static void send_vehicle(struct partition *to, vehicle_t vehicle)
+{
+	VEHICLES.next[vehicle] = __atomic_load_n(&to->inbox, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&to->inbox, &VEHICLES.next[vehicle], vehicle, true,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/* vsim->depart -- route the vehicle to the next intersection. */
+static void network_depart(struct vsim *sim, struct vintersection *from,
+                           vehicle_t vehicle)
+{
+	struct partition *self = container_of(sim, struct partition, sim);
+	dir_t exit = HEADING_END(VEHICLES.heading[vehicle]), approach = (exit + 2) % NUM_DIRECTIONS;
+	int to = neighbour(from->index, exit);
+	uint64_t random = route_hash(vehicle);
+
+	if (to < 0 || ++VEHICLES.hops[vehicle] >= NETWORK_MAX_HOPS ||
+	    random % NETWORK_MEAN_HOPS == 0) {
+		sim->finished++;
+		self->pending--;
+		self->last_departure = sim->now;
+		return;
+	}
+
+	random /= NETWORK_MEAN_HOPS;
+	VEHICLES.intersection[vehicle] = to;
+	VEHICLES.heading[vehicle] =
+		approach_headings[approach][random % num_approach_headings[approach]];
+	VEHICLES.arrived[vehicle] = sim->now + NETWORK_LINK_TIME;
+	VEHICLES.status[vehicle] = VEHICLE_ARRIVING;
+
+	if (net.owner[to] == self) {
+		vsim_schedule(sim, VEHICLES.arrived[vehicle], EV_ENTER, VEHICLE_TO_PTR(vehicle));
+	} else {
+		self->pending--;
+		send_vehicle(net.owner[to], vehicle);
+	}
+}
+
+static void drain_inbox(struct partition *self)
+{
+	vehicle_t vehicle = __atomic_exchange_n(&self->inbox, VEHICLE_NONE, __ATOMIC_ACQUIRE);
+
+	while (vehicle != VEHICLE_NONE) {
+		vehicle_t next = VEHICLES.next[vehicle];
+		vsim_schedule(&self->sim, VEHICLES.arrived[vehicle], EV_ENTER, VEHICLE_TO_PTR(vehicle));
+		self->pending++;
+		vehicle = next;
+	}
+}
+
+/* How far can a partition without vehicles of its own safely go? */
+static simtime_t departure_bound(void)
+{
+	simtime_t bound = INT64_MIN;
+
+	for (int p = 0; p < net.num_partitions; p++) {
+		simtime_t horizon = __atomic_load_n(&net.partitions[p].horizon, __ATOMIC_ACQUIRE);
+		if (horizon > bound)
+			bound = horizon;
+	}
+	return bound;
+}
+
+static void partition_dispatch(struct partition *self, struct event_t *event)
+{
+	struct vsim *sim = &self->sim;
+
+	sim->now = event->when;
+	if (!vsim_dispatch(sim, event) && event->type == EV_ENTER) {
+		vehicle_t vehicle = PTR_TO_VEHICLE(event->data);
+		vintersection_enter(sim, &net.intersections[VEHICLES.intersection[vehicle]], vehicle);
+	}
+}
+
+static void *partition_start(void *arg)
+{
+	struct partition *self = arg;
+	struct vsim *sim = &self->sim;
+	struct event_t event;
+	simtime_t end = 0;
+	int reported = 0;
+
+	while (__atomic_load_n(&net.finished, __ATOMIC_ACQUIRE) < net.total) {
+		simtime_t bound = INT64_MAX, limit = INT64_MIN, next;
+		int processed = 0;
+
+		/*
+		 * Read the neighbours' clocks *before* draining our inbox. Vehicles
+		 * are pushed before the sender's clock moves past them, so anything
+		 * earlier than the bound is then guaranteed to be in our queue.
+		 */
+		for (int i = 0; i < self->num_neighbours; i++) {
+			simtime_t clock = __atomic_load_n(&self->neighbours[i]->clock, __ATOMIC_ACQUIRE);
+			if (clock + NETWORK_LINK_TIME < bound)
+				bound = clock + NETWORK_LINK_TIME;
+		}
+		drain_inbox(self);
+
+		next = eventq_empty(&sim->events) ? INT64_MAX : sim->events.heap[0].when;
+		__atomic_store_n(&self->clock, next < bound ? next : bound, __ATOMIC_RELEASE);
+		if (self->pending)
+			__atomic_store_n(&self->horizon, next < bound ? next : bound, __ATOMIC_RELEASE);
+		else
+			limit = departure_bound();
+
+		while (processed < NETWORK_BATCH && !eventq_empty(&sim->events) &&
+		       sim->events.heap[0].when < bound &&
+		       (self->pending || sim->events.heap[0].when <= limit)) {
+			eventq_pop(&sim->events, &event);
+			partition_dispatch(self, &event);
+			processed++;
+		}
+		self->events += processed;
+
+		if (sim->finished > reported) {
+			__atomic_add_fetch(&net.finished, sim->finished - reported, __ATOMIC_RELEASE);
+			reported = sim->finished;
+		}
+		if (!processed)
+			sched_yield();
+	}
+
+	/*
+	 * Everybody's vehicles have finished (and so have recorded their last
+	 * departures), so run the rest of our controllers up to the last one.
+	 */
+	for (int p = 0; p < net.num_partitions; p++)
+		if (net.partitions[p].last_departure > end)
+			end = net.partitions[p].last_departure;
+	while (!eventq_empty(&sim->events) && sim->events.heap[0].when <= end) {
+		eventq_pop(&sim->events, &event);
+		partition_dispatch(self, &event);
+		self->events++;
+	}
+	sim->now = end;
+
+	/* Clean up our intersections (the vehicles all live in VEHICLES). */
+	for (int i = self->first; i < self->last; i++)
+		vintersection_free(sim, &net.intersections[i]);
+	return NULL;
+}
+
+/* Work out which partitions each partition can receive vehicles from. */
+static void find_neighbours(struct partition *self)
+{
+	self->neighbours = calloc(net.num_partitions, sizeof(*self->neighbours));
+	if (!self->neighbours)
+		bail("calloc(partition neighbours) failed");
+
+	for (int i = self->first; i < self->last; i++) {
+		for (dir_t dir = 0; dir < NUM_DIRECTIONS; dir++) {
+			int other = neighbour(i, dir);
+			bool seen = false;
+
+			if (other < 0 || net.owner[other] == self)
+				continue;
+			for (int j = 0; j < self->num_neighbours; j++)
+				seen |= self->neighbours[j] == net.owner[other];
+			if (!seen)
+				self->neighbours[self->num_neighbours++] = net.owner[other];
+		}
+	}
+}
+
+int network_run(const struct traffic_params *params, int width, int height,
+                int npartitions)
+{
+	int num_intersections = width * height;
+	simtime_t start, end = 0;
+	uint64_t events = 0;
+
+	if (num_intersections > (1L << ROUTE_ORIGIN_BITS))
+		bail("%dx%d is too many intersections", width, height);
+	if (npartitions > num_intersections)
+		npartitions = num_intersections;
+
+	net = (typeof(net)) {
+		.width = width,
+		.height = height,
+		.num_partitions = npartitions,
+		.total = (long) params->num_vehicles * num_intersections,
+		.route_key = rng_key(params->seed, NETWORK_ROUTE_STREAM),
+	};
+	net.intersections = calloc(num_intersections, sizeof(*net.intersections));
+	net.owner = calloc(num_intersections, sizeof(*net.owner));
+	net.partitions = calloc(npartitions, sizeof(*net.partitions));
+	if (!net.intersections || !net.owner || !net.partitions)
+		bail("calloc(network) failed");
+	/* Every vehicle in the network enters it at one of the intersections. */
+	if (net.total >= VEHICLE_NONE || vehicles_init(net.total) < 0)
+		bail("vehicles_init(%ld) failed", net.total);
+
+	for (size_t i = 0; i < ARRAY_LENGTH(VALID_HEADINGS); i++) {
+		dir_t approach = HEADING_START(VALID_HEADINGS[i]);
+		approach_headings[approach][num_approach_headings[approach]++] = VALID_HEADINGS[i];
+	}
+
+	/* Split the grid into contiguous (row-major) blocks. */
+	for (int p = 0; p < npartitions; p++) {
+		struct partition *partition = &net.partitions[p];
+
+		partition->first = (long) p * num_intersections / npartitions;
+		partition->last = (long) (p + 1) * num_intersections / npartitions;
+		for (int i = partition->first; i < partition->last; i++)
+			net.owner[i] = partition;
+		partition->inbox = VEHICLE_NONE;
+		partition->pending = (long) params->num_vehicles * (partition->last - partition->first);
+
+		if (vsim_init(&partition->sim) < 0)
+			bail("vsim_init failed");
+		partition->sim.depart = network_depart;
+	}
+	for (int p = 0; p < npartitions; p++) {
+		struct partition *partition = &net.partitions[p];
+
+		find_neighbours(partition);
+		/* Each intersection draws from its own random streams (keyed by index). */
+		for (int i = partition->first; i < partition->last; i++)
+			vintersection_init(&partition->sim, &net.intersections[i], params, i);
+	}
+
+	start = monotonic_now();
+	for (int p = 0; p < npartitions; p++)
+		if ((errno = pthread_create(&net.partitions[p].thread, NULL, partition_start,
+		                            &net.partitions[p])))
+			bail("pthread_create(partition[%d]) failed", p);
+	for (int p = 0; p < npartitions; p++)
+		pthread_join(net.partitions[p].thread, NULL);
+
+	for (int p = 0; p < npartitions; p++) {
+		struct partition *partition = &net.partitions[p];
+		if (partition->sim.now > end)
+			end = partition->sim.now;
+		events += partition->events;
+		vsim_free(&partition->sim);
+		free(partition->neighbours);
+	}
+
+	fprintf(stderr, "Network: %dx%d intersections on %d partitions, %ld vehicles, "
+	        "%.1fs simulated in %.3fs (%.0f events/s).\n",
+	        width, height, npartitions, net.total, TO_SECONDS(end),
+	        TO_SECONDS(monotonic_now() - start),
+	        events / TO_SECONDS(monotonic_now() - start));
+
+	free(net.partitions);
+	free(net.owner);
+	free(net.intersections);
+	vehicles_free();
+	return 0;
+}
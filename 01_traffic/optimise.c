@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Green-time optimiser. This is a compass search (coordinate descent that
+ * tries both directions of every coordinate at once): each round tries making
+ * every green time one step longer and one step shorter, moves to the best of
+ * those plans if it beats the current one, and halves the step otherwise.
+ * There are only three coordinates, so a round is just six candidates, and
+ * the whole of a round can be run in parallel.
+ *
+ * The best plan is the one that happened to score lowest on the search's
+ * seeds, so its score there is biased low (the winner's curse). The confidence
+ * intervals at the end come from re-scoring it and the start plan on a fresh
+ * block of seeds instead.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimise.h"
+#include "stats.h"
+#include "sweep.h"
+#include "traffic.h"
+
+/* The coordinates being optimised. */
+static const int GREEN_PARAMS[] = {
+	PARAM_TRUNK_GREEN, PARAM_MINOR_GREEN, PARAM_RIGHT_GREEN,
+};
+
+/* Stop once the step is shorter than this (in seconds), or after this many rounds. */
+#define OPTIMISE_MIN_STEP	0.1
+#define OPTIMISE_MAX_ROUNDS	64
+
+struct optimise_ctx {
+	enum optimise_objective_t objective;
+	int replications, njobs;
+	/* Replication number of the first seed to score on. */
+	int first;
+	int (*run)(const struct param_point_t *point, int replication,
+	           struct stats_summary_t *summary);
+	/* The candidates currently being scored. */
+	const struct param_point_t *points;
+};
+
+bool optimise_objective_from_string(const char *name, enum optimise_objective_t *objective)
+{
+	if (!strcmp(name, "mean"))
+		*objective = OBJECTIVE_MEAN;
+	else if (!strcmp(name, "p95"))
+		*objective = OBJECTIVE_P95;
+	else
+		return false;
+	return true;
+}
+
+/* sweep_map() callback -- one replication of one candidate. */
+static int optimise_job(size_t index, void *result, void *arg)
+{
+	struct optimise_ctx *ctx = arg;
+
+	return ctx->run(&ctx->points[index / ctx->replications],
+	                ctx->first + index % ctx->replications, result);
+}
+
+/*
+ * Score each of the @n plans at @points, filling in the objective (in seconds)
+ * of every replication of candidate c at scores[c * replications ...].
+ */
+static void evaluate(struct optimise_ctx *ctx, const struct param_point_t *points,
+                     size_t n, double *scores)
+{
+	size_t jobs = n * ctx->replications, failed;
+	struct stats_summary_t *summaries = calloc(jobs, sizeof(*summaries));
+	bool *ok = calloc(jobs, sizeof(*ok));
+
+	if (!summaries || !ok)
+		bail("calloc(optimiser results) failed");
+
+	ctx->points = points;
+	failed = sweep_map(jobs, ctx->njobs, optimise_job, ctx, summaries,
+	                   sizeof(*summaries), ok);
+	if (failed)
+		bail("%zu of the optimiser's runs failed", failed);
+
+	for (size_t i = 0; i < jobs; i++)
+		scores[i] = TO_SECONDS(ctx->objective == OBJECTIVE_P95 ?
+		                       summaries[i].p95 : summaries[i].mean);
+
+	free(summaries);
+	free(ok);
+}
+
+static double average(const double *scores, int n)
+{
+	double sum = 0;
+
+	for (int i = 0; i < n; i++)
+		sum += scores[i];
+	return sum / n;
+}
+
+static void print_row(FILE *out, int round, double step, const struct param_point_t *point,
+                      double score)
+{
+	fprintf(out, "%5d %9.3f", round, step);
+	for (size_t i = 0; i < ARRAY_LENGTH(GREEN_PARAMS); i++)
+		fprintf(out, " %11.3f", point->values[GREEN_PARAMS[i]]);
+	fprintf(out, " %9.3f\n", score);
+	fflush(out);
+}
+
+int optimise_run(const struct param_point_t *start, enum optimise_objective_t objective,
+                 int replications, int njobs,
+                 int (*run)(const struct param_point_t *point, int replication,
+                            struct stats_summary_t *summary),
+                 FILE *out)
+{
+	struct optimise_ctx ctx = {
+		.objective = objective,
+		.replications = replications,
+		.njobs = njobs,
+		.run = run,
+	};
+	struct param_point_t best = *start, candidates[2 * ARRAY_LENGTH(GREEN_PARAMS)];
+	double *scores = calloc(ARRAY_LENGTH(candidates) * replications, sizeof(double));
+	double *diffs = calloc(replications, sizeof(double));
+	const char *name = objective == OBJECTIVE_P95 ? "p95" : "mean";
+	double step = 0, min_green, best_score, mean, halfwidth;
+	double *best_scores = scores, *start_scores = scores + replications;
+	int round;
+
+	if (!scores || !diffs)
+		bail("calloc(optimiser scores) failed");
+
+	/*
+	 * Start with steps of a quarter of the longest green, and never let a
+	 * green get so short that not even one vehicle gets through.
+	 */
+	for (size_t i = 0; i < ARRAY_LENGTH(GREEN_PARAMS); i++)
+		if (start->values[GREEN_PARAMS[i]] > step)
+			step = start->values[GREEN_PARAMS[i]];
+	step /= 4;
+	if (step < OPTIMISE_MIN_STEP)
+		step = OPTIMISE_MIN_STEP;
+	min_green = start->values[PARAM_INTERSECTION_GAP];
+	if (min_green < OPTIMISE_MIN_STEP)
+		min_green = OPTIMISE_MIN_STEP;
+
+	fprintf(out, "%5s %9s", "round", "step");
+	for (size_t i = 0; i < ARRAY_LENGTH(GREEN_PARAMS); i++)
+		fprintf(out, " %11s", PARAM_INFO[GREEN_PARAMS[i]].name);
+	fprintf(out, " %9s\n", name);
+
+	evaluate(&ctx, start, 1, scores);
+	best_score = average(scores, replications);
+	print_row(out, 0, step, &best, best_score);
+
+	for (round = 1; round <= OPTIMISE_MAX_ROUNDS && step >= OPTIMISE_MIN_STEP; round++) {
+		size_t n = 0, pick = 0;
+		double pick_score = 0;
+
+		for (size_t i = 0; i < ARRAY_LENGTH(GREEN_PARAMS); i++) {
+			for (int sign = -1; sign <= 1; sign += 2) {
+				struct param_point_t *candidate = &candidates[n];
+
+				*candidate = best;
+				candidate->values[GREEN_PARAMS[i]] += sign * step;
+				if (candidate->values[GREEN_PARAMS[i]] >= min_green)
+					n++;
+			}
+		}
+
+		evaluate(&ctx, candidates, n, scores);
+		for (size_t i = 0; i < n; i++) {
+			double score = average(&scores[i * replications], replications);
+
+			if (!i || score < pick_score) {
+				pick = i;
+				pick_score = score;
+			}
+		}
+
+		/* Move if that's an improvement, otherwise look closer. */
+		if (n && pick_score < best_score) {
+			best = candidates[pick];
+			best_score = pick_score;
+		} else {
+			step /= 2;
+		}
+		print_row(out, round, step, &best, best_score);
+	}
+
+	/* Re-score the best and the start plan on the next block of seeds. */
+	candidates[0] = best;
+	candidates[1] = *start;
+	ctx.first = replications;
+	evaluate(&ctx, candidates, 2, scores);
+
+	fprintf(out, "\nBest plan (%s wait over %d fresh replications):\n ", name, replications);
+	for (size_t i = 0; i < ARRAY_LENGTH(GREEN_PARAMS); i++)
+		fprintf(out, " -o %s=%.3f", PARAM_INFO[GREEN_PARAMS[i]].name,
+		        best.values[GREEN_PARAMS[i]]);
+	fprintf(out, "\n");
+
+	mean = stats_mean_ci95(best_scores, replications, &halfwidth);
+	fprintf(out, "  best plan:   %9.3fs  (95%% CI %.3f to %.3f)\n",
+	        mean, mean - halfwidth, mean + halfwidth);
+	mean = stats_mean_ci95(start_scores, replications, &halfwidth);
+	fprintf(out, "  start plan:  %9.3fs  (95%% CI %.3f to %.3f)\n",
+	        mean, mean - halfwidth, mean + halfwidth);
+
+	/* Both plans saw the same arrivals, so compare them replication by replication. */
+	for (int i = 0; i < replications; i++)
+		diffs[i] = best_scores[i] - start_scores[i];
+	mean = stats_mean_ci95(diffs, replications, &halfwidth);
+	fprintf(out, "  improvement: %9.3fs  (95%% CI %.3f to %.3f, paired)\n",
+	        -mean, -mean - halfwidth, -mean + halfwidth);
+	fflush(out);
+
+	free(scores);
+	free(diffs);
+	return 0;
+}
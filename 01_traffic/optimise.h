@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OPTIMISE_H
+#define OPTIMISE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "stats.h"
+#include "sweep.h"
+
+/* What does the optimiser minimise? */
+enum optimise_objective_t {
+	/* Mean wait at the lights. */
+	OBJECTIVE_MEAN,
+	/* 95th percentile wait at the lights. */
+	OBJECTIVE_P95,
+};
+
+bool optimise_objective_from_string(const char *name, enum optimise_objective_t *objective);
+
+/*
+ * Search for the green times (trunk_green, minor_green and right_green) that
+ * minimise @objective, starting from the ones in @start, and print the best
+ * plan to @out.
+ *
+ * Every plan is scored over the same @replications seeds (common random
+ * numbers), so that two plans are compared on exactly the same arrivals and
+ * the noise between them mostly cancels out. The best plan is then compared
+ * with the start plan on the next @replications seeds (replications
+ * @replications to 2 * @replications - 1), which the search never saw.
+ * @run(point, replication, summary) runs one replication, in its own process
+ * -- all of the replications of all of the candidates in a round are run at
+ * once, @njobs at a time (see sweep_map()).
+ */
+int optimise_run(const struct param_point_t *start, enum optimise_objective_t objective,
+                 int replications, int njobs,
+                 int (*run)(const struct param_point_t *point, int replication,
+                            struct stats_summary_t *summary),
+                 FILE *out);
+
+#endif /* !OPTIMISE_H */
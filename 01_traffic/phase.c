@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Conflicts between headings, and the phase scheduler built on top of them.
+ *
+ * Every lane meets the edge of the intersection at one point, so we number
+ * those points clockwise from the north-west corner. Traffic keeps to the
+ * left, so on each side the outgoing lane comes before the incoming one:
+ *
+ *          0   1
+ *        +-↑---↓-+
+ *      7 →       → 2
+ *      6 ←       ← 3
+ *        +-↑---↓-+
+ *          5   4
+ *
+ * The path of a heading is then a chord between two points, and two paths cut
+ * across each other exactly when one of them has an end on each side of the
+ * other. Two headings also conflict if they merge into the same exit, but not
+ * if they leave from the same side (they're either in the same lane, which
+ * only lets one vehicle in at a time, or they split off straight away).
+ */
+
+#include <stdint.h>
+
+#include "phase.h"
+#include "traffic.h"
+
+#define NUM_EDGE_POINTS		(2 * NUM_DIRECTIONS)
+#define EDGE_OUT(dir)		(2 * (dir))
+#define EDGE_IN(dir)		(2 * (dir) + 1)
+
+/* Clockwise distance from edge point @from to edge point @to. */
+#define ARC(from, to)		(((to) - (from) + NUM_EDGE_POINTS) % NUM_EDGE_POINTS)
+
+/* Is edge point @point between the two ends of (s, e), going clockwise? */
+#define BETWEEN(point, s, e)	(ARC(EDGE_IN(s), point) < ARC(EDGE_IN(s), EDGE_OUT(e)))
+
+#define CONFLICTS(s1, e1, s2, e2)											\
+	((s1) != (s2) && ((e1) == (e2) ||										\
+	                  BETWEEN(EDGE_IN(s2), s1, e1) != BETWEEN(EDGE_OUT(e2), s1, e1)))
+
+/* Every heading (valid or not) that conflicts with (s, e). */
+#define CONFLICT_BIT(s1, e1, s2, e2)										\
+	(CONFLICTS(s1, e1, s2, e2) ? HEADING_BIT(PACK_HEADING(s2, e2)) : 0)
+#define CONFLICT_ROW_FROM(s1, e1, s2)										\
+	(CONFLICT_BIT(s1, e1, s2, NORTH) | CONFLICT_BIT(s1, e1, s2, EAST) |		\
+	 CONFLICT_BIT(s1, e1, s2, SOUTH) | CONFLICT_BIT(s1, e1, s2, WEST))
+#define CONFLICT_ROW(s, e)													\
+	(CONFLICT_ROW_FROM(s, e, NORTH) | CONFLICT_ROW_FROM(s, e, EAST) |		\
+	 CONFLICT_ROW_FROM(s, e, SOUTH) | CONFLICT_ROW_FROM(s, e, WEST))
+
+/* The headings of the whole intersection, and of each controller. */
+enum {
+	VALID_HEADINGS_MASK = 0
+#	define HEADING_GENERIC(start, end, _) | HEADING_BIT(PACK_HEADING(start, end))
+#	include "heading-list.h"
+	,
+	TRUNK_FWD_HEADINGS = 0
+#	define HEADING_TRUNK_FWD(start, end, _) | HEADING_BIT(PACK_HEADING(start, end))
+#	include "heading-list.h"
+	,
+	MINOR_FWD_HEADINGS = 0
+#	define HEADING_MINOR_FWD(start, end, _) | HEADING_BIT(PACK_HEADING(start, end))
+#	include "heading-list.h"
+	,
+	TRUNK_RIGHT_HEADINGS = 0
+#	define HEADING_TRUNK_RIGHT(start, end, _) | HEADING_BIT(PACK_HEADING(start, end))
+#	include "heading-list.h"
+	,
+};
+
+const heading_mask_t HEADING_CONFLICTS[NUM_HEADINGS] = {
+#	define HEADING_GENERIC(start, end, _)									\
+	[PACK_HEADING(start, end)] = CONFLICT_ROW(start, end) & VALID_HEADINGS_MASK,
+#	include "heading-list.h"
+};
+
+/*
+ * Compile-time sanity check -- every controller can let all of its headings
+ * through at once (this won't compile if one of them conflicts).
+ */
+struct controller_conflict_check {
+#	define HEADING_TRUNK_FWD(start, end, name)								\
+	char start##_##end[CONFLICT_ROW(start, end) & TRUNK_FWD_HEADINGS ? -1 : 1];
+#	define HEADING_MINOR_FWD(start, end, name)								\
+	char start##_##end[CONFLICT_ROW(start, end) & MINOR_FWD_HEADINGS ? -1 : 1];
+#	define HEADING_TRUNK_RIGHT(start, end, name)							\
+	char start##_##end[CONFLICT_ROW(start, end) & TRUNK_RIGHT_HEADINGS ? -1 : 1];
+#	include "heading-list.h"
+};
+
+/* Every valid heading that uses @group's lane. */
+static heading_mask_t group_headings(int group)
+{
+	heading_mask_t headings = 0;
+
+	for (int i = 0; i < NUM_VALID_HEADINGS; i++) {
+		heading_t heading = VALID_HEADINGS[i];
+
+		if (HEADING_CONTROLLERS[heading] == ALL_CONTROLLERS[GROUP_CONTROLLER(group)] &&
+		    HEADING_START(heading) == GROUP_DIRECTION(group))
+			headings |= HEADING_BIT(heading);
+	}
+	return headings;
+}
+
+void phase_sched_init(struct phase_sched_t *sched)
+{
+	heading_mask_t headings[NUM_SIGNAL_GROUPS], conflicts[NUM_SIGNAL_GROUPS];
+
+	*sched = (struct phase_sched_t) { 0 };
+
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++) {
+		headings[i] = group_headings(i);
+		conflicts[i] = 0;
+		for (heading_t heading = 0; heading < NUM_HEADINGS; heading++)
+			if (headings[i] & HEADING_BIT(heading))
+				conflicts[i] |= HEADING_CONFLICTS[heading];
+	}
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++)
+		for (int j = 0; j < NUM_SIGNAL_GROUPS; j++)
+			if (!(conflicts[i] & headings[j]) && !(conflicts[j] & headings[i]))
+				sched->compatible[i] |= GROUP_BIT(j);
+}
+
+/* Can every group in @phase be green at the same time? */
+static bool phase_compatible(const struct phase_sched_t *sched, phase_t phase)
+{
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++)
+		if ((phase & GROUP_BIT(i)) && (phase & ~sched->compatible[i]))
+			return false;
+	return true;
+}
+
+phase_t phase_pick(struct phase_sched_t *sched, const int demand[NUM_SIGNAL_GROUPS])
+{
+	phase_t waiting = 0, best = 0;
+	int first = -1, best_groups = -1, best_vehicles = -1, best_size = -1;
+
+	/*
+	 * The group that has gone longest without a green (preferring ones with
+	 * anybody waiting) gets it, so no lane can be starved.
+	 */
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++)
+		if (demand[i] > 0)
+			waiting |= GROUP_BIT(i);
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++) {
+		if (waiting && !(waiting & GROUP_BIT(i)))
+			continue;
+		if (first < 0 || sched->last_green[i] < sched->last_green[first])
+			first = i;
+	}
+
+	/*
+	 * There are only 2^NUM_SIGNAL_GROUPS phases, so just try all of the ones
+	 * with that group in them. The best one lets the most groups with anybody
+	 * waiting go, then the most vehicles, and then opens as many (idle) lanes
+	 * as it can for anybody who turns up during the green.
+	 */
+	for (phase_t phase = 1; phase < GROUP_BIT(NUM_SIGNAL_GROUPS); phase++) {
+		int groups = 0, vehicles = 0, size = 0;
+
+		if (!(phase & GROUP_BIT(first)) || !phase_compatible(sched, phase))
+			continue;
+		for (int i = 0; i < NUM_SIGNAL_GROUPS; i++) {
+			if (!(phase & GROUP_BIT(i)))
+				continue;
+			size++;
+			if (demand[i] > 0) {
+				groups++;
+				vehicles += demand[i];
+			}
+		}
+		if (groups > best_groups ||
+		    (groups == best_groups && vehicles > best_vehicles) ||
+		    (groups == best_groups && vehicles == best_vehicles && size > best_size)) {
+			best = phase;
+			best_groups = groups;
+			best_vehicles = vehicles;
+			best_size = size;
+		}
+	}
+
+	sched->cycle++;
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++)
+		if (best & GROUP_BIT(i))
+			sched->last_green[i] = sched->cycle;
+	return best;
+}
+
+unsigned int phase_lanes(phase_t phase, int index)
+{
+	unsigned int lanes = 0;
+
+	for (int j = 0; j < 2; j++)
+		if (phase & GROUP_BIT(2 * index + j))
+			lanes |= 1U << HEADING_START(ALL_CONTROLLERS[index]->id[j]);
+	return lanes;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PHASE_H
+#define PHASE_H
+
+#include <stdint.h>
+
+#include "traffic.h"
+
+/* A set of headings, with one bit for each (packed) heading_t. */
+typedef uint16_t heading_mask_t;
+#define HEADING_BIT(heading)	((heading_mask_t) (1U << (heading)))
+
+/*
+ * Which headings have paths that cross or merge with each heading? This is
+ * worked out at compile time from heading-list.h (see phase.c).
+ */
+extern const heading_mask_t HEADING_CONFLICTS[NUM_HEADINGS];
+
+/*
+ * Lights only switch whole lanes, and a lane (entry[] of a controller) carries
+ * every heading of that controller with the same starting direction. So the
+ * unit of scheduling is a signal group -- group 2*i + j is the lane of
+ * ALL_CONTROLLERS[i] used by ->id[j].
+ */
+#define NUM_SIGNAL_GROUPS		(2 * NUM_CONTROLLERS)
+#define GROUP_CONTROLLER(group)	((group) / 2)
+#define GROUP_DIRECTION(group)												\
+	HEADING_START(ALL_CONTROLLERS[GROUP_CONTROLLER(group)]->id[(group) % 2])
+
+/* A phase is a set of signal groups that are green at the same time. */
+typedef unsigned int phase_t;
+#define GROUP_BIT(group)		((phase_t) (1U << (group)))
+/* The phase in which ALL_CONTROLLERS[@index] is green on its own. */
+#define CONTROLLER_PHASE(index)	((phase_t) (3U << (2 * (index))))
+
+/*
+ * Picks the phases for one intersection when non-conflicting lanes of
+ * different controllers are allowed to be green together.
+ */
+struct phase_sched_t {
+	/* Which groups can be green alongside each group? */
+	phase_t compatible[NUM_SIGNAL_GROUPS];
+	/* In which cycle was each group last green? */
+	uint64_t last_green[NUM_SIGNAL_GROUPS];
+	uint64_t cycle;
+};
+
+void phase_sched_init(struct phase_sched_t *sched);
+/*
+ * Pick the next phase given the number of vehicles waiting in each group.
+ * The group that has been waiting longest for a green always gets one, along
+ * with as many other groups with vehicles waiting as are compatible with it.
+ */
+phase_t phase_pick(struct phase_sched_t *sched, const int demand[NUM_SIGNAL_GROUPS]);
+
+/* Which of ALL_CONTROLLERS[@index]'s lanes (a bitmask of dir_t) are green in @phase? */
+unsigned int phase_lanes(phase_t phase, int index);
+
+#endif /* !PHASE_H */
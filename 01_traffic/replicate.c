@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Monte Carlo replication runner. A single run is a single noisy sample, so
+ * rather than read anything into one, we run independent replications (each
+ * with its own seed, and so its own random streams -- see rng.h) and report
+ * the mean of each statistic over them with a confidence interval. Rounds of
+ * replications are run until that interval is as narrow as was asked for, so
+ * an easy configuration only takes as many runs as it needs.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replicate.h"
+#include "stats.h"
+#include "sweep.h"
+#include "traffic.h"
+
+/*
+ * Don't trust the confidence interval to stop on until there are at least
+ * this many replications -- with only two or three, two that happen to agree
+ * give a very narrow (and very wrong) interval.
+ */
+#define REPLICATE_MIN	5
+
+struct replicate_ctx {
+	const struct param_point_t *point;
+	/* Replication number of the first job of the current round. */
+	int first;
+	int (*run)(const struct param_point_t *point, int replication,
+	           struct replication_t *result);
+};
+
+/* sweep_map() callback -- one replication of the current round. */
+static int replicate_job(size_t index, void *result, void *arg)
+{
+	struct replicate_ctx *ctx = arg;
+
+	return ctx->run(ctx->point, ctx->first + index, result);
+}
+
+/*
+ * Mean (in seconds) and CI half-width of the mean or (@p95) p95 wait of the
+ * summary at @offset in each of the @n @results, skipping replications in
+ * which nobody took that heading. Returns how many replications counted.
+ */
+static int mean_ci95(const struct replication_t *results, int n, size_t offset, bool p95,
+                     double *samples, double *mean, double *halfwidth)
+{
+	int count = 0;
+
+	for (int i = 0; i < n; i++) {
+		const struct stats_summary_t *summary =
+			(const struct stats_summary_t *) ((const char *) &results[i] + offset);
+
+		if (summary->vehicles)
+			samples[count++] = p95 ? TO_SECONDS(summary->p95) : TO_SECONDS(summary->mean);
+	}
+	*mean = stats_mean_ci95(samples, count, halfwidth);
+	return count;
+}
+
+static void print_row(FILE *out, const char *name, const struct replication_t *results, int n,
+                      size_t offset, double *samples)
+{
+	double vehicles = 0, mean, halfwidth;
+	int count;
+
+	for (int i = 0; i < n; i++)
+		vehicles += ((const struct stats_summary_t *)
+		             ((const char *) &results[i] + offset))->vehicles / (double) n;
+
+	count = mean_ci95(results, n, offset, false, samples, &mean, &halfwidth);
+	fprintf(out, "  %-7s %10.1f %6d %9.3f %9.3f", name, vehicles, count, mean, halfwidth);
+	mean_ci95(results, n, offset, true, samples, &mean, &halfwidth);
+	fprintf(out, " %9.3f %9.3f\n", mean, halfwidth);
+}
+
+int replicate_run(const struct param_point_t *point, int max, double target, int njobs,
+                  int (*run)(const struct param_point_t *point, int replication,
+                             struct replication_t *result),
+                  FILE *out)
+{
+	struct replicate_ctx ctx = {
+		.point = point,
+		.run = run,
+	};
+	struct replication_t *results = calloc(max, sizeof(*results));
+	double *samples = calloc(max, sizeof(*samples));
+	bool *ok = calloc(max, sizeof(*ok));
+	double mean = 0, halfwidth = 0;
+	int done = 0;
+
+	if (!results || !samples || !ok)
+		bail("calloc(replications) failed");
+
+	fprintf(out, "%12s %9s %9s\n", "replications", "mean", "+/-");
+	while (done < max) {
+		int round = njobs;
+		size_t failed;
+
+		/* The first round has to be big enough to stop after. */
+		if (round < REPLICATE_MIN - done)
+			round = REPLICATE_MIN - done;
+		if (round > max - done)
+			round = max - done;
+
+		ctx.first = done;
+		failed = sweep_map(round, njobs, replicate_job, &ctx, &results[done],
+		                   sizeof(*results), &ok[done]);
+		if (failed)
+			bail("%zu of the replications failed", failed);
+		done += round;
+
+		mean_ci95(results, done, offsetof(struct replication_t, total), false, samples,
+		          &mean, &halfwidth);
+		fprintf(out, "%12d %9.3f %9.3f\n", done, mean, halfwidth);
+		fflush(out);
+		if (target > 0 && done >= REPLICATE_MIN && halfwidth <= target)
+			break;
+	}
+
+	fprintf(out, "\nWait at the lights over %d replications (mean of each replication's mean and\n"
+	        "p95, in seconds, with the half-width of the 95%% confidence interval):\n", done);
+	fprintf(out, "  %-7s %10s %6s %9s %9s %9s %9s\n", "heading", "vehicles", "runs", "mean",
+	        "+/-", "p95", "+/-");
+	for (int i = 0; i < NUM_VALID_HEADINGS; i++)
+		print_row(out, heading_to_string(VALID_HEADINGS[i]), results, done,
+		          offsetof(struct replication_t, headings) + i * sizeof(results->headings[0]),
+		          samples);
+	print_row(out, "all", results, done, offsetof(struct replication_t, total), samples);
+	if (target > 0 && halfwidth > target)
+		fprintf(out, "\nThe mean wait is still only known to +/- %.3fs (not %.3fs) after "
+		        "%d replications.\n", halfwidth, target, done);
+	fflush(out);
+
+	free(results);
+	free(samples);
+	free(ok);
+	return 0;
+}
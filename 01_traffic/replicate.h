@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLICATE_H
+#define REPLICATE_H
+
+#include <stdio.h>
+
+#include "stats.h"
+#include "sweep.h"
+#include "traffic.h"
+
+/* What a single replication reports. */
+struct replication_t {
+	/* Wait at the lights over every heading, and for each heading. */
+	struct stats_summary_t total;
+	struct stats_summary_t headings[NUM_VALID_HEADINGS];
+};
+
+/*
+ * Monte Carlo replication. Run up to @max independent replications of the
+ * configuration at @point, and print the mean wait (overall, and for every
+ * heading) with its 95% confidence interval across the replications to @out.
+ *
+ * @run(point, replication, result) runs one replication, in its own process
+ * and with its own seed. The replications are run in rounds of @njobs at a
+ * time (see sweep_map()), and once the confidence interval of the overall
+ * mean wait is no wider than +/- @target seconds, no more rounds are started
+ * (@target <= 0 always runs all @max).
+ */
+int replicate_run(const struct param_point_t *point, int max, double target, int njobs,
+                  int (*run)(const struct param_point_t *point, int replication,
+                             struct replication_t *result),
+                  FILE *out);
+
+#endif /* !REPLICATE_H */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * Counter-based random numbers. Every value is a pure function of a stream key
+ * and a counter (the splitmix64 sequence starting at the key), so there is no
+ * shared generator state -- each user keeps its own counter, and a run is
+ * reproducible from the seed alone no matter how the work is interleaved.
+ */
+#define RNG_GOLDEN	0x9e3779b97f4a7c15ULL
+
+/* The splitmix64 finaliser, a bijective mix of all 64 bits. */
+static inline uint64_t rng_mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Key of the independent stream @stream of the run seeded with @seed. */
+static inline uint64_t rng_key(uint64_t seed, uint64_t stream)
+{
+	return rng_mix(seed ^ rng_mix(stream + RNG_GOLDEN));
+}
+
+/* The @counter'th value of the stream with key @key. */
+static inline uint64_t rng_u64(uint64_t key, uint64_t counter)
+{
+	return rng_mix(key + (counter + 1) * RNG_GOLDEN);
+}
+
+/* ... as a uniformly-distributed double in [0,1). */
+static inline double rng_double(uint64_t key, uint64_t counter)
+{
+	return (rng_u64(key, counter) >> 11) * 0x1.0p-53;
+}
+
+#endif /* !RNG_H */
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * M:N task scheduler. A fixed pool of workers runs stackless tasks, with each
+ * worker owning a Chase-Lev work-stealing deque ("Dynamic Circular
+ * Work-Stealing Deque", Chase and Lev 2005; memory orderings from "Correct and
+ * Efficient Work-Stealing for Weak Memory Models", Lê et al. 2013).
+ *
+ * Tasks woken by a worker go onto that worker's deque, while tasks woken by
+ * any other thread (the controllers, the timer thread or main) go onto a
+ * shared injection queue. Sleeping tasks are kept in an eventq_t by a
+ * dedicated timer thread, so a sleeping vehicle costs a heap slot rather than
+ * an OS thread.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eventq.h"
+#include "sched.h"
+#include "traffic.h"
+
+#define DEQUE_INITIAL_SIZE 256
+
+struct deque_array {
+	long size;
+	/* Previous (smaller) array -- only freed when the deque is freed. */
+	struct deque_array *prev;
+	struct task_t *buf[];
+};
+
+struct deque {
+	long top, bottom;
+	struct deque_array *array;
+};
+
+struct worker {
+	pthread_t thread;
+	struct deque deque;
+	/* Per-worker xorshift state for picking steal victims. */
+	uint32_t seed;
+};
+
+static struct {
+	struct worker *workers;
+	int nworkers;
+	bool stopping;
+
+	/*
+	 * Injection queue for tasks woken outside of a worker, linked through
+	 * task_t.next (a task is only ever queued once at a time).
+	 */
+	pthread_mutex_t inject_lock;
+	struct task_t *inject_head, *inject_tail;
+	long inject_len;
+
+	/* Idle workers sleep here. */
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	int sleepers;
+
+	/* Timer thread state. */
+	pthread_t timer_thread;
+	pthread_mutex_t timer_lock;
+	pthread_cond_t timer_cond;
+	struct eventq_t timers;
+} sched = {
+	.inject_lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle_lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER,
+	.timer_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Which worker (if any) is the current thread? */
+static __thread struct worker *current_worker;
+
+static struct deque_array *deque_array_new(long size)
+{
+	struct deque_array *array;
+
+	array = calloc(1, sizeof(*array) + size * sizeof(*array->buf));
+	if (!array)
+		bail("calloc(deque array) failed");
+	array->size = size;
+	return array;
+}
+
+static void deque_init(struct deque *deque)
+{
+	*deque = (struct deque) { .array = deque_array_new(DEQUE_INITIAL_SIZE) };
+}
+
+static void deque_free(struct deque *deque)
+{
+	struct deque_array *array = deque->array;
+	while (array) {
+		struct deque_array *prev = array->prev;
+		free(array);
+		array = prev;
+	}
+}
+
+/* Push a task onto the bottom of the deque (owner only). */
+static void deque_push(struct deque *deque, struct task_t *task)
+{
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+	if (b - t > array->size - 1) {
+		/*
+		 * Grow the array. Thieves may still be reading from the old array, so
+		 * we keep it around (chained through ->prev) until deque_free().
+		 */
+		struct deque_array *new = deque_array_new(2 * array->size);
+		for (long i = t; i < b; i++)
+			new->buf[i % new->size] = __atomic_load_n(&array->buf[i % array->size],
+			                                          __ATOMIC_RELAXED);
+		new->prev = array;
+		__atomic_store_n(&deque->array, new, __ATOMIC_RELEASE);
+		array = new;
+	}
+	__atomic_store_n(&array->buf[b % array->size], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* Pop a task from the bottom of the deque (owner only). */
+static struct task_t *deque_take(struct deque *deque)
+{
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+	struct task_t *task = NULL;
+	long t;
+
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (t <= b) {
+		task = __atomic_load_n(&array->buf[b % array->size], __ATOMIC_RELAXED);
+		if (t == b) {
+			/* Last element -- race against thieves for it. */
+			if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+			                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				task = NULL;
+			__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		/* Empty. */
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/* Steal a task from the top of the deque (any thread). */
+static struct task_t *deque_steal(struct deque *deque)
+{
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	long b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (t < b) {
+		struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+		struct task_t *task = __atomic_load_n(&array->buf[t % array->size],
+		                                      __ATOMIC_RELAXED);
+		if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+		                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			/* Lost the race (to the owner or another thief). */
+			return NULL;
+		return task;
+	}
+	return NULL;
+}
+
+static bool deque_empty(struct deque *deque)
+{
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	return b <= t;
+}
+
+static void inject_push(struct task_t **tasks, size_t n)
+{
+	struct task_t *head, *tail;
+
+	if (!n)
+		return;
+
+	/* Build the chain outside the lock, then splice it in. */
+	for (size_t i = 0; i + 1 < n; i++)
+		tasks[i]->next = tasks[i + 1];
+	head = tasks[0];
+	tail = tasks[n - 1];
+	tail->next = NULL;
+
+	pthread_mutex_lock(&sched.inject_lock);
+	if (sched.inject_tail)
+		sched.inject_tail->next = head;
+	else
+		sched.inject_head = head;
+	sched.inject_tail = tail;
+	__atomic_add_fetch(&sched.inject_len, n, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&sched.inject_lock);
+}
+
+static struct task_t *inject_pop(void)
+{
+	struct task_t *task;
+
+	/* Avoid taking the lock in the (common) empty case. */
+	if (!__atomic_load_n(&sched.inject_len, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	pthread_mutex_lock(&sched.inject_lock);
+	task = sched.inject_head;
+	if (task) {
+		sched.inject_head = task->next;
+		if (!sched.inject_head)
+			sched.inject_tail = NULL;
+		__atomic_sub_fetch(&sched.inject_len, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&sched.inject_lock);
+	return task;
+}
+
+static bool work_available(void)
+{
+	if (__atomic_load_n(&sched.inject_len, __ATOMIC_SEQ_CST))
+		return true;
+	for (int i = 0; i < sched.nworkers; i++)
+		if (!deque_empty(&sched.workers[i].deque))
+			return true;
+	return false;
+}
+
+/* Wake up an idle worker (or all of them), if there are any. */
+static void notify_idle(bool all)
+{
+	/*
+	 * Pairs with the fence in worker_idle() -- either we see the sleeper or
+	 * the sleeper sees our newly-queued task.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&sched.sleepers, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&sched.idle_lock);
+	if (all)
+		pthread_cond_broadcast(&sched.idle_cond);
+	else
+		pthread_cond_signal(&sched.idle_cond);
+	pthread_mutex_unlock(&sched.idle_lock);
+}
+
+static void worker_idle(void)
+{
+	pthread_mutex_lock(&sched.idle_lock);
+	__atomic_add_fetch(&sched.sleepers, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!work_available() && !sched.stopping)
+		pthread_cond_wait(&sched.idle_cond, &sched.idle_lock);
+	__atomic_sub_fetch(&sched.sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&sched.idle_lock);
+}
+
+static struct task_t *worker_steal(struct worker *self)
+{
+	/* Start at a random victim so thieves don't all pile onto worker 0. */
+	int start;
+
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+	start = self->seed % sched.nworkers;
+
+	for (int i = 0; i < sched.nworkers; i++) {
+		struct worker *victim = &sched.workers[(start + i) % sched.nworkers];
+		struct task_t *task;
+
+		if (victim == self)
+			continue;
+		task = deque_steal(&victim->deque);
+		if (task)
+			return task;
+	}
+	return NULL;
+}
+
+static void *worker_start(void *arg)
+{
+	struct worker *self = arg;
+
+	current_worker = self;
+	while (!__atomic_load_n(&sched.stopping, __ATOMIC_ACQUIRE)) {
+		struct task_t *task = deque_take(&self->deque);
+
+		if (!task)
+			task = inject_pop();
+		if (!task)
+			task = worker_steal(self);
+		if (!task) {
+			worker_idle();
+			continue;
+		}
+		task->run(task);
+	}
+	return NULL;
+}
+
+static void *timer_start(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&sched.timer_lock);
+	while (!sched.stopping) {
+		struct event_t event;
+		struct timespec deadline;
+
+		if (eventq_empty(&sched.timers)) {
+			pthread_cond_wait(&sched.timer_cond, &sched.timer_lock);
+			continue;
+		}
+
+		/* Fire everything that has expired. */
+		event = sched.timers.heap[0];
+		if (event.when <= monotonic_now()) {
+			eventq_pop(&sched.timers, &event);
+			pthread_mutex_unlock(&sched.timer_lock);
+			sched_wake(event.data);
+			pthread_mutex_lock(&sched.timer_lock);
+			continue;
+		}
+
+		deadline = simtime_to_timespec(event.when);
+		pthread_cond_timedwait(&sched.timer_cond, &sched.timer_lock, &deadline);
+	}
+	pthread_mutex_unlock(&sched.timer_lock);
+	return NULL;
+}
+
+int sched_init(int nworkers)
+{
+	pthread_condattr_t attr;
+
+	if (nworkers < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Timer deadlines are CLOCK_MONOTONIC, so the condvar must match. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched.timer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (eventq_init(&sched.timers) < 0)
+		return -1;
+
+	sched.nworkers = nworkers;
+	sched.workers = calloc(nworkers, sizeof(*sched.workers));
+	if (!sched.workers)
+		return -1;
+	for (int i = 0; i < nworkers; i++) {
+		deque_init(&sched.workers[i].deque);
+		sched.workers[i].seed = 2463534242U + i;
+	}
+
+	for (int i = 0; i < nworkers; i++) {
+		errno = pthread_create(&sched.workers[i].thread, NULL, worker_start,
+		                       &sched.workers[i]);
+		if (errno)
+			return -1;
+	}
+	errno = pthread_create(&sched.timer_thread, NULL, timer_start, NULL);
+	if (errno)
+		return -1;
+	return 0;
+}
+
+void sched_shutdown(void)
+{
+	__atomic_store_n(&sched.stopping, true, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&sched.idle_lock);
+	pthread_cond_broadcast(&sched.idle_cond);
+	pthread_mutex_unlock(&sched.idle_lock);
+
+	pthread_mutex_lock(&sched.timer_lock);
+	pthread_cond_signal(&sched.timer_cond);
+	pthread_mutex_unlock(&sched.timer_lock);
+
+	for (int i = 0; i < sched.nworkers; i++)
+		pthread_join(sched.workers[i].thread, NULL);
+	pthread_join(sched.timer_thread, NULL);
+
+	for (int i = 0; i < sched.nworkers; i++)
+		deque_free(&sched.workers[i].deque);
+	free(sched.workers);
+	eventq_free(&sched.timers);
+	while (inject_pop())
+		;
+}
+
+void sched_wake(struct task_t *task)
+{
+	sched_wake_many(&task, 1);
+}
+
+void sched_wake_many(struct task_t **tasks, size_t n)
+{
+	if (current_worker)
+		for (size_t i = 0; i < n; i++)
+			deque_push(&current_worker->deque, tasks[i]);
+	else
+		inject_push(tasks, n);
+	notify_idle(n > 1);
+}
+
+void sched_sleep(struct task_t *task, simtime_t duration)
+{
+	simtime_t when = monotonic_now() + duration;
+
+	pthread_mutex_lock(&sched.timer_lock);
+	if (eventq_push(&sched.timers, when, 0, task) < 0)
+		bail("eventq_push(timer) failed");
+	/* Only need to poke the timer thread if we're the new earliest timer. */
+	if (sched.timers.heap[0].data == task)
+		pthread_cond_signal(&sched.timer_cond);
+	pthread_mutex_unlock(&sched.timer_lock);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+
+#include "timeutil.h"
+
+/*
+ * Get a pointer to the structure containing @ptr (which points to the @member
+ * field of a @type).
+ */
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/*
+ * A lightweight task, run by a fixed pool of worker threads. Tasks are
+ * stackless -- ->run is called every time the task is runnable, and it has to
+ * save whatever state it needs in the enclosing structure before returning.
+ * A task is only ever run by one worker at a time, but it must not touch its
+ * own memory after having arranged to be woken up again (sched_sleep() or a
+ * parked mailbox), because another worker may already be running it.
+ */
+struct task_t {
+	void (*run)(struct task_t *task);
+	/* Next task in the injection queue (owned by the scheduler). */
+	struct task_t *next;
+};
+
+/*
+ * Start @nworkers worker threads (and a timer thread). Each worker has its own
+ * work-stealing deque; idle workers steal from the others.
+ */
+int sched_init(int nworkers);
+/* Stop all of the worker threads (tasks still queued are never run). */
+void sched_shutdown(void);
+
+/* Make @task runnable (it will be run by some worker). */
+void sched_wake(struct task_t *task);
+/* Make a batch of tasks runnable at once (cheaper than sched_wake() each). */
+void sched_wake_many(struct task_t **tasks, size_t n);
+/* Make @task runnable again after @duration ns (without blocking a worker). */
+void sched_sleep(struct task_t *task, simtime_t duration);
+
+#endif /* !SCHED_H */
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Arrival schedules generated in bulk, and alias tables. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrival.h"
+#include "rng.h"
+#include "schedule.h"
+#include "traffic.h"
+
+/*
+ * Random streams of the schedules are tagged with this bit, so they never
+ * meet the per-heading generators' streams (counted up from 0 by
+ * arrivals_init()) or NETWORK_ROUTE_STREAM.
+ */
+#define SCHEDULE_STREAM		(1ULL << 62)
+
+int alias_init(struct alias_table_t *table, const double *weights, size_t n)
+{
+	uint32_t *small, *large;
+	size_t nsmall = 0, nlarge = 0;
+	double total = 0;
+
+	*table = (struct alias_table_t) { .n = n };
+	for (size_t i = 0; i < n; i++) {
+		if (!(weights[i] >= 0))
+			goto err_inval;
+		total += weights[i];
+	}
+	if (!n || n > UINT32_MAX || !(total > 0))
+		goto err_inval;
+
+	table->prob = malloc(n * sizeof(*table->prob));
+	table->alias = malloc(n * sizeof(*table->alias));
+	small = malloc(n * sizeof(*small));
+	large = malloc(n * sizeof(*large));
+	if (!table->prob || !table->alias || !small || !large) {
+		free(small);
+		free(large);
+		alias_free(table);
+		return -1;
+	}
+
+	/*
+	 * Scale the weights so that they average 1, then fill every column that
+	 * is short of 1 with the excess of one that isn't (Vose's method).
+	 */
+	for (size_t i = 0; i < n; i++) {
+		table->prob[i] = weights[i] * n / total;
+		table->alias[i] = i;
+		if (table->prob[i] < 1)
+			small[nsmall++] = i;
+		else
+			large[nlarge++] = i;
+	}
+	while (nsmall && nlarge) {
+		uint32_t s = small[--nsmall], l = large[--nlarge];
+
+		table->alias[s] = l;
+		table->prob[l] -= 1 - table->prob[s];
+		if (table->prob[l] < 1)
+			small[nsmall++] = l;
+		else
+			large[nlarge++] = l;
+	}
+	/* Whatever is left is only short of (or over) 1 by rounding. */
+	while (nsmall)
+		table->prob[small[--nsmall]] = 1;
+	while (nlarge)
+		table->prob[large[--nlarge]] = 1;
+
+	free(small);
+	free(large);
+	return 0;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+void alias_free(struct alias_table_t *table)
+{
+	free(table->prob);
+	free(table->alias);
+	*table = (struct alias_table_t) { 0 };
+}
+
+/*
+ * Read a file of "<x> <y>" lines (with # comments) into @xs and @ys, which
+ * have to be non-negative.
+ */
+static int load_pairs(const char *path, double **xs, double **ys, size_t *n)
+{
+	FILE *file = fopen(path, "r");
+	char *line = NULL;
+	size_t len = 0, cap = 0;
+	int lineno = 0, ret = 0;
+
+	*xs = *ys = NULL;
+	*n = 0;
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (getline(&line, &len, file) >= 0) {
+		char *comment = strchr(line, '#'), *start = line, junk;
+		double x, y;
+
+		lineno++;
+		if (comment)
+			*comment = '\0';
+		while (isspace((unsigned char) *start))
+			start++;
+		if (!*start)
+			continue;
+		if (sscanf(start, "%lf %lf %c", &x, &y, &junk) != 2 || !(x >= 0) || !(y >= 0)) {
+			fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+			ret = -1;
+			break;
+		}
+		if (*n == cap) {
+			cap = cap ? 2 * cap : 64;
+			*xs = realloc(*xs, cap * sizeof(**xs));
+			*ys = realloc(*ys, cap * sizeof(**ys));
+			if (!*xs || !*ys)
+				bail("realloc(%s) failed", path);
+		}
+		(*xs)[*n] = x;
+		(*ys)[(*n)++] = y;
+	}
+	if (!ret && !*n) {
+		fprintf(stderr, "%s: empty\n", path);
+		ret = -1;
+	}
+	free(line);
+	fclose(file);
+	if (ret < 0) {
+		free(*xs);
+		free(*ys);
+		*xs = *ys = NULL;
+	}
+	return ret;
+}
+
+/* Load a time-of-day profile of "<start> <rate>" lines. */
+static int load_profile(struct schedule_spec_t *spec, const char *path)
+{
+	double *starts, *rates;
+	size_t n, k = 0;
+
+	if (load_pairs(path, &starts, &rates, &n) < 0)
+		return -1;
+
+	/* Until the first line, arrivals come at the normal rate. */
+	spec->nprofile = n + (starts[0] > 0);
+	spec->profile_start = malloc(spec->nprofile * sizeof(*spec->profile_start));
+	spec->profile_rate = malloc(spec->nprofile * sizeof(*spec->profile_rate));
+	spec->profile_op = malloc(spec->nprofile * sizeof(*spec->profile_op));
+	if (!spec->profile_start || !spec->profile_rate || !spec->profile_op)
+		bail("malloc(%s) failed", path);
+	if (starts[0] > 0) {
+		spec->profile_start[k] = 0;
+		spec->profile_rate[k++] = 1;
+	}
+	for (size_t i = 0; i < n; i++, k++) {
+		spec->profile_start[k] = SECONDS(starts[i]);
+		spec->profile_rate[k] = rates[i];
+	}
+	free(starts);
+	free(rates);
+
+	spec->profile_op[0] = 0;
+	for (k = 1; k < spec->nprofile; k++) {
+		if (spec->profile_start[k] <= spec->profile_start[k - 1]) {
+			fprintf(stderr, "%s: start times have to go up\n", path);
+			return -1;
+		}
+		spec->profile_op[k] = spec->profile_op[k - 1] + spec->profile_rate[k - 1] *
+		                      (spec->profile_start[k] - spec->profile_start[k - 1]);
+	}
+	/* Otherwise the last arrivals would never come. */
+	if (!(spec->profile_rate[spec->nprofile - 1] > 0)) {
+		fprintf(stderr, "%s: the last rate has to be positive\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Load an empirical gap distribution of "<gap> <count>" lines. */
+static int load_counts(struct schedule_spec_t *spec, const char *path)
+{
+	double *gaps, *counts;
+	size_t n;
+	int ret;
+
+	if (load_pairs(path, &gaps, &counts, &n) < 0)
+		return -1;
+
+	spec->gaps = malloc(n * sizeof(*spec->gaps));
+	if (!spec->gaps)
+		bail("malloc(%s) failed", path);
+	for (size_t i = 0; i < n; i++)
+		spec->gaps[i] = SECONDS(gaps[i]);
+	ret = alias_init(&spec->gap_table, counts, n);
+	if (ret < 0)
+		fprintf(stderr, "%s: no gaps counted\n", path);
+
+	free(gaps);
+	free(counts);
+	return ret;
+}
+
+int schedule_spec_parse(struct schedule_spec_t *spec, const char *arg)
+{
+	const char *path = strchr(arg, ':');
+	size_t len = path ? (size_t) (path++ - arg) : strlen(arg);
+	int ret = 0;
+
+	*spec = (struct schedule_spec_t) { 0 };
+	if (len == strlen("uniform") && !strncmp(arg, "uniform", len) && !path) {
+		spec->dist = SCHEDULE_UNIFORM;
+	} else if (len == strlen("poisson") && !strncmp(arg, "poisson", len)) {
+		spec->dist = SCHEDULE_POISSON;
+		if (path)
+			ret = load_profile(spec, path);
+	} else if (len == strlen("empirical") && !strncmp(arg, "empirical", len) && path) {
+		spec->dist = SCHEDULE_EMPIRICAL;
+		ret = load_counts(spec, path);
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ret < 0)
+		schedule_spec_free(spec);
+	return ret;
+}
+
+void schedule_spec_free(struct schedule_spec_t *spec)
+{
+	free(spec->gaps);
+	alias_free(&spec->gap_table);
+	free(spec->profile_start);
+	free(spec->profile_rate);
+	free(spec->profile_op);
+	*spec = (struct schedule_spec_t) { 0 };
+}
+
+int schedule_init(struct schedule_t *sched, const struct schedule_spec_t *spec,
+                  const struct traffic_params *params, uint64_t stream)
+{
+	double rates[NUM_VALID_HEADINGS], total = 0;
+
+	/*
+	 * Keep the rate of every heading that of its own generator, whose gaps
+	 * average (max_gap + ARRIVAL_TICK) / 2.
+	 */
+	for (size_t i = 0; i < ARRAY_LENGTH(rates); i++) {
+		rates[i] = 2.0 / (params->max_arrival_gap[VALID_HEADINGS[i]] + ARRIVAL_TICK);
+		total += rates[i];
+	}
+
+	*sched = (struct schedule_t) {
+		.spec = spec,
+		.mean_gap = 1 / total,
+		.gap_key = rng_key(params->seed, SCHEDULE_STREAM | 2 * stream),
+		.heading_key = rng_key(params->seed, SCHEDULE_STREAM | (2 * stream + 1)),
+	};
+	if (alias_init(&sched->headings, rates, ARRAY_LENGTH(rates)) < 0)
+		return -1;
+
+	schedule_fill(sched);
+	return 0;
+}
+
+void schedule_free(struct schedule_t *sched)
+{
+	alias_free(&sched->headings);
+}
+
+void schedule_fill(struct schedule_t *sched)
+{
+	const struct schedule_spec_t *spec = sched->spec;
+	double *u = sched->u, *v = sched->v;
+
+	for (size_t i = 0; i < SCHEDULE_BATCH; i++) {
+		u[i] = rng_double(sched->gap_key, sched->draws + i);
+		v[i] = rng_double(sched->heading_key, sched->draws + i);
+	}
+	sched->draws += SCHEDULE_BATCH;
+
+	/* Turn u[] into gaps (in operational time) ... */
+	switch (spec->dist) {
+	case SCHEDULE_UNIFORM:
+		for (size_t i = 0; i < SCHEDULE_BATCH; i++)
+			u[i] *= 2 * sched->mean_gap;
+		break;
+	case SCHEDULE_POISSON:
+		for (size_t i = 0; i < SCHEDULE_BATCH; i++)
+			u[i] = -sched->mean_gap * log1p(-u[i]);
+		break;
+	case SCHEDULE_EMPIRICAL:
+		for (size_t i = 0; i < SCHEDULE_BATCH; i++)
+			u[i] = spec->gaps[alias_sample(&spec->gap_table, u[i])];
+		break;
+	}
+
+	/* ... then into arrival times ... */
+	for (size_t i = 0; i < SCHEDULE_BATCH; i++) {
+		sched->clock += u[i];
+		u[i] = sched->clock;
+	}
+
+	/* ... and into real time, if the rate changes over the run. */
+	if (spec->nprofile) {
+		size_t k = sched->segment;
+
+		for (size_t i = 0; i < SCHEDULE_BATCH; i++) {
+			/* Segments with a rate of 0 take no operational time at all. */
+			while (k + 1 < spec->nprofile && u[i] >= spec->profile_op[k + 1])
+				k++;
+			u[i] = spec->profile_start[k] + (u[i] - spec->profile_op[k]) / spec->profile_rate[k];
+		}
+		sched->segment = k;
+	}
+
+	for (size_t i = 0; i < SCHEDULE_BATCH; i++) {
+		sched->when[i] = (simtime_t) (u[i] / ARRIVAL_TICK) * ARRIVAL_TICK;
+		sched->heading[i] = VALID_HEADINGS[alias_sample(&sched->headings, v[i])];
+	}
+	sched->pos = 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timeutil.h"
+#include "traffic.h"
+
+/*
+ * Walker's alias table, for drawing from a discrete distribution over n
+ * outcomes in constant time with a single uniform value: split [0,1) into n
+ * equal columns, each of which holds outcome i with probability prob[i] and
+ * outcome alias[i] otherwise.
+ */
+struct alias_table_t {
+	size_t n;
+	double *prob;
+	uint32_t *alias;
+};
+
+/* Build the table for outcomes with the (not necessarily normalised) @weights. */
+int alias_init(struct alias_table_t *table, const double *weights, size_t n);
+void alias_free(struct alias_table_t *table);
+
+/* Which outcome does the uniform value @u (in [0,1)) pick? */
+static inline uint32_t alias_sample(const struct alias_table_t *table, double u)
+{
+	double x = u * table->n;
+	uint32_t column = x;
+
+	return x - column < table->prob[column] ? column : table->alias[column];
+}
+
+/* How the gaps between two arrivals are distributed. */
+enum schedule_dist_t {
+	/* Uniform between zero and twice the mean gap. */
+	SCHEDULE_UNIFORM,
+	/* Exponential, so arrivals are a Poisson process. */
+	SCHEDULE_POISSON,
+	/* Drawn from a histogram of observed gaps. */
+	SCHEDULE_EMPIRICAL,
+};
+
+/*
+ * An arrival schedule (traffic -D), shared by every run that uses it. Rather
+ * than one generator per heading, a schedule is a single stream of arrivals
+ * over the whole intersection, whose heading is drawn from an alias table
+ * weighted by the arrival rate of each heading.
+ *
+ * The rate can also change over the course of a run (a time-of-day profile):
+ * from profile_start[k] on, arrivals come profile_rate[k] times as often. The
+ * gaps are drawn in "operational time", which runs profile_rate[k] times as
+ * fast as real time, and mapped back to real time afterwards.
+ */
+struct schedule_spec_t {
+	enum schedule_dist_t dist;
+	/* The gaps of an empirical distribution (in nanoseconds), and their odds. */
+	simtime_t *gaps;
+	struct alias_table_t gap_table;
+	/*
+	 * The profile, sorted by start time -- segment 0 always starts at time
+	 * 0, and the rate of the last segment holds forever. profile_op[k] is
+	 * the operational time at profile_start[k].
+	 */
+	size_t nprofile;
+	simtime_t *profile_start;
+	double *profile_rate, *profile_op;
+};
+
+/*
+ * Parse a schedule from @arg -- "uniform", "poisson", "poisson:<profile>" or
+ * "empirical:<counts>", where <profile> is a file of "<start> <rate>" lines
+ * (seconds, and a multiple of the normal rate) and <counts> is a file of
+ * "<gap> <count>" lines (seconds, and how many times that gap was seen).
+ */
+int schedule_spec_parse(struct schedule_spec_t *spec, const char *arg);
+void schedule_spec_free(struct schedule_spec_t *spec);
+
+/*
+ * Arrivals are generated SCHEDULE_BATCH at a time, one pass over the batch for
+ * each step (draw the random values, turn them into gaps, add the gaps up,
+ * and so on), so that each pass is a short loop over flat arrays.
+ */
+#define SCHEDULE_BATCH	4096
+
+/* The arrivals of one run of a schedule. */
+struct schedule_t {
+	const struct schedule_spec_t *spec;
+	/* Pick a heading (indexed like VALID_HEADINGS). */
+	struct alias_table_t headings;
+	/* Mean gap over the whole intersection (in nanoseconds). */
+	double mean_gap;
+	/*
+	 * Counter-based random streams for the gaps and for the headings (see
+	 * rng.h), and how many values have been drawn from each.
+	 */
+	uint64_t gap_key, heading_key, draws;
+	/* Operational time of the last arrival, and its profile segment. */
+	double clock;
+	size_t segment;
+
+	/* The current batch, of which the first ->pos have been handed out. */
+	simtime_t when[SCHEDULE_BATCH];
+	uint8_t heading[SCHEDULE_BATCH];
+	size_t pos;
+	/* Scratch space for the random values. */
+	double u[SCHEDULE_BATCH], v[SCHEDULE_BATCH];
+};
+
+/*
+ * Start stream @stream (one for each intersection) of @spec, seeded from
+ * params->seed, with the heading rates of params->max_arrival_gap.
+ */
+int schedule_init(struct schedule_t *sched, const struct schedule_spec_t *spec,
+                  const struct traffic_params *params, uint64_t stream);
+void schedule_free(struct schedule_t *sched);
+
+/* Generate the next batch (and start handing it out from the beginning). */
+void schedule_fill(struct schedule_t *sched);
+
+#endif /* !SCHEDULE_H */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Publisher side of the live state snapshot (see snapshot.h). */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "timeutil.h"
+
+static struct {
+	struct snapshot_t *shm;
+	char name[64];
+	void (*fill)(struct snapshot_state_t *state);
+	simtime_t start;
+
+	pthread_t thread;
+	bool stopping;
+} snapshot;
+
+/* Only ever called by one thread at a time (the publisher, then snapshot_stop()). */
+static void snapshot_publish(bool finished)
+{
+	struct snapshot_state_t state = { 0 };
+	uint32_t seq = snapshot.shm->seq;
+
+	snapshot.fill(&state);
+	state.elapsed = monotonic_now() - snapshot.start;
+	state.finished = finished;
+
+	__atomic_store_n(&snapshot.shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&snapshot.shm->state, &state, sizeof(state));
+	__atomic_store_n(&snapshot.shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *snapshot_publisher(void *arg)
+{
+	simtime_t next = monotonic_now();
+
+	(void) arg;
+	while (!__atomic_load_n(&snapshot.stopping, __ATOMIC_ACQUIRE)) {
+		snapshot_publish(false);
+		next += SNAPSHOT_PERIOD;
+		sleep_until(next);
+	}
+	return NULL;
+}
+
+int snapshot_start(const char *name, void (*fill)(struct snapshot_state_t *state))
+{
+	int fd;
+
+	/* shm_open() wants exactly one leading slash. */
+	snprintf(snapshot.name, sizeof(snapshot.name), "/%s", name[0] == '/' ? name + 1 : name);
+	fd = shm_open(snapshot.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, sizeof(*snapshot.shm)) < 0)
+		goto err_unlink;
+	snapshot.shm = mmap(NULL, sizeof(*snapshot.shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+	                    fd, 0);
+	if (snapshot.shm == MAP_FAILED)
+		goto err_unlink;
+	close(fd);
+
+	snapshot.fill = fill;
+	snapshot.start = monotonic_now();
+	snapshot.stopping = false;
+
+	/* The segment starts out zeroed, so it's only valid once there's a magic. */
+	snapshot.shm->version = SNAPSHOT_VERSION;
+	snapshot.shm->pid = getpid();
+	snapshot_publish(false);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(snapshot.shm->magic, SNAPSHOT_MAGIC, sizeof(snapshot.shm->magic));
+
+	if ((errno = pthread_create(&snapshot.thread, NULL, snapshot_publisher, NULL))) {
+		munmap(snapshot.shm, sizeof(*snapshot.shm));
+		snapshot.shm = NULL;
+		shm_unlink(snapshot.name);
+		return -1;
+	}
+	return 0;
+
+err_unlink:
+	close(fd);
+	shm_unlink(snapshot.name);
+	return -1;
+}
+
+void snapshot_stop(void)
+{
+	if (!snapshot.shm)
+		return;
+
+	__atomic_store_n(&snapshot.stopping, true, __ATOMIC_RELEASE);
+	pthread_join(snapshot.thread, NULL);
+	snapshot_publish(true);
+
+	/* Monitors that have it mapped can still read the final state. */
+	munmap(snapshot.shm, sizeof(*snapshot.shm));
+	snapshot.shm = NULL;
+	shm_unlink(snapshot.name);
+}
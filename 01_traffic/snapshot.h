@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timeutil.h"
+
+/*
+ * Live state of a real-time run, published to a POSIX shared-memory segment
+ * (-M <name>) for external monitors such as ./monitor. The segment holds a
+ * single struct snapshot_t, which is refreshed every SNAPSHOT_PERIOD by a
+ * publisher thread that only ever reads the simulation's state.
+ *
+ * The state is guarded by a seqlock: the publisher makes ->seq odd, copies in
+ * the new state and makes it even again, and a reader retries until it has
+ * copied out the state without ->seq changing (or being odd) under it. The
+ * publisher never waits for the readers, and the readers only ever map the
+ * segment read-only, so a monitor can't slow the simulation down.
+ *
+ * This header is shared with the monitor, so it only uses fixed-size types
+ * and names everything with strings rather than heading_t.
+ */
+#define SNAPSHOT_MAGIC				"TRAFSNAP"
+#define SNAPSHOT_VERSION			1
+#define SNAPSHOT_PERIOD				(100 * NSEC_PER_MSEC)
+
+#define SNAPSHOT_MAX_CONTROLLERS	8
+/* Each controller has two of the lanes in its entry[]. */
+#define SNAPSHOT_LANES				2
+
+struct snapshot_lane_t {
+	/* Heading that uses the lane (e.g. "n2s"). */
+	char name[8];
+	/* Vehicles waiting at the lights, and in the intersection. */
+	int32_t waiting, crossing;
+};
+
+struct snapshot_controller_t {
+	/* Heading pair (e.g. "(n2s, s2n)"). */
+	char name[16];
+	/* Is the light green, and how long until it turns red (if it is)? */
+	int32_t green;
+	simtime_t green_left;
+	/* Green phases so far, and vehicles let through in the current one. */
+	uint64_t phases;
+	int32_t phase_vehicles;
+	/* Vehicles that have crossed so far. */
+	uint64_t passed;
+	struct snapshot_lane_t lanes[SNAPSHOT_LANES];
+};
+
+/* Everything that is published, copied in and out in one go. */
+struct snapshot_state_t {
+	/* How long the run has been going, and has it finished? */
+	simtime_t elapsed;
+	int32_t finished;
+	/* Vehicles spawned so far, and in total. */
+	uint64_t spawned, total;
+	int32_t num_controllers;
+	struct snapshot_controller_t controllers[SNAPSHOT_MAX_CONTROLLERS];
+};
+
+struct snapshot_t {
+	/* Written once, before the first state is published. */
+	char magic[8];
+	uint32_t version;
+	int32_t pid;
+	/* Odd while the publisher is writing ->state. */
+	uint32_t seq;
+	struct snapshot_state_t state;
+};
+
+/* Copy out a consistent @state from @snapshot (never blocks the publisher). */
+static inline void snapshot_read(const struct snapshot_t *snapshot,
+                                 struct snapshot_state_t *state)
+{
+	for (;;) {
+		uint32_t seq = __atomic_load_n(&snapshot->seq, __ATOMIC_ACQUIRE);
+
+		if (!(seq & 1)) {
+			memcpy(state, (const void *) &snapshot->state, sizeof(*state));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED) == seq)
+				return;
+		}
+		sched_yield();
+	}
+}
+
+/*
+ * Create the segment /@name and start publishing to it every SNAPSHOT_PERIOD,
+ * with @fill filling in the state (everything but ->elapsed and ->finished).
+ */
+int snapshot_start(const char *name, void (*fill)(struct snapshot_state_t *state));
+/* Publish the final state (marked as finished), and remove the segment. */
+void snapshot_stop(void);
+
+#endif /* !SNAPSHOT_H */
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Wait-time and throughput statistics. Shards are handed out to threads the
+ * same way as the log rings in log.c (see struct claim_list_t) -- a thread
+ * claims a free shard the first time it records something, and releases it
+ * again when it exits.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr.h"
+#include "sched.h"
+#include "stats.h"
+
+struct stats_shard {
+	/* Time spent waiting at the lights, by heading. */
+	struct hdr_hist_t wait[NUM_VALID_HEADINGS];
+	/* Number of vehicles let through in each green phase, by controller. */
+	struct hdr_hist_t per_green[NUM_CONTROLLERS];
+	/* Total lane time (both lanes) spent green, by controller. */
+	simtime_t green_time[NUM_CONTROLLERS];
+	/* How much of that green lane time had a vehicle crossing? */
+	simtime_t busy_time[NUM_CONTROLLERS];
+
+	struct claim_node_t claim;
+};
+
+static struct claim_list_t shards;
+
+static __thread struct stats_shard *current_shard;
+
+/* Index of each heading in VALID_HEADINGS. */
+static const int HEADING_INDEX[NUM_HEADINGS] = {
+#	define HEADING_GENERIC(start, end, name)									\
+	[PACK_HEADING(start, end)] = HEADING_IDX_##start##_##end,
+#	include "heading-list.h"
+};
+
+static struct claim_node_t *shard_alloc(void)
+{
+	/* calloc() of a shard this size is mmap-backed, so untouched buckets are free. */
+	struct stats_shard *shard = calloc(1, sizeof(*shard));
+
+	if (!shard)
+		bail("calloc(stats shard) failed");
+	return &shard->claim;
+}
+
+static void shard_free(struct claim_node_t *node)
+{
+	free(container_of(node, struct stats_shard, claim));
+}
+
+static struct stats_shard *shard_get(void)
+{
+	if (!current_shard)
+		current_shard = container_of(claim_list_claim(&shards, shard_alloc),
+		                             struct stats_shard, claim);
+	return current_shard;
+}
+
+int stats_init(void)
+{
+	return claim_list_init(&shards);
+}
+
+void stats_free(void)
+{
+	claim_list_destroy(&shards, shard_free);
+	current_shard = NULL;
+}
+
+void stats_vehicle(vehicle_t vehicle)
+{
+	struct stats_shard *shard = shard_get();
+	heading_t heading = VEHICLES.heading[vehicle];
+	int controller = controller_index(HEADING_CONTROLLERS[heading]);
+	simtime_t admitted = VEHICLES.admitted[vehicle], left = VEHICLES.left[vehicle];
+	simtime_t red_deadline = VEHICLES.red_deadline[vehicle], busy_until;
+
+	hdr_record(&shard->wait[HEADING_INDEX[heading]], admitted - VEHICLES.arrived[vehicle]);
+
+	/* Only the part of the crossing that happened while we were green. */
+	busy_until = left < red_deadline ? left : red_deadline;
+	if (busy_until > admitted)
+		shard->busy_time[controller] += busy_until - admitted;
+}
+
+void stats_green(const struct light_controller_t *controller, int lanes, simtime_t green)
+{
+	shard_get()->green_time[controller_index(controller)] += lanes * green;
+}
+
+void stats_red(const struct light_controller_t *controller, int vehicles)
+{
+	hdr_record(&shard_get()->per_green[controller_index(controller)], vehicles);
+}
+
+void stats_green_cut(const struct light_controller_t *controller, int lanes, simtime_t unused)
+{
+	shard_get()->green_time[controller_index(controller)] -= lanes * unused;
+}
+
+/* Merge every shard into a new one (which the caller has to free). */
+static struct stats_shard *stats_merge(void)
+{
+	struct stats_shard *total = calloc(1, sizeof(*total));
+	struct claim_node_t *node;
+
+	if (!total)
+		bail("calloc(stats total) failed");
+
+	/* Every thread that recorded anything has finished by now. */
+	for (node = claim_list_first(&shards); node; node = node->next) {
+		struct stats_shard *shard = container_of(node, struct stats_shard, claim);
+
+		for (int i = 0; i < NUM_VALID_HEADINGS; i++)
+			hdr_merge(&total->wait[i], &shard->wait[i]);
+		for (int i = 0; i < NUM_CONTROLLERS; i++) {
+			hdr_merge(&total->per_green[i], &shard->per_green[i]);
+			total->green_time[i] += shard->green_time[i];
+			total->busy_time[i] += shard->busy_time[i];
+		}
+	}
+	return total;
+}
+
+void stats_report(FILE *out)
+{
+	struct stats_shard *total = stats_merge();
+
+	fprintf(out, "\nWait at the lights (seconds):\n");
+	fprintf(out, "  %-8s %9s %9s %9s %9s %9s\n",
+	        "heading", "vehicles", "p50", "p90", "p99", "max");
+	for (int i = 0; i < NUM_VALID_HEADINGS; i++) {
+		const struct hdr_hist_t *wait = &total->wait[i];
+
+		fprintf(out, "  %-8s %9" PRIu64, heading_to_string(VALID_HEADINGS[i]), wait->count);
+		if (wait->count)
+			fprintf(out, " %9.3f %9.3f %9.3f %9.3f\n",
+			        TO_SECONDS(hdr_percentile(wait, 50)),
+			        TO_SECONDS(hdr_percentile(wait, 90)),
+			        TO_SECONDS(hdr_percentile(wait, 99)),
+			        TO_SECONDS(wait->max));
+		else
+			fprintf(out, " %9s %9s %9s %9s\n", "-", "-", "-", "-");
+	}
+
+	fprintf(out, "\nGreen phases:\n");
+	fprintf(out, "  %-12s %7s %11s %9s %9s %14s\n",
+	        "controller", "phases", "vehicles", "per green", "max", "idle green");
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		const struct light_controller_t *controller = ALL_CONTROLLERS[i];
+		const struct hdr_hist_t *per_green = &total->per_green[i];
+		simtime_t idle = total->green_time[i] - total->busy_time[i];
+		char name[16];
+
+		snprintf(name, sizeof(name), "(%s, %s)", heading_to_string(controller->id[0]),
+		         heading_to_string(controller->id[1]));
+		fprintf(out, "  %-12s %7" PRIu64 " %11" PRId64 " %9.2f %9" PRId64 " %8.3fs %3.0f%%\n",
+		        name, per_green->count, per_green->sum, hdr_mean(per_green),
+		        per_green->max, TO_SECONDS(idle),
+		        total->green_time[i] ? 100.0 * idle / total->green_time[i] : 0);
+	}
+
+	free(total);
+}
+
+/* Two-sided 95% quantiles of Student's t, by degrees of freedom. */
+static const double T95[] = {
+	0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+/* ... and the normal approximation past the end of the table. */
+#define Z95		1.960
+
+double stats_mean_ci95(const double *samples, int n, double *halfwidth)
+{
+	double mean = 0, var = 0;
+
+	for (int i = 0; i < n; i++)
+		mean += samples[i] / n;
+	for (int i = 0; i < n; i++)
+		var += (samples[i] - mean) * (samples[i] - mean);
+
+	if (n < 2)
+		*halfwidth = INFINITY;
+	else
+		*halfwidth = ((size_t) n - 1 < ARRAY_LENGTH(T95) ? T95[n - 1] : Z95) *
+		             sqrt(var / (n - 1) / n);
+	return mean;
+}
+
+static void summarise(const struct hdr_hist_t *wait, struct stats_summary_t *summary)
+{
+	*summary = (struct stats_summary_t) {
+		.vehicles = wait->count,
+		.mean = hdr_mean(wait),
+		.p50 = hdr_percentile(wait, 50),
+		.p95 = hdr_percentile(wait, 95),
+		.p99 = hdr_percentile(wait, 99),
+		.max = wait->max,
+	};
+}
+
+void stats_summary(struct stats_summary_t *summary)
+{
+	struct stats_shard *total = stats_merge();
+	struct hdr_hist_t *wait = &total->wait[0];
+
+	for (int i = 1; i < NUM_VALID_HEADINGS; i++)
+		hdr_merge(wait, &total->wait[i]);
+	summarise(wait, summary);
+	free(total);
+}
+
+void stats_summary_headings(struct stats_summary_t summaries[NUM_VALID_HEADINGS])
+{
+	struct stats_shard *total = stats_merge();
+
+	for (int i = 0; i < NUM_VALID_HEADINGS; i++)
+		summarise(&total->wait[i], &summaries[i]);
+	free(total);
+}
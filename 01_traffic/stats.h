@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "timeutil.h"
+#include "traffic.h"
+
+/*
+ * Run statistics. Every thread records into its own shard (so recording never
+ * takes a lock or bounces a cache line), and the shards are only merged by
+ * stats_report() once the run is over.
+ */
+int stats_init(void);
+void stats_free(void);
+
+/*
+ * Record a vehicle that has left the intersection (its arrived, admitted,
+ * left and red_deadline must all be filled in).
+ */
+void stats_vehicle(vehicle_t vehicle);
+/*
+ * Record that @lanes of @controller's lanes have turned green for @green, and
+ * that the controller has turned red again after letting @vehicles into the
+ * intersection. If a green phase is cut short (or the run ends in the middle
+ * of it), the part of it that never happened has to be taken off again with
+ * stats_green_cut().
+ */
+void stats_green(const struct light_controller_t *controller, int lanes, simtime_t green);
+void stats_red(const struct light_controller_t *controller, int vehicles);
+void stats_green_cut(const struct light_controller_t *controller, int lanes, simtime_t unused);
+
+/* Merge all of the shards and print a summary. */
+void stats_report(FILE *out);
+
+/* Wait at the lights over every heading (in nanoseconds). */
+struct stats_summary_t {
+	uint64_t vehicles;
+	double mean;
+	simtime_t p50, p95, p99, max;
+};
+
+/* Merge all of the shards into @summary. */
+void stats_summary(struct stats_summary_t *summary);
+/* ... and into one summary per heading (indexed like VALID_HEADINGS). */
+void stats_summary_headings(struct stats_summary_t summaries[NUM_VALID_HEADINGS]);
+
+/*
+ * Mean of @n independent samples, and the half-width of its 95% confidence
+ * interval (Student's t, so it holds up for a handful of samples).
+ */
+double stats_mean_ci95(const double *samples, int n, double *halfwidth);
+
+#endif /* !STATS_H */
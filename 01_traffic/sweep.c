@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Non-interactive run parameters, and parameter sweeps. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "stats.h"
+#include "sweep.h"
+#include "traffic.h"
+
+const struct param_info_t PARAM_INFO[NUM_PARAMS] = {
+	[PARAM_VEHICLES] = { "vehicles", "the total number of vehicles", true },
+	[PARAM_ARRIVAL_GAP] = { "arrival_gap", "vehicles arrival rate", false },
+	[PARAM_INTERSECTION_GAP] = {
+		"intersection_gap", "minimum interval between two consecutive vehicles", false,
+	},
+	[PARAM_TRUNK_GREEN] = {
+		"trunk_green", "green time for forward-moving vehicles on trunk road", false,
+	},
+	[PARAM_MINOR_GREEN] = { "minor_green", "green time for vehicles on minor road", false },
+	[PARAM_RIGHT_GREEN] = {
+		"right_green", "green time for right-turning vehicles on trunk road", false,
+	},
+};
+
+/* Ranges may overshoot their last value by this much (rounding of the steps). */
+#define RANGE_SLACK		1e-9
+
+static void values_push(double **values, size_t *count, size_t *cap, double value)
+{
+	if (*count == *cap) {
+		*cap = *cap ? 2 * *cap : 8;
+		*values = realloc(*values, *cap * sizeof(**values));
+		if (!*values)
+			bail("realloc(param values) failed");
+	}
+	(*values)[(*count)++] = value;
+}
+
+/* Parse a single number, which has to take up the whole of @str. */
+static bool parse_number(const char *str, double *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtod(str, &end);
+	while (isspace((unsigned char) *end))
+		end++;
+	return end != str && !*end && !errno && isfinite(*value);
+}
+
+int param_set_parse(struct param_set_t *set, const char *assignment)
+{
+	char *copy = strdup(assignment), *name, *list, *item, *saveptr;
+	double *values = NULL;
+	size_t count = 0, cap = 0;
+	int param;
+
+	if (!copy)
+		bail("strdup(param) failed");
+
+	list = strchr(copy, '=');
+	if (!list)
+		goto err_syntax;
+	*list++ = '\0';
+
+	/* Trim the name (config files can have spaces around the '='). */
+	for (name = copy; isspace((unsigned char) *name); name++)
+		;
+	for (char *end = list - 1; end > name && isspace((unsigned char) end[-1]); end--)
+		end[-1] = '\0';
+	for (param = 0; param < NUM_PARAMS; param++)
+		if (!strcmp(name, PARAM_INFO[param].name))
+			break;
+	if (param == NUM_PARAMS) {
+		fprintf(stderr, "unknown parameter '%s'\n", name);
+		goto err;
+	}
+
+	for (item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *first = item, *last = strchr(item, ':'), *step;
+		double from, to, by;
+
+		if (!last) {
+			if (!parse_number(first, &from))
+				goto err_syntax;
+			values_push(&values, &count, &cap, from);
+			continue;
+		}
+		*last++ = '\0';
+		step = strchr(last, ':');
+		if (!step)
+			goto err_syntax;
+		*step++ = '\0';
+		if (!parse_number(first, &from) || !parse_number(last, &to) ||
+		    !parse_number(step, &by) || by <= 0 || to < from)
+			goto err_syntax;
+		for (size_t i = 0; from + i * by <= to + RANGE_SLACK; i++)
+			values_push(&values, &count, &cap, from + i * by);
+	}
+	if (!count)
+		goto err_syntax;
+
+	for (size_t i = 0; i < count; i++) {
+		if (values[i] < 0 || (PARAM_INFO[param].integer && values[i] != floor(values[i]))) {
+			fprintf(stderr, "%s can't be %g\n", name, values[i]);
+			goto err;
+		}
+	}
+
+	free(set->values[param]);
+	set->values[param] = values;
+	set->count[param] = count;
+	free(copy);
+	return 0;
+
+err_syntax:
+	fprintf(stderr, "expected <name>=<value>[,<first>:<last>:<step>]..., got '%s'\n",
+	        assignment);
+err:
+	free(values);
+	free(copy);
+	return -1;
+}
+
+int param_set_load(struct param_set_t *set, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0, ret = 0;
+
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (getline(&line, &len, file) >= 0) {
+		char *comment = strchr(line, '#'), *start = line;
+
+		lineno++;
+		if (comment)
+			*comment = '\0';
+		while (isspace((unsigned char) *start))
+			start++;
+		if (!*start)
+			continue;
+		if (param_set_parse(set, start) < 0) {
+			fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+			ret = -1;
+			break;
+		}
+	}
+	free(line);
+	fclose(file);
+	return ret;
+}
+
+void param_set_add(struct param_set_t *set, int param, double value)
+{
+	size_t cap = set->count[param];
+
+	values_push(&set->values[param], &set->count[param], &cap, value);
+}
+
+void param_set_free(struct param_set_t *set)
+{
+	for (int i = 0; i < NUM_PARAMS; i++)
+		free(set->values[i]);
+	*set = (struct param_set_t) { 0 };
+}
+
+size_t param_set_points(const struct param_set_t *set)
+{
+	size_t points = 1;
+
+	for (int i = 0; i < NUM_PARAMS; i++)
+		points *= set->count[i];
+	return points;
+}
+
+void param_set_point(const struct param_set_t *set, size_t index,
+                     struct param_point_t *point)
+{
+	for (int i = NUM_PARAMS - 1; i >= 0; i--) {
+		point->values[i] = set->values[i][index % set->count[i]];
+		index /= set->count[i];
+	}
+}
+
+size_t sweep_map(size_t n, int njobs, int (*run)(size_t index, void *result, void *arg),
+                 void *arg, void *results, size_t result_size, bool *ok)
+{
+	size_t next = 0, done = 0, failed = 0;
+	pid_t *pids;
+	char *shared;
+	int running = 0;
+
+	if (!n)
+		return 0;
+	pids = calloc(n, sizeof(*pids));
+	if (!pids)
+		bail("calloc(sweep pids) failed");
+	shared = mmap(NULL, n * result_size, PROT_READ | PROT_WRITE,
+	              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		bail("mmap(sweep results) failed");
+
+	/* Otherwise every child would flush its own copy of anything buffered. */
+	fflush(NULL);
+
+	while (done < n) {
+		int status;
+		pid_t pid;
+		size_t index;
+
+		while (running < njobs && next < n) {
+			pid = fork();
+			if (pid < 0)
+				bail("fork(sweep run %zu) failed", next);
+			if (!pid)
+				_exit(run(next, shared + next * result_size, arg) ? 1 : 0);
+			pids[next++] = pid;
+			running++;
+		}
+
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			bail("wait(sweep run) failed");
+		}
+		for (index = 0; index < next && pids[index] != pid; index++)
+			;
+		if (index == next)
+			continue;
+		running--;
+		done++;
+
+		ok[index] = WIFEXITED(status) && !WEXITSTATUS(status);
+		if (ok[index])
+			memcpy((char *) results + index * result_size,
+			       shared + index * result_size, result_size);
+		else
+			failed++;
+	}
+
+	munmap(shared, n * result_size);
+	free(pids);
+	return failed;
+}
+
+struct sweep_arg {
+	const struct param_set_t *set;
+	int (*run)(const struct param_point_t *point, struct stats_summary_t *summary);
+};
+
+static int sweep_point(size_t index, void *result, void *arg)
+{
+	struct sweep_arg *sweep = arg;
+	struct param_point_t point;
+
+	param_set_point(sweep->set, index, &point);
+	return sweep->run(&point, result);
+}
+
+/* Columns are at least as wide as their name. */
+static int column_width(const char *name)
+{
+	int width = strlen(name);
+	return width < 9 ? 9 : width;
+}
+
+int sweep_run(const struct param_set_t *set, int njobs,
+              int (*run)(const struct param_point_t *point, struct stats_summary_t *summary),
+              FILE *out)
+{
+	struct sweep_arg arg = { .set = set, .run = run };
+	size_t n = param_set_points(set), failed;
+	struct stats_summary_t *summaries = calloc(n, sizeof(*summaries));
+	bool *ok = calloc(n, sizeof(*ok));
+
+	if (!summaries || !ok)
+		bail("calloc(sweep results) failed");
+	failed = sweep_map(n, njobs, sweep_point, &arg, summaries, sizeof(*summaries), ok);
+
+	/* Every row has the parameters, then the wait at the lights (in seconds). */
+	for (int i = 0; i < NUM_PARAMS; i++)
+		fprintf(out, "%*s ", column_width(PARAM_INFO[i].name), PARAM_INFO[i].name);
+	fprintf(out, "%9s %9s %9s %9s %9s %9s\n", "done", "mean", "p50", "p95", "p99", "max");
+
+	for (size_t i = 0; i < n; i++) {
+		const struct stats_summary_t *summary = &summaries[i];
+		struct param_point_t point;
+
+		param_set_point(set, i, &point);
+		for (int j = 0; j < NUM_PARAMS; j++)
+			fprintf(out, "%*.*f ", column_width(PARAM_INFO[j].name),
+			        PARAM_INFO[j].integer ? 0 : 3, point.values[j]);
+		if (!ok[i]) {
+			fprintf(out, "%9s %9s %9s %9s %9s %9s\n", "failed", "-", "-", "-", "-", "-");
+			continue;
+		}
+		fprintf(out, "%9" PRIu64 " %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+		        summary->vehicles, TO_SECONDS(summary->mean), TO_SECONDS(summary->p50),
+		        TO_SECONDS(summary->p95), TO_SECONDS(summary->p99),
+		        TO_SECONDS(summary->max));
+	}
+	fflush(out);
+
+	free(summaries);
+	free(ok);
+	return failed ? -1 : 0;
+}
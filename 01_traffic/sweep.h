@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+/*
+ * The run parameters that main() prompts for, in prompt order. They can also
+ * be given on the command line (-o) or in a config file (-f), in which case
+ * each of them can take a list of values -- and a run with more than one value
+ * for anything becomes a sweep over every combination.
+ */
+enum {
+	PARAM_VEHICLES,
+	PARAM_ARRIVAL_GAP,
+	PARAM_INTERSECTION_GAP,
+	PARAM_TRUNK_GREEN,
+	PARAM_MINOR_GREEN,
+	PARAM_RIGHT_GREEN,
+	NUM_PARAMS,
+};
+
+struct param_info_t {
+	/* Key used by -o and config files. */
+	const char *name;
+	/* What main() prompts with. */
+	const char *prompt;
+	/* Vehicle counts are integers, everything else is in seconds. */
+	bool integer;
+};
+
+extern const struct param_info_t PARAM_INFO[NUM_PARAMS];
+
+/* One value for every parameter (vehicle count, then times in seconds). */
+struct param_point_t {
+	double values[NUM_PARAMS];
+};
+
+/* Every value given for each parameter. */
+struct param_set_t {
+	double *values[NUM_PARAMS];
+	size_t count[NUM_PARAMS];
+};
+
+/*
+ * Parse "<name>=<values>", replacing any values given for <name> so far.
+ * <values> is a comma-separated list of numbers or inclusive ranges
+ * (<first>:<last>:<step>). Returns -1 (with a message on stderr) on error.
+ */
+int param_set_parse(struct param_set_t *set, const char *assignment);
+/*
+ * Read a config file with one "<name> = <values>" per line (blank lines and
+ * everything after a '#' are ignored).
+ */
+int param_set_load(struct param_set_t *set, const char *path);
+/* Add a single value for @param. */
+void param_set_add(struct param_set_t *set, int param, double value);
+void param_set_free(struct param_set_t *set);
+
+/* How many combinations of values are there? */
+size_t param_set_points(const struct param_set_t *set);
+/* The @index'th combination (the last parameter varies fastest). */
+void param_set_point(const struct param_set_t *set, size_t index,
+                     struct param_point_t *point);
+
+/*
+ * Run @run(@index, @result, @arg) for every @index in [0, @n), each in its own
+ * forked process, with up to @njobs of them at a time. The simulator keeps its
+ * state in globals, so a process per run is the only way to run them side by
+ * side. Each run fills in its @result_size byte slot of @results (which lives
+ * in shared memory while it runs), and returns 0 on success. Returns how many
+ * runs failed, with ok[index] set for the ones that didn't.
+ */
+size_t sweep_map(size_t n, int njobs, int (*run)(size_t index, void *result, void *arg),
+                 void *arg, void *results, size_t result_size, bool *ok);
+
+/*
+ * Run a simulation for every point of @set, @njobs at a time, and write one
+ * row per point to @out. @run sets up and runs the simulation for @point and
+ * fills in @summary.
+ */
+int sweep_run(const struct param_set_t *set, int njobs,
+              int (*run)(const struct param_point_t *point, struct stats_summary_t *summary),
+              FILE *out);
+
+#endif /* !SWEEP_H */
@@ -17,13 +17,201 @@
 
 /* Synchronisation helpers. */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "sync.h"
 
+#ifdef LOCKSTAT
+
+/* Every named lock, in the order they were named. */
+static struct {
+	pthread_mutex_t lock;
+	struct lockstat_t *head, *tail;
+	bool started;
+} lockstats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t lockstat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Account for somebody who started waiting at @start and has just got through. */
+static uint64_t lockstat_waited(struct lockstat_t *stat, uint64_t start, bool contended)
+{
+	uint64_t now = lockstat_now();
+
+	__atomic_add_fetch(&stat->acquisitions, 1, __ATOMIC_RELAXED);
+	if (contended)
+		__atomic_add_fetch(&stat->contended, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat->wait_ns, now - start, __ATOMIC_RELAXED);
+	return now;
+}
+
+static void lockstat_released(struct lockstat_t *stat)
+{
+	__atomic_add_fetch(&stat->hold_ns, lockstat_now() - stat->acquired_at, __ATOMIC_RELAXED);
+}
+
+/*
+ * The hooks used by the locks below. Barriers can be passed by several
+ * threads at once, so they only get LOCKSTAT_PASSED() and no hold time.
+ */
+#	define LOCKSTAT_START(var)			uint64_t var = lockstat_now()
+#	define LOCKSTAT_ACQUIRED(lock, start, contended)						\
+	((lock)->stat.acquired_at = lockstat_waited(&(lock)->stat, start, contended))
+#	define LOCKSTAT_PASSED(lock, start, contended)							\
+	((void) lockstat_waited(&(lock)->stat, start, contended))
+#	define LOCKSTAT_RELEASED(lock)		lockstat_released(&(lock)->stat)
+#	define LOCKSTAT_WOKEN(lock, n)											\
+	__atomic_add_fetch(&(lock)->stat.wakeups, n, __ATOMIC_RELAXED)
+#	define LOCKSTAT_PARKED(waiter, start)	((waiter)->parked_at = (start))
+#	define LOCKSTAT_FORGET(lock)		lockstat_unregister(&(lock)->stat)
+
+void lockstat_register(struct lockstat_t *stat, const char *group, const char *name)
+{
+	pthread_mutex_lock(&lockstats.lock);
+	snprintf(stat->group, sizeof(stat->group), "%s", group);
+	snprintf(stat->name, sizeof(stat->name), "%s", name);
+	if (!stat->registered) {
+		stat->registered = true;
+		stat->next = NULL;
+		if (lockstats.tail)
+			lockstats.tail->next = stat;
+		else
+			lockstats.head = stat;
+		lockstats.tail = stat;
+	}
+	pthread_mutex_unlock(&lockstats.lock);
+}
+
+void lockstat_unregister(struct lockstat_t *stat)
+{
+	struct lockstat_t **link, *prev = NULL;
+
+	pthread_mutex_lock(&lockstats.lock);
+	for (link = &lockstats.head; *link; prev = *link, link = &(*link)->next) {
+		if (*link != stat)
+			continue;
+		*link = stat->next;
+		if (lockstats.tail == stat)
+			lockstats.tail = prev;
+		stat->registered = false;
+		break;
+	}
+	pthread_mutex_unlock(&lockstats.lock);
+}
+
+static void lockstat_row(FILE *out, const char *group, const char *name,
+                         const struct lockstat_t *totals)
+{
+	uint64_t acquisitions = totals->acquisitions ? totals->acquisitions : 1;
+
+	fprintf(out, "  %-24s %-10s %10" PRIu64 " %10" PRIu64 " %5.1f%% %10.1f %10.1f %10"
+	        PRIu64 "\n", group, name, totals->acquisitions, totals->contended,
+	        100.0 * totals->contended / acquisitions,
+	        totals->wait_ns / 1e3 / acquisitions, totals->hold_ns / 1e3 / acquisitions,
+	        totals->wakeups);
+}
+
+static void lockstat_add(struct lockstat_t *totals, const struct lockstat_t *stat)
+{
+	totals->acquisitions += __atomic_load_n(&stat->acquisitions, __ATOMIC_RELAXED);
+	totals->contended += __atomic_load_n(&stat->contended, __ATOMIC_RELAXED);
+	totals->wakeups += __atomic_load_n(&stat->wakeups, __ATOMIC_RELAXED);
+	totals->wait_ns += __atomic_load_n(&stat->wait_ns, __ATOMIC_RELAXED);
+	totals->hold_ns += __atomic_load_n(&stat->hold_ns, __ATOMIC_RELAXED);
+}
+
+void lockstat_dump(FILE *out)
+{
+	pthread_mutex_lock(&lockstats.lock);
+	fprintf(out, "Lock statistics (wait and hold are the mean per acquisition, in us):\n");
+	fprintf(out, "  %-24s %-10s %10s %10s %6s %10s %10s %10s\n", "group", "lock",
+	        "acquired", "contended", "%", "wait", "hold", "wakeups");
+
+	/* The locks of a group are named together, so they are next to each other. */
+	for (struct lockstat_t *first = lockstats.head, *stat; first; first = stat) {
+		struct lockstat_t group = { 0 };
+		int members = 0;
+
+		for (stat = first; stat && !strcmp(stat->group, first->group); stat = stat->next) {
+			struct lockstat_t one = { 0 };
+
+			lockstat_add(&one, stat);
+			lockstat_add(&group, stat);
+			lockstat_row(out, first->group, stat->name, &one);
+			members++;
+		}
+		if (members > 1)
+			lockstat_row(out, first->group, "total", &group);
+	}
+	pthread_mutex_unlock(&lockstats.lock);
+	fflush(out);
+}
+
+static void *lockstat_dumper(void *arg)
+{
+	sigset_t *signals = arg;
+	int signal;
+
+	for (;;)
+		if (!sigwait(signals, &signal))
+			lockstat_dump(stderr);
+	return NULL;
+}
+
+int lockstat_init(void)
+{
+	static sigset_t signals;
+	pthread_t thread;
+
+	if (lockstats.started)
+		return 0;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)))
+		return -1;
+	if ((errno = pthread_create(&thread, NULL, lockstat_dumper, &signals)))
+		return -1;
+	pthread_detach(thread);
+	lockstats.started = true;
+	return 0;
+}
+
+#else /* !LOCKSTAT */
+
+#	define LOCKSTAT_START(var)
+#	define LOCKSTAT_ACQUIRED(lock, start, contended)	((void) (contended))
+#	define LOCKSTAT_PASSED(lock, start, contended)		((void) (contended))
+#	define LOCKSTAT_RELEASED(lock)						((void) 0)
+#	define LOCKSTAT_WOKEN(lock, n)						((void) (n))
+#	define LOCKSTAT_PARKED(waiter, start)				((void) 0)
+#	define LOCKSTAT_FORGET(lock)						((void) 0)
+
+#endif /* LOCKSTAT */
+
 arcsem_t *arcsem_new(unsigned int value)
 {
 	arcsem_t *sem = malloc(sizeof(*sem));
@@ -31,7 +219,6 @@ arcsem_t *arcsem_new(unsigned int value)
 		return NULL;
 
 	*sem = (arcsem_t) {
-		.lock = PTHREAD_MUTEX_INITIALIZER,
 		.count = 1,
 	};
 	if (sem_init(&sem->inner, 0, value) < 0)
@@ -49,12 +236,30 @@ arcsem_t *arcsem_get(arcsem_t *sem)
 	if (!sem)
 		return NULL;
 
-	pthread_mutex_lock(&sem->lock);
-	sem->count++;
-	pthread_mutex_unlock(&sem->lock);
+	/* We already hold a reference, so nobody can free it under us. */
+	__atomic_add_fetch(&sem->count, 1, __ATOMIC_RELAXED);
 	return sem;
 }
 
+static void arcsem_pool_return(arcsem_pool_t *pool, arcsem_t *sem)
+{
+	/*
+	 * Reset the value to 0 for the next user -- we hold the only reference, so
+	 * nobody else can be posting to it.
+	 */
+	while (sem_trywait(&sem->inner) == 0)
+		;
+
+	/*
+	 * Push onto the returned stack. There's no ABA problem because only the
+	 * owner ever removes anything, and it takes the whole stack at once.
+	 */
+	sem->next_free = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pool->returned, &sem->next_free, sem,
+	                                    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
 void arcsem_put(arcsem_t *sem)
 {
 	int count;
@@ -62,39 +267,323 @@ void arcsem_put(arcsem_t *sem)
 	if (!sem)
 		return;
 
-	pthread_mutex_lock(&sem->lock);
-	count = --sem->count;
-	pthread_mutex_unlock(&sem->lock);
+	count = __atomic_sub_fetch(&sem->count, 1, __ATOMIC_ACQ_REL);
 
 	/* This is a bug -- every put() must be paired with get(). */
 	if (count < 0)
 		abort();
-	/* No users left, time to free. */
+	/* No users left, time to free (or recycle). */
 	if (count == 0) {
+		if (sem->pool) {
+			arcsem_pool_return(sem->pool, sem);
+		} else {
+			sem_destroy(&sem->inner);
+			free(sem);
+		}
+	}
+}
+
+arcsem_t *arcsem_pool_get(arcsem_pool_t *pool)
+{
+	arcsem_t *sem = pool->free;
+
+	/* Grab everything that has been returned since we last looked. */
+	if (!sem)
+		sem = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+
+	if (sem) {
+		pool->free = sem->next_free;
+		sem->next_free = NULL;
+		__atomic_store_n(&sem->count, 1, __ATOMIC_RELAXED);
+		return sem;
+	}
+
+	/* Pool is empty, so we need a new one. */
+	sem = arcsem_new(0);
+	if (sem)
+		sem->pool = pool;
+	return sem;
+}
+
+static void arcsem_free_list(arcsem_t *sem)
+{
+	while (sem) {
+		arcsem_t *next = sem->next_free;
 		sem_destroy(&sem->inner);
 		free(sem);
+		sem = next;
 	}
 }
 
+void arcsem_pool_drain(arcsem_pool_t *pool)
+{
+	arcsem_free_list(pool->free);
+	arcsem_free_list(__atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE));
+	pool->free = NULL;
+}
+
 void mailbox_init(signal_mailbox_t *mbox)
 {
 	*mbox = (signal_mailbox_t) SIGNAL_MAILBOX_INITIALIZER;
 }
 
-void mailbox_signal(signal_mailbox_t *mbox, arcsem_t *receipt)
+static long futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+#ifdef MAILBOX_FUTEX
+
+/* Wake up one thread sleeping in mailbox_wait_lock(), if there are any. */
+static void mailbox_wake_sleeper(signal_mailbox_t *mbox)
+{
+	/*
+	 * Pairs with the increment in mailbox_wait_lock() -- either we see the
+	 * sleeper, or its FUTEX_WAIT sees the state change we just made.
+	 */
+	if (__atomic_load_n(&mbox->sleepers, __ATOMIC_SEQ_CST))
+		futex(&mbox->state, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static void mailbox_parklock(signal_mailbox_t *mbox)
+{
+	while (__atomic_fetch_or(&mbox->state, MBOX_PARKLOCK, __ATOMIC_ACQUIRE) & MBOX_PARKLOCK)
+		sched_yield();
+}
+
+static void mailbox_parkunlock(signal_mailbox_t *mbox)
+{
+	__atomic_fetch_and(&mbox->state, ~MBOX_PARKLOCK, __ATOMIC_RELEASE);
+}
+
+/* Is there a pending signal, with nobody holding the mailbox? */
+static bool mailbox_takeable(uint32_t state)
+{
+	return state >= MBOX_PERMIT && !(state & MBOX_LOCKED);
+}
+
+/*
+ * If there is a pending signal and the mailbox is free, hand it to the first
+ * parked waiter (and wake it up).
+ */
+static void mailbox_handoff(signal_mailbox_t *mbox)
+{
+	struct mailbox_waiter_t *waiter = NULL;
+	uint32_t state;
+
+	mailbox_parklock(mbox);
+	state = __atomic_load_n(&mbox->state, __ATOMIC_SEQ_CST);
+	while (mbox->parked_head && mailbox_takeable(state)) {
+		uint32_t new = (state - MBOX_PERMIT) | MBOX_LOCKED;
+
+		if (!__atomic_compare_exchange_n(&mbox->state, &state, new, false,
+		                                 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+
+		waiter = mbox->parked_head;
+		mbox->parked_head = waiter->next;
+		if (!mbox->parked_head) {
+			mbox->parked_tail = NULL;
+			__atomic_fetch_and(&mbox->state, ~MBOX_PARKED, __ATOMIC_SEQ_CST);
+		}
+		LOCKSTAT_ACQUIRED(mbox, waiter->parked_at, true);
+		break;
+	}
+	mailbox_parkunlock(mbox);
+
+	if (waiter) {
+		LOCKSTAT_WOKEN(mbox, 1);
+		waiter->wake(waiter);
+	}
+}
+
+/* Drop ownership of the mailbox, and post (and drop) the receipt. */
+static void mailbox_drop(signal_mailbox_t *mbox)
+{
+	arcsem_t *receipt = NULL;
+	uint32_t old;
+
+	LOCKSTAT_RELEASED(mbox);
+
+	/*
+	 * The receipt belongs to whichever signal we consumed, so once all of its
+	 * permits are used up take it out of the mailbox -- the next signal will
+	 * bring its own. The park lock keeps a new signal from slipping in
+	 * between (see mailbox_signal_many()), which would have us take its
+	 * receipt instead.
+	 */
+	mailbox_parklock(mbox);
+	if (__atomic_load_n(&mbox->state, __ATOMIC_SEQ_CST) < MBOX_PERMIT)
+		receipt = __atomic_exchange_n(&mbox->receipt, NULL, __ATOMIC_ACQ_REL);
+	mailbox_parkunlock(mbox);
+	if (receipt) {
+		sem_post(&receipt->inner);
+		arcsem_put(receipt);
+	}
+
+	old = __atomic_fetch_and(&mbox->state, ~MBOX_LOCKED, __ATOMIC_SEQ_CST);
+	if (old >= MBOX_PERMIT) {
+		mailbox_wake_sleeper(mbox);
+		if (old & MBOX_PARKED)
+			mailbox_handoff(mbox);
+	}
+}
+
+void mailbox_signal_many(signal_mailbox_t *mbox, arcsem_t *receipt, unsigned int permits)
+{
+	arcsem_t *old;
+	uint32_t state, new;
+
+	/*
+	 * The receipt and the permits have to appear together, or a holder that
+	 * is just dropping the mailbox could take (and post) the new receipt
+	 * while it still sees no permits.
+	 */
+	mailbox_parklock(mbox);
+	old = __atomic_exchange_n(&mbox->receipt, arcsem_get(receipt), __ATOMIC_ACQ_REL);
+	state = __atomic_load_n(&mbox->state, __ATOMIC_RELAXED);
+	do {
+		new = (state & MBOX_FLAGS) | permits * MBOX_PERMIT;
+	} while (!__atomic_compare_exchange_n(&mbox->state, &state, new, true,
+	                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	mailbox_parkunlock(mbox);
+
+	/* Free old semaphore. */
+	arcsem_put(old);
+	/* Nobody can take the signal until the owner unlocks. */
+	if (state & MBOX_LOCKED)
+		return;
+	mailbox_wake_sleeper(mbox);
+	if (state & MBOX_PARKED)
+		mailbox_handoff(mbox);
+}
+
+void mailbox_retract(signal_mailbox_t *mbox)
+{
+	__atomic_fetch_and(&mbox->state, MBOX_FLAGS, __ATOMIC_SEQ_CST);
+	arcsem_put(__atomic_exchange_n(&mbox->receipt, NULL, __ATOMIC_ACQ_REL));
+}
+
+void mailbox_wait_lock(signal_mailbox_t *mbox)
+{
+	uint32_t state = __atomic_load_n(&mbox->state, __ATOMIC_RELAXED);
+	bool slept = false;
+	int oldtype;
+	LOCKSTAT_START(start);
+
+	for (;;) {
+		/* Fast path -- a pending signal and nobody holding the mailbox. */
+		if (mailbox_takeable(state)) {
+			uint32_t new = (state - MBOX_PERMIT) | MBOX_LOCKED;
+			if (__atomic_compare_exchange_n(&mbox->state, &state, new, false,
+			                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				LOCKSTAT_ACQUIRED(mbox, start, slept);
+				return;
+			}
+			continue;
+		}
+
+		/*
+		 * Slow path -- sleep until the word changes. A raw syscall isn't a
+		 * cancellation point (unlike pthread_cond_wait), so we have to allow
+		 * asynchronous cancellation while we're asleep to let main() cancel
+		 * the controllers.
+		 */
+		__atomic_add_fetch(&mbox->sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
+		futex(&mbox->state, FUTEX_WAIT_PRIVATE, state);
+		pthread_setcanceltype(oldtype, NULL);
+		__atomic_sub_fetch(&mbox->sleepers, 1, __ATOMIC_SEQ_CST);
+		LOCKSTAT_WOKEN(mbox, 1);
+		slept = true;
+		state = __atomic_load_n(&mbox->state, __ATOMIC_RELAXED);
+	}
+}
+
+void mailbox_unlock(signal_mailbox_t *mbox)
+{
+	mailbox_drop(mbox);
+}
+
+bool mailbox_park(signal_mailbox_t *mbox, struct mailbox_waiter_t *waiter)
+{
+	uint32_t state = __atomic_load_n(&mbox->state, __ATOMIC_RELAXED);
+	LOCKSTAT_START(start);
+
+	/* Fast path -- the signal is already here (and nobody is queued). */
+	while (mailbox_takeable(state) && !(state & MBOX_PARKED)) {
+		uint32_t new = (state - MBOX_PERMIT) | MBOX_LOCKED;
+		if (__atomic_compare_exchange_n(&mbox->state, &state, new, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			LOCKSTAT_ACQUIRED(mbox, start, false);
+			return true;
+		}
+	}
+
+	mailbox_parklock(mbox);
+	LOCKSTAT_PARKED(waiter, start);
+	waiter->next = NULL;
+	if (mbox->parked_tail)
+		mbox->parked_tail->next = waiter;
+	else
+		mbox->parked_head = waiter;
+	mbox->parked_tail = waiter;
+	__atomic_fetch_or(&mbox->state, MBOX_PARKED, __ATOMIC_SEQ_CST);
+	mailbox_parkunlock(mbox);
+
+	/* A signal may have arrived before we set MBOX_PARKED. */
+	mailbox_handoff(mbox);
+	return false;
+}
+
+void mailbox_release(signal_mailbox_t *mbox)
+{
+	mailbox_drop(mbox);
+}
+
+#else /* !MAILBOX_FUTEX */
+
+/*
+ * If there is a pending signal and the mailbox is free, hand it to the first
+ * parked waiter. Must be called with mbox->lock held, and the returned waiter
+ * (if any) must be woken after dropping the lock.
+ */
+static struct mailbox_waiter_t *mailbox_handoff(signal_mailbox_t *mbox)
+{
+	struct mailbox_waiter_t *waiter = mbox->parked_head;
+
+	if (!waiter || !mbox->permits || mbox->held)
+		return NULL;
+
+	mbox->parked_head = waiter->next;
+	if (!mbox->parked_head)
+		mbox->parked_tail = NULL;
+	mbox->permits--;
+	mbox->held = true;
+	LOCKSTAT_ACQUIRED(mbox, waiter->parked_at, true);
+	LOCKSTAT_WOKEN(mbox, 1);
+	return waiter;
+}
+
+void mailbox_signal_many(signal_mailbox_t *mbox, arcsem_t *receipt, unsigned int permits)
 {
 	arcsem_t *old, *new = arcsem_get(receipt);
+	struct mailbox_waiter_t *waiter;
 
 	pthread_mutex_lock(&mbox->lock);
 	/* Swap receipt semaphore. */
 	old = mbox->receipt;
 	mbox->receipt = new;
-	/* Pending signal. */
-	mbox->pending = true;
+	/* Pending signals. */
+	mbox->permits = permits;
 	pthread_cond_signal(&mbox->cond);
+	waiter = mailbox_handoff(mbox);
 	pthread_mutex_unlock(&mbox->lock);
 	/* Free old semaphore. */
 	arcsem_put(old);
+
+	if (waiter)
+		waiter->wake(waiter);
 }
 
 void mailbox_retract(signal_mailbox_t *mbox)
@@ -106,44 +595,390 @@ void mailbox_retract(signal_mailbox_t *mbox)
 	old = mbox->receipt;
 	mbox->receipt = NULL;
 	/* Clear pending signals. */
-	mbox->pending = false;
+	mbox->permits = 0;
 	pthread_mutex_unlock(&mbox->lock);
 	/* Free old semaphore. */
 	arcsem_put(old);
 }
 
+/*
+ * The holder of the mailbox is marked by ->held rather than by keeping
+ * mbox->lock, so the lock is only ever held for a few instructions -- never
+ * for a vehicle's whole crossing -- and signalling or retracting doesn't have
+ * to wait for the holder.
+ */
 void mailbox_wait_lock(signal_mailbox_t *mbox)
 {
+	bool contended;
+	LOCKSTAT_START(start);
+
 	pthread_mutex_lock(&mbox->lock);
-	while (!mbox->pending)
+	contended = !mbox->permits || mbox->held;
+	while (!mbox->permits || mbox->held) {
 		pthread_cond_wait(&mbox->cond, &mbox->lock);
-	mbox->pending = false;
+		LOCKSTAT_WOKEN(mbox, 1);
+	}
+	mbox->permits--;
+	mbox->held = true;
+	LOCKSTAT_ACQUIRED(mbox, start, contended);
+	pthread_mutex_unlock(&mbox->lock);
 }
 
 void mailbox_unlock(signal_mailbox_t *mbox)
 {
-	if (mbox->receipt)
+	mailbox_release(mbox);
+}
+
+bool mailbox_park(signal_mailbox_t *mbox, struct mailbox_waiter_t *waiter)
+{
+	bool taken = false;
+	LOCKSTAT_START(start);
+
+	pthread_mutex_lock(&mbox->lock);
+	if (mbox->permits && !mbox->held && !mbox->parked_head) {
+		/* Fast path -- the signal is already here. */
+		mbox->permits--;
+		mbox->held = true;
+		LOCKSTAT_ACQUIRED(mbox, start, false);
+		taken = true;
+	} else {
+		LOCKSTAT_PARKED(waiter, start);
+		waiter->next = NULL;
+		if (mbox->parked_tail)
+			mbox->parked_tail->next = waiter;
+		else
+			mbox->parked_head = waiter;
+		mbox->parked_tail = waiter;
+	}
+	pthread_mutex_unlock(&mbox->lock);
+	return taken;
+}
+
+void mailbox_release(signal_mailbox_t *mbox)
+{
+	struct mailbox_waiter_t *waiter;
+
+	pthread_mutex_lock(&mbox->lock);
+	LOCKSTAT_RELEASED(mbox);
+	/* Either the next holder carries on, or the sender gets its receipt. */
+	if (mbox->permits)
+		pthread_cond_signal(&mbox->cond);
+	else if (mbox->receipt)
 		sem_post(&mbox->receipt->inner);
+	mbox->held = false;
+	waiter = mailbox_handoff(mbox);
 	pthread_mutex_unlock(&mbox->lock);
+
+	if (waiter)
+		waiter->wake(waiter);
+}
+
+#endif /* MAILBOX_FUTEX */
+
+void mailbox_signal(signal_mailbox_t *mbox, arcsem_t *receipt)
+{
+	mailbox_signal_many(mbox, receipt, 1);
+}
+
+/* A thread queued by mailbox_wait_fifo(). */
+struct mailbox_ticket_t {
+	struct mailbox_waiter_t waiter;
+	sem_t granted;
+};
+
+static void mailbox_ticket_wake(struct mailbox_waiter_t *waiter)
+{
+	struct mailbox_ticket_t *ticket = (struct mailbox_ticket_t *) waiter;
+	sem_post(&ticket->granted);
 }
 
-void barrier_init(barrier_t *barrier, int required)
+void mailbox_wait_fifo(signal_mailbox_t *mbox)
 {
-	*barrier = (barrier_t) {
+	struct mailbox_ticket_t ticket = { .waiter.wake = mailbox_ticket_wake };
+
+	/* The ticket lives on our stack, since we can't leave before it's used. */
+	sem_init(&ticket.granted, 0, 0);
+	if (!mailbox_park(mbox, &ticket.waiter))
+		while (sem_wait(&ticket.granted) < 0 && errno == EINTR)
+			;
+	sem_destroy(&ticket.granted);
+}
+
+int condvar_barrier_init(condvar_barrier_t *barrier, int required)
+{
+	*barrier = (condvar_barrier_t) {
+		.required = required,
 		.remaining = required,
 		.lock = PTHREAD_MUTEX_INITIALIZER,
 		.cond = PTHREAD_COND_INITIALIZER,
 	};
+	return 0;
 }
 
-void barrier_wait(barrier_t *barrier)
+void condvar_barrier_wait(condvar_barrier_t *barrier)
 {
+	unsigned int generation;
+	bool last;
+	LOCKSTAT_START(start);
+
 	pthread_mutex_lock(&barrier->lock);
-	/* The last thread to hit the barrier wakes up the rest. */
-	if (--barrier->remaining == 0)
+	generation = barrier->generation;
+	/* The last thread to hit the barrier resets it and wakes up the rest. */
+	last = --barrier->remaining == 0;
+	if (last) {
+		barrier->remaining = barrier->required;
+		barrier->generation++;
 		pthread_cond_broadcast(&barrier->cond);
+	}
 	/* Wait until the group wake-up -- loop to avoid spurrious wake-ups. */
-	while (barrier->remaining > 0)
+	while (barrier->generation == generation) {
 		pthread_cond_wait(&barrier->cond, &barrier->lock);
+		LOCKSTAT_WOKEN(barrier, 1);
+	}
+	LOCKSTAT_PASSED(barrier, start, !last);
 	pthread_mutex_unlock(&barrier->lock);
 }
+
+void condvar_barrier_destroy(condvar_barrier_t *barrier)
+{
+	LOCKSTAT_FORGET(barrier);
+	pthread_cond_destroy(&barrier->cond);
+	pthread_mutex_destroy(&barrier->lock);
+}
+
+/* How many times do barrier waiters check before going to sleep? */
+#define BARRIER_SPINS	256
+
+/* Has the round counter @word reached @round (allowing for wrap-around)? */
+static bool barrier_reached(uint32_t *word, uint32_t round)
+{
+	return (int32_t) (__atomic_load_n(word, __ATOMIC_ACQUIRE) - round) >= 0;
+}
+
+/*
+ * Wait for the round counter @word to reach @round. Barrier rounds are
+ * usually short, so we spin for a while first -- but with more threads than
+ * CPUs, spinning just keeps the last thread from arriving, so then we sleep on
+ * it as a futex. Returns how many times we went to sleep.
+ */
+static int barrier_sleep(uint32_t *word, uint32_t round, int *sleepers)
+{
+	int slept = 0;
+
+	for (int i = 0; i < BARRIER_SPINS; i++)
+		if (barrier_reached(word, round))
+			return 0;
+
+	__atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+	for (;; slept++) {
+		uint32_t now = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+		if ((int32_t) (now - round) >= 0)
+			break;
+		futex(word, FUTEX_WAIT_PRIVATE, now);
+	}
+	__atomic_sub_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+	return slept;
+}
+
+/* Move the round counter @word on to @round, and wake everybody up. */
+static void barrier_wake(uint32_t *word, uint32_t round, int *sleepers)
+{
+	__atomic_store_n(word, round, __ATOMIC_SEQ_CST);
+	/*
+	 * Pairs with the increment in barrier_sleep() -- either we see the
+	 * sleeper, or its FUTEX_WAIT sees the new value.
+	 */
+	if (__atomic_load_n(sleepers, __ATOMIC_SEQ_CST))
+		futex(word, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+int sense_barrier_init(sense_barrier_t *barrier, int required)
+{
+	*barrier = (sense_barrier_t) {
+		.required = required,
+		.remaining = required,
+	};
+	return 0;
+}
+
+void sense_barrier_wait(sense_barrier_t *barrier)
+{
+	/* The sense can't change until we've arrived, so this is our round's. */
+	uint32_t sense = __atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE);
+	int slept;
+	LOCKSTAT_START(start);
+
+	if (__atomic_sub_fetch(&barrier->remaining, 1, __ATOMIC_ACQ_REL)) {
+		slept = barrier_sleep(&barrier->sense, sense + 1, &barrier->sleepers);
+		LOCKSTAT_WOKEN(barrier, slept);
+		LOCKSTAT_PASSED(barrier, start, true);
+		return;
+	}
+
+	/* Last one in -- nobody can arrive for the next round until we flip. */
+	__atomic_store_n(&barrier->remaining, barrier->required, __ATOMIC_RELAXED);
+	LOCKSTAT_PASSED(barrier, start, false);
+	barrier_wake(&barrier->sense, sense + 1, &barrier->sleepers);
+}
+
+void sense_barrier_destroy(sense_barrier_t *barrier)
+{
+	LOCKSTAT_FORGET(barrier);
+	(void) barrier;
+}
+
+/* Each node gets its own cacheline, so that the subtrees don't interfere. */
+struct barrier_node_t {
+	/* How many children (threads or nodes) arrive here in each round? */
+	int required;
+	int remaining;
+	/* How many rounds have been released at this node? */
+	uint32_t released;
+	int sleepers;
+	struct barrier_node_t *parent;
+} __attribute__((aligned(64)));
+
+/* The tree is never deeper than this (BARRIER_FANIN^32 threads). */
+#define BARRIER_MAX_DEPTH	32
+
+int tree_barrier_init(tree_barrier_t *barrier, int required)
+{
+	int total = 0, level, width;
+	struct barrier_node_t *nodes;
+
+	/* Count the nodes -- one leaf for every BARRIER_FANIN threads, and so on up. */
+	for (width = required; ; width = level) {
+		level = (width + BARRIER_FANIN - 1) / BARRIER_FANIN;
+		total += level;
+		if (level == 1)
+			break;
+	}
+
+	if (posix_memalign((void **) &nodes, sizeof(*nodes), total * sizeof(*nodes)))
+		return -1;
+	*barrier = (tree_barrier_t) {
+		.required = required,
+		.nodes = nodes,
+	};
+
+	/* Each level is laid out after the one below it. */
+	for (width = required; ; width = level, nodes += level) {
+		level = (width + BARRIER_FANIN - 1) / BARRIER_FANIN;
+		for (int i = 0; i < level; i++) {
+			int children = width - i * BARRIER_FANIN;
+
+			if (children > BARRIER_FANIN)
+				children = BARRIER_FANIN;
+			nodes[i] = (struct barrier_node_t) {
+				.required = children,
+				.remaining = children,
+				.parent = level == 1 ? NULL : &nodes[level + i / BARRIER_FANIN],
+			};
+		}
+		if (level == 1)
+			break;
+	}
+	return 0;
+}
+
+void tree_barrier_wait(tree_barrier_t *barrier)
+{
+	struct barrier_node_t *path[BARRIER_MAX_DEPTH], *node;
+	unsigned long ticket;
+	uint32_t round;
+	int depth = 0, slept = -1;
+	LOCKSTAT_START(start);
+
+	/*
+	 * Every thread takes exactly one ticket per round, and nobody can start
+	 * the next round before everyone has arrived, so each round hands out the
+	 * leaf slots 0 .. required-1 exactly once.
+	 *
+	 * Releasing goes top-down, so a thread that has already been released
+	 * may arrive for the next round at a node that hasn't been released from
+	 * this one yet. That's why every node counts rounds rather than flipping
+	 * a sense, and is reset as soon as the last child arrives.
+	 */
+	ticket = __atomic_fetch_add(&barrier->tickets, 1, __ATOMIC_RELAXED);
+	round = ticket / barrier->required;
+	node = &barrier->nodes[(ticket % barrier->required) / BARRIER_FANIN];
+
+	/* Climb for as long as we're the last to arrive. */
+	for (; node; node = node->parent) {
+		if (__atomic_sub_fetch(&node->remaining, 1, __ATOMIC_ACQ_REL)) {
+			slept = barrier_sleep(&node->released, round + 1, &node->sleepers);
+			LOCKSTAT_WOKEN(barrier, slept);
+			break;
+		}
+		__atomic_store_n(&node->remaining, node->required, __ATOMIC_RELAXED);
+		path[depth++] = node;
+	}
+
+	/* We've been released (or we're the last of all), so release our subtrees. */
+	LOCKSTAT_PASSED(barrier, start, slept >= 0);
+	while (depth--)
+		barrier_wake(&path[depth]->released, round + 1, &path[depth]->sleepers);
+}
+
+void tree_barrier_destroy(tree_barrier_t *barrier)
+{
+	LOCKSTAT_FORGET(barrier);
+	free(barrier->nodes);
+}
+
+/* pthread_key_t destructor -- hand the object over to the next thread. */
+static void claim_release(void *arg)
+{
+	struct claim_node_t *node = arg;
+	__atomic_store_n(&node->owned, false, __ATOMIC_RELEASE);
+}
+
+int claim_list_init(struct claim_list_t *list)
+{
+	list->head = NULL;
+	list->count = 0;
+	if ((errno = pthread_key_create(&list->key, claim_release)))
+		return -1;
+	return 0;
+}
+
+struct claim_node_t *claim_list_claim(struct claim_list_t *list,
+                                      struct claim_node_t *(*alloc)(void))
+{
+	struct claim_node_t *node;
+
+	/* Reuse an object left behind by a thread that has exited. */
+	for (node = claim_list_first(list); node; node = node->next) {
+		bool expected = false;
+		if (__atomic_compare_exchange_n(&node->owned, &expected, true, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			goto out;
+	}
+
+	node = alloc();
+	node->owned = true;
+	node->index = __atomic_fetch_add(&list->count, 1, __ATOMIC_RELAXED);
+
+	node->next = __atomic_load_n(&list->head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&list->head, &node->next, node, true,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+out:
+	pthread_setspecific(list->key, node);
+	return node;
+}
+
+void claim_list_destroy(struct claim_list_t *list, void (*free_node)(struct claim_node_t *node))
+{
+	struct claim_node_t *node = list->head;
+
+	while (node) {
+		struct claim_node_t *next = node->next;
+		free_node(node);
+		node = next;
+	}
+	list->head = NULL;
+	list->count = 0;
+	pthread_key_delete(list->key);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Hierarchical timer wheel. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define LEVEL_SHIFT(level)	((level) * WHEEL_BITS)
+#define SLOT_MASK			(WHEEL_SLOTS - 1)
+/* Largest delta that the whole wheel can represent. */
+#define WHEEL_MAX_DELTA		((UINT64_C(1) << LEVEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+void wheel_init(struct timerwheel_t *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
+
+static void slot_push(struct wheel_timer_t **slot, struct wheel_timer_t *timer)
+{
+	timer->next = *slot;
+	*slot = timer;
+}
+
+void wheel_add(struct timerwheel_t *wheel, struct wheel_timer_t *timer)
+{
+	uint64_t expires = timer->expires, delta;
+	int level;
+
+	/* Already expired -- put it in the next slot to be processed. */
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+	delta = expires - wheel->now;
+
+	/*
+	 * Timers too far in the future are parked in the coarsest level, and will
+	 * be re-filed (with their real expiry) when that slot is cascaded.
+	 */
+	if (delta > WHEEL_MAX_DELTA)
+		expires = wheel->now + WHEEL_MAX_DELTA;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (UINT64_C(1) << LEVEL_SHIFT(level + 1)))
+			break;
+	slot_push(&wheel->slots[level][(expires >> LEVEL_SHIFT(level)) & SLOT_MASK], timer);
+}
+
+/* Re-file every timer in the given slot, which is now due to be processed. */
+static void wheel_cascade(struct timerwheel_t *wheel, int level, int idx,
+                          struct wheel_timer_t **fired)
+{
+	struct wheel_timer_t *timer = wheel->slots[level][idx];
+
+	wheel->slots[level][idx] = NULL;
+	while (timer) {
+		struct wheel_timer_t *next = timer->next;
+		if (timer->expires <= wheel->now)
+			slot_push(fired, timer);
+		else
+			wheel_add(wheel, timer);
+		timer = next;
+	}
+}
+
+struct wheel_timer_t *wheel_advance(struct timerwheel_t *wheel, uint64_t now)
+{
+	struct wheel_timer_t *fired = NULL;
+
+	while (wheel->now < now) {
+		uint64_t tick, due = wheel_next(wheel);
+		struct wheel_timer_t *timer;
+
+		/* Nothing can fire before @due, so skip the empty ticks. */
+		if (due > now) {
+			wheel->now = now;
+			break;
+		}
+		if (due > wheel->now + 1)
+			wheel->now = due - 1;
+		tick = ++wheel->now;
+
+		/* Cascade from the coarsest level down, at every level boundary. */
+		for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+			uint64_t mask = (UINT64_C(1) << LEVEL_SHIFT(level)) - 1;
+			if ((tick & mask) == 0)
+				wheel_cascade(wheel, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK,
+				              &fired);
+		}
+
+		timer = wheel->slots[0][tick & SLOT_MASK];
+		wheel->slots[0][tick & SLOT_MASK] = NULL;
+		while (timer) {
+			struct wheel_timer_t *next = timer->next;
+			slot_push(&fired, timer);
+			timer = next;
+		}
+	}
+	return fired;
+}
+
+uint64_t wheel_next(const struct timerwheel_t *wheel)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		int shift = LEVEL_SHIFT(level);
+		uint64_t base = wheel->now >> shift;
+
+		for (uint64_t i = 1; i <= WHEEL_SLOTS; i++) {
+			uint64_t when;
+
+			if (!wheel->slots[level][(base + i) & SLOT_MASK])
+				continue;
+			/* The tick at which this slot is processed (or cascaded). */
+			when = (base + i) << shift;
+			if (when < best)
+				best = when;
+			break;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+/* An intrusive timer, embedded in whatever is being timed. */
+struct wheel_timer_t {
+	/* Absolute tick at which the timer fires. */
+	uint64_t expires;
+	struct wheel_timer_t *next;
+};
+
+/*
+ * A hierarchical timer wheel (Varghese and Lauck 1987). Level 0 has one slot
+ * per tick, and each level above it has slots that are WHEEL_SLOTS times
+ * coarser. Timers are added to the finest level that can hold them and are
+ * "cascaded" down a level as the wheel turns, so adding and firing a timer is
+ * O(1) regardless of how many timers are pending.
+ */
+struct timerwheel_t {
+	/* Last tick that was processed. */
+	uint64_t now;
+	struct wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init(struct timerwheel_t *wheel, uint64_t now);
+/* Add a timer (timers that have already expired fire on the next advance). */
+void wheel_add(struct timerwheel_t *wheel, struct wheel_timer_t *timer);
+/*
+ * Turn the wheel up to (and including) tick @now, returning the list of all
+ * timers that fired (linked through ->next, in no particular order).
+ */
+struct wheel_timer_t *wheel_advance(struct timerwheel_t *wheel, uint64_t now);
+/*
+ * Return a lower bound on the next tick at which a timer could fire (or
+ * UINT64_MAX if there are no timers). Advancing to that tick may not fire
+ * anything if the nearest timer is still on a coarser level.
+ */
+uint64_t wheel_next(const struct timerwheel_t *wheel);
+
+#endif /* !TIMERWHEEL_H */
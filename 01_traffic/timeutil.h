@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMEUTIL_H
+#define TIMEUTIL_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A point in time or a duration, in nanoseconds. Every interval in the
+ * simulator is kept in these units -- the virtual-time engine counts from the
+ * start of the simulation, while everything that actually sleeps uses
+ * CLOCK_MONOTONIC (so that deadlines aren't affected by the wall clock being
+ * stepped).
+ */
+typedef int64_t simtime_t;
+
+#define NSEC_PER_USEC	1000LL
+#define NSEC_PER_MSEC	1000000LL
+#define NSEC_PER_SEC	1000000000LL
+
+/* Convert a (possibly fractional) number of seconds into a simtime_t. */
+#define SECONDS(s)	((simtime_t) ((s) * NSEC_PER_SEC))
+/* ... and back again, for printing. */
+#define TO_SECONDS(t)	((double) (t) / NSEC_PER_SEC)
+
+static inline struct timespec simtime_to_timespec(simtime_t t)
+{
+	return (struct timespec) {
+		.tv_sec = t / NSEC_PER_SEC,
+		.tv_nsec = t % NSEC_PER_SEC,
+	};
+}
+
+/* Current CLOCK_MONOTONIC time. */
+static inline simtime_t monotonic_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/* Sleep until CLOCK_MONOTONIC reaches @deadline (this is a cancellation point). */
+static inline void sleep_until(simtime_t deadline)
+{
+	struct timespec ts = simtime_to_timespec(deadline);
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Sleep for @duration nanoseconds. */
+static inline void sleep_for(simtime_t duration)
+{
+	sleep_until(monotonic_now() + duration);
+}
+
+#endif /* !TIMEUTIL_H */
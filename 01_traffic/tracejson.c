@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Convert a columnar trace (traffic -L coltrace, see coltrace.h) to Chrome's
+ * trace-event JSON, for chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Every thread of the run (light_start(), vehicle_start(), the workers of -T
+ * and so on) gets its own timeline, on which its blocking mailbox waits are
+ * drawn as slices. Green phases, the all-red gap and each vehicle's wait at
+ * the lights and crossing are drawn as async slices (so they can be followed
+ * from one thread to another), and everything else is an instant event.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coltrace.h"
+#include "log.h"
+#include "traffic.h"
+
+static const char *HEADING_NAMES[NUM_HEADINGS] = {
+#	define HEADING_GENERIC(start, end, name) [PACK_HEADING(start, end)] = name,
+#	include "heading-list.h"
+};
+
+static const char *heading_name(uint8_t heading)
+{
+	if (heading >= NUM_HEADINGS || !HEADING_NAMES[heading])
+		return "invalid-heading";
+	return HEADING_NAMES[heading];
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [<trace>]\n", argv0);
+	fprintf(stderr, "  reads the trace from stdin if none is given, and writes the JSON\n"
+	                "  to stdout\n");
+	exit(1);
+}
+
+/* Is the next event the first one in the array? */
+static bool first = true;
+
+/* Print one event (the common fields, then @fmt for the rest). */
+static void emit(const struct coltrace_event_t *event, const char *phase, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void emit(const struct coltrace_event_t *event, const char *phase, const char *fmt, ...)
+{
+	va_list args;
+
+	printf("%s{\"ph\":\"%s\",\"pid\":1,\"tid\":%" PRIu32 ",\"ts\":%.3f,",
+	       first ? "\n" : ",\n", phase, event->thread, event->when / 1000.0);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	putchar('}');
+	first = false;
+}
+
+/* Emit the async slice @name (@cat, for @key) beginning or ending at @event. */
+static void emit_async(const struct coltrace_event_t *event, bool begin, const char *cat,
+                       const char *name, const char *key)
+{
+	emit(event, begin ? "b" : "e", "\"cat\":\"%s\",\"name\":\"%s\",\"id2\":{\"local\":\"%s\"}",
+	     cat, name, key);
+}
+
+static void convert(const struct coltrace_event_t *event, bool *all_red)
+{
+	const char *heading0 = heading_name(event->heading[0]);
+	const char *heading1 = heading_name(event->heading[1]);
+	char key[64];
+
+	switch ((enum log_event_t) event->type) {
+	case LOG_CONTROLLER_READY:
+		emit(event, "M", "\"name\":\"thread_name\",\"args\":{\"name\":\"controller (%s, %s)\"}",
+		     heading0, heading1);
+		emit(event, "i", "\"s\":\"t\",\"name\":\"ready (%s, %s)\"", heading0, heading1);
+		return;
+	case LOG_CONTROLLER_GREEN:
+		if (*all_red)
+			emit_async(event, false, "lights", "all red", "all-red");
+		*all_red = false;
+		/* fallthrough */
+	case LOG_CONTROLLER_RED:
+		snprintf(key, sizeof(key), "(%s, %s)", heading0, heading1);
+		emit(event, event->type == LOG_CONTROLLER_GREEN ? "b" : "e",
+		     "\"cat\":\"lights\",\"name\":\"green %s\",\"id2\":{\"local\":\"%s\"}", key, key);
+		return;
+	case LOG_ALL_RED:
+		if (!*all_red)
+			emit_async(event, true, "lights", "all red", "all-red");
+		*all_red = true;
+		return;
+	case LOG_VEHICLE_ARRIVED:
+	case LOG_VEHICLE_PROCEEDING:
+	case LOG_VEHICLE_LEFT:
+		snprintf(key, sizeof(key), "%s #%" PRId32, heading0, event->id);
+		if (event->type != LOG_VEHICLE_ARRIVED)
+			emit_async(event, false, "vehicle",
+			           event->type == LOG_VEHICLE_PROCEEDING ? "waiting" : "crossing", key);
+		if (event->type != LOG_VEHICLE_LEFT)
+			emit_async(event, true, "vehicle",
+			           event->type == LOG_VEHICLE_ARRIVED ? "waiting" : "crossing", key);
+		return;
+	case LOG_LANE_WAIT:
+		emit(event, "X", "\"cat\":\"mailbox\",\"name\":\"wait lane %s\",\"dur\":%" PRId32,
+		     heading0, event->id);
+		return;
+	case LOG_WAKE_WAIT:
+		emit(event, "X", "\"cat\":\"mailbox\",\"name\":\"wait wake (%s, %s)\",\"dur\":%" PRId32,
+		     heading0, heading1, event->id);
+		return;
+	case NUM_LOG_EVENTS:
+		break;
+	}
+	/* An event type from a newer trace -- keep it, but as a bare instant. */
+	emit(event, "i", "\"s\":\"t\",\"name\":\"event %u\"", event->type);
+}
+
+int main(int argc, char **argv)
+{
+	struct coltrace_reader_t reader;
+	struct coltrace_event_t *events = NULL;
+	size_t cap = 0;
+	ssize_t count;
+	bool all_red = false;
+	FILE *in = stdin;
+
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+		usage(argv[0]);
+	if (argc == 2 && !(in = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "fopen(%s) failed: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	if (coltrace_reader_init(&reader, in) < 0) {
+		fprintf(stderr, "%s: not a columnar trace\n", argc == 2 ? argv[1] : "stdin");
+		return 1;
+	}
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	while ((count = coltrace_reader_block(&reader, &events, &cap)) > 0)
+		for (ssize_t i = 0; i < count; i++)
+			convert(&events[i], &all_red);
+	printf("\n]}\n");
+
+	if (count < 0)
+		fprintf(stderr, "reading trace failed: %s\n", strerror(errno));
+	coltrace_reader_free(&reader);
+	free(events);
+	if (in != stdin)
+		fclose(in);
+	return count < 0 || fflush(stdout) == EOF;
+}
@@ -17,6 +17,7 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <inttypes.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -26,6 +27,17 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "arrival.h"
+#include "evloop.h"
+#include "log.h"
+#include "optimise.h"
+#include "phase.h"
+#include "replicate.h"
+#include "sched.h"
+#include "schedule.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "sweep.h"
 #include "traffic.h"
 #include "sync.h"
 
@@ -46,13 +58,13 @@
  */
 
 /* What are the valid (start, end) pairs? */
-static const heading_t VALID_HEADINGS[] = {
+const heading_t VALID_HEADINGS[NUM_VALID_HEADINGS] = {
 #  	define HEADING_GENERIC(start, end, _) PACK_HEADING(start, end),
 #	include "heading-list.h"
 };
 
 /* Represent a (start, end) pair as "x2y" for debugging output. */
-static const char *heading_to_string(heading_t heading)
+const char *heading_to_string(heading_t heading)
 {
 	switch (heading) {
 #	define HEADING_GENERIC(start, end, name)								\
@@ -63,21 +75,24 @@ static const char *heading_to_string(heading_t heading)
 	return "invalid-heading";
 }
 
-/* Choose a (uniformly) random heading from VALID_HEADINGS. */
-static heading_t random_heading()
+int controller_index(const struct light_controller_t *controller)
 {
-	/*
-	 * (rand() % RANGE) gives you bad random distribution (it's usually skewed
-	 * heavily towards 0, especially if RANGE is non-prime). See
-	 * <http://www.azillionmonkeys.com/qed/random.html> for more details.
-	 *
-	 * Instead, we use drand48(3) to give us a uniformly-distributed value in
-	 * [0,1) and then multiply it to match the choice. There are hacks you can
-	 * do to make rand() produce a better distribution, but drand48(3) is much
-	 * simpler to get right.
-	 */
-	size_t choice = floor(ARRAY_LENGTH(VALID_HEADINGS) * drand48());
-	return VALID_HEADINGS[choice];
+	for (int i = 0; i < NUM_CONTROLLERS; i++)
+		if (ALL_CONTROLLERS[i] == controller)
+			return i;
+	bail("unknown light controller");
+}
+
+/* Parse a heading in the format given by heading_to_string(). */
+static bool string_to_heading(const char *name, heading_t *heading)
+{
+#	define HEADING_GENERIC(start, end, str)									\
+	if (!strcmp(name, str)) {												\
+		*heading = PACK_HEADING(start, end);								\
+		return true;														\
+	}
+#	include "heading-list.h"
+	return false;
 }
 
 static struct light_controller_t trunk_fwd_light;
@@ -115,14 +130,14 @@ static struct light_controller_t trunk_right_light = {
 };
 
 /* Set all of all light controllers. */
-struct light_controller_t *ALL_CONTROLLERS[] = {
+struct light_controller_t *ALL_CONTROLLERS[NUM_CONTROLLERS] = {
 	&trunk_fwd_light,
 	&minor_fwd_light,
 	&trunk_right_light,
 };
 
 /* Mapping from (start, end) to the associated light_controller_t. */
-struct light_controller_t *HEADING_CONTROLLERS[] = {
+struct light_controller_t *HEADING_CONTROLLERS[NUM_HEADINGS] = {
 #	define HEADING_TRUNK_FWD(start, end, _)									\
 	[PACK_HEADING(start, end)] = &trunk_fwd_light,
 #	define HEADING_MINOR_FWD(start, end, _)									\
@@ -132,56 +147,212 @@ struct light_controller_t *HEADING_CONTROLLERS[] = {
 #	include "heading-list.h"
 };
 
+/*
+ * The phase that is currently green, and how many of its controllers have yet
+ * to turn red again. The last one to turn red starts the next phase.
+ */
+static struct {
+	bool concurrent;
+	struct phase_sched_t sched;
+	phase_t current;
+	int active;
+	/* Are the controllers driven by the event loop (-E) rather than threads? */
+	bool event_loop;
+	/* Controllers (by index) that have turned green since phase_record(). */
+	unsigned int unrecorded;
+} phases;
+
+/* How many vehicles are waiting in @lanes (a bitmask of dir_t) of @controller? */
+static int controller_demand(const struct light_controller_t *controller, unsigned int lanes)
+{
+	int demand = 0;
+
+	for (int lane = 0; lane < NUM_DIRECTIONS; lane++)
+		if (lanes & (1U << lane))
+			demand += __atomic_load_n(&controller->waiting[lane], __ATOMIC_RELAXED);
+	return demand;
+}
+
+/*
+ * Which controller should go next? Normally just ->next, but actuated
+ * controllers skip over phases that nobody is waiting for (if nobody is
+ * waiting anywhere, we stick to the ring).
+ */
+static struct light_controller_t *controller_pick_next(struct light_controller_t *self)
+{
+	struct light_controller_t *next = self->next;
+
+	if (!self->actuated)
+		return next;
+	for (int i = 0; i < NUM_CONTROLLERS; i++, next = next->next)
+		if (controller_demand(next, CONTROLLER_LANES(next)))
+			return next;
+	return self->next;
+}
+
+/*
+ * Which phase comes after the one that @self has just finished (NULL for the
+ * first phase)? Either the next controller on its own, or whatever the phase
+ * scheduler makes of the vehicles waiting in each lane.
+ */
+static phase_t phase_next(struct light_controller_t *self)
+{
+	int demand[NUM_SIGNAL_GROUPS];
+
+	if (!phases.concurrent)
+		return CONTROLLER_PHASE(controller_index(self ? controller_pick_next(self) : &trunk_fwd_light));
+
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++)
+		demand[i] = controller_demand(ALL_CONTROLLERS[GROUP_CONTROLLER(i)],
+		                              1U << GROUP_DIRECTION(i));
+	return phase_pick(&phases.sched, demand);
+}
+
+static void driver_green(struct light_controller_t *self);
+
+/* Wake up every controller in @phase (with only its lanes in @phase open). */
+static void phase_start(phase_t phase)
+{
+	int active = 0;
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		ALL_CONTROLLERS[i]->open_lanes = phase_lanes(phase, i);
+		if (ALL_CONTROLLERS[i]->open_lanes)
+			active++;
+	}
+	phases.current = phase;
+	__atomic_store_n(&phases.active, active, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		if (!ALL_CONTROLLERS[i]->open_lanes)
+			continue;
+		if (phases.event_loop)
+			driver_green(ALL_CONTROLLERS[i]);
+		else
+			mailbox_signal(&ALL_CONTROLLERS[i]->wake, NULL);
+	}
+}
+
+/*
+ * Record how many vehicles each controller let through in its last green
+ * phase. That's normally done in the all-red gap, but also once the run is
+ * over, for the phase it interrupted.
+ */
+static void phase_record(void)
+{
+	unsigned int unrecorded = __atomic_exchange_n(&phases.unrecorded, 0, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		struct light_controller_t *controller = ALL_CONTROLLERS[i];
+
+		if (unrecorded & (1U << i))
+			stats_red(controller, __atomic_exchange_n(&controller->phase_vehicles, 0,
+			                                          __ATOMIC_RELAXED));
+	}
+}
+
+/*
+ * When should @self, green for the lanes in @open, next check on them? Not
+ * until the light turns red, unless it's actuated -- if nobody is waiting, an
+ * actuated controller only waits for one intersection_gap (and at least until
+ * @min_deadline, the end of the minimum green) for somebody to turn up.
+ * Otherwise it still checks back once a whole platoon could have gone
+ * through, so it notices the traffic drying up half-way through a platoon.
+ */
+static simtime_t controller_wait_deadline(const struct light_controller_t *self,
+                                          unsigned int open, simtime_t now,
+                                          simtime_t min_deadline)
+{
+	simtime_t wait_deadline = self->red_deadline;
+
+	if (self->actuated && !controller_demand(self, open)) {
+		wait_deadline = now + self->intersection_gap;
+		if (wait_deadline < min_deadline)
+			wait_deadline = min_deadline;
+	} else if (self->actuated) {
+		wait_deadline = now + self->platoon * self->intersection_gap;
+	}
+	if (wait_deadline > self->red_deadline)
+		wait_deadline = self->red_deadline;
+	return wait_deadline;
+}
+
 static void *light_start(void *arg)
 {
-	char *id = NULL;
 	dir_t lane1, lane2;
 	struct light_controller_t *self = arg;
 
-	if (asprintf(&id, "(%s, %s)", heading_to_string(self->id[0]),
-	                              heading_to_string(self->id[1])) < 0)
-		bail("asprintf(light controller id) failed");
-
-	/* Clean up the id string when pthread_cancell'd. */
-	pthread_cleanup_push(free, id);
-
 	lane1 = HEADING_START(self->id[0]);
 	lane2 = HEADING_START(self->id[1]);
 
-	printf("Traffic light mini-controller %s: "
-	       "Initialization complete. I am ready.\n", id);
+	log_controller(log_clock(), LOG_CONTROLLER_READY, self);
 
 	barrier_wait(self->ready);
 
 	for (;;) {
-		struct timespec red_deadline = { 0 };
+		unsigned int open;
+		simtime_t wait_start, green_start, green_max, min_deadline, now;
 
-		/* Wait for our turn. */
+		/* Wait for our turn -- which lanes does this phase let through? */
+		wait_start = log_clock();
 		mailbox_wait_lock(&self->wake);
+		log_wait(wait_start, LOG_WAKE_WAIT, self->id[0], self->id[1]);
+		open = self->open_lanes;
 
-		/* When do we need to turn red again? */
-		red_deadline.tv_sec = time(NULL) + self->green_interval;
+		/*
+		 * When do we need to turn red again? Actuated controllers may turn red
+		 * earlier (see below), or stay green for up to green_extension longer.
+		 */
+		green_start = monotonic_now();
+		green_max = self->green_interval + (self->actuated ? self->green_extension : 0);
+		self->red_deadline = green_start + green_max;
+		min_deadline = green_start + self->intersection_gap;
 
 		/* Until the deadline is reached, allow cars to pass. */
-		printf("The traffic lights %s have changed to green.\n", id);
-		while (time(NULL) < red_deadline.tv_sec) {
+		log_controller(log_clock(), LOG_CONTROLLER_GREEN, self);
+		__atomic_store_n(&self->phases, self->phases + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&self->green, true, __ATOMIC_RELAXED);
+		stats_green(self, __builtin_popcount(open), green_max);
+		__atomic_or_fetch(&phases.unrecorded, 1U << controller_index(self), __ATOMIC_RELAXED);
+		while ((now = monotonic_now()) < self->red_deadline) {
+			simtime_t wait_deadline;
+			struct timespec wait_timespec;
+			int admitted = __atomic_load_n(&self->phase_vehicles, __ATOMIC_RELAXED);
+			bool crossed;
+
 			/*
-			 * Create a new semaphore for each iteration so we can be sure that
+			 * Use a fresh semaphore for each iteration so we can be sure that
 			 * we catch a crossing after we "send" new signals -- there isn't
-			 * any other fool-proof way to set the sempahore back to 0.
+			 * any other fool-proof way to set the sempahore back to 0. They
+			 * come from a pool, and are only recycled once every mailbox and
+			 * vehicle has dropped its reference.
 			 */
-			arcsem_t *receipt = arcsem_new(0);
+			arcsem_t *receipt = arcsem_pool_get(&self->receipts);
+			if (!receipt)
+				bail("arcsem_pool_get failed");
 
 			/*
-			 * Signal both lanes to allow one vehicle to pass through -- if
-			 * there's already a pending signal then this just updates the
-			 * receipt semaphore (freeing the old one).
+			 * Signal both (open) lanes to allow a platoon of vehicles to pass
+			 * through -- if there are already pending signals then this just
+			 * refills them and updates the receipt semaphore (freeing the old
+			 * one).
 			 */
-			mailbox_signal(&self->entry[lane1], receipt);
-			mailbox_signal(&self->entry[lane2], receipt);
+			if (open & (1U << lane1))
+				mailbox_signal_many(&self->entry[lane1], receipt, self->platoon);
+			if (open & (1U << lane2))
+				mailbox_signal_many(&self->entry[lane2], receipt, self->platoon);
 
-			/* Wait for one of them to have passed. */
-			sem_timedwait(&receipt->inner, &red_deadline);
+			/*
+			 * Wait for one of the lanes to have let its whole platoon through
+			 * (or for an actuated controller's next check). The deadline is on
+			 * CLOCK_MONOTONIC, so it isn't affected by the wall clock. Part of
+			 * a platoon may have gone through even if we time out, which still
+			 * counts as traffic for the gap-out.
+			 */
+			wait_deadline = controller_wait_deadline(self, open, now, min_deadline);
+			wait_timespec = simtime_to_timespec(wait_deadline);
+			crossed = !sem_clockwait(&receipt->inner, CLOCK_MONOTONIC, &wait_timespec) ||
+			          __atomic_load_n(&self->phase_vehicles, __ATOMIC_RELAXED) != admitted;
 
 			/*
 			 * We're done waiting -- the only references still alive are the
@@ -189,149 +360,1091 @@ static void *light_start(void *arg)
 			 * by mailbox_retract).
 			 */
 			arcsem_put(receipt);
+
+			/* Gap-out -- nobody came, so don't waste the rest of the green. */
+			if (self->actuated && !crossed && !controller_demand(self, open) &&
+			    (now = monotonic_now()) >= min_deadline && now < self->red_deadline) {
+				stats_green_cut(self, __builtin_popcount(open), self->red_deadline - now);
+				self->red_deadline = now;
+				break;
+			}
 		}
 		/* Retract any remaining signals -- and free the semaphores. */
 		mailbox_retract(&self->entry[lane1]);
 		mailbox_retract(&self->entry[lane2]);
 
 		/* No more car crossings from here on. */
-		printf("The traffic lights %s will change to red now.\n", id);
+		log_controller(log_clock(), LOG_CONTROLLER_RED, self);
+		__atomic_store_n(&self->green, false, __ATOMIC_RELAXED);
+
+		/* Wait for the rest of the phase to turn red. */
+		if (__atomic_sub_fetch(&phases.active, 1, __ATOMIC_ACQ_REL)) {
+			mailbox_unlock(&self->wake);
+			continue;
+		}
 
-		/* We pause for 2 seconds before triggering the next controller. */
-		sleep(2);
+		/* We pause for 2 seconds before triggering the next phase. */
+		log_controller(log_clock(), LOG_ALL_RED, self);
+		sleep_for(ALL_RED_GAP);
+
+		/* Every vehicle let through in this phase has counted itself by now. */
+		phase_record();
+
+		/* This may include ourselves again, if nobody else is waiting. */
 		mailbox_unlock(&self->wake);
-		mailbox_signal(&self->next->wake, NULL);
+		phase_start(phase_next(self));
 	}
 
 	/* Should never be reached. */
-	pthread_cleanup_pop(true);
 	return NULL;
 }
 
+/*
+ * Event-loop driver (-E). Rather than every controller having its own thread
+ * that sleeps in mailbox_wait_lock(), sem_clockwait() and sleep_for(), a single
+ * thread drives all of them from one epoll loop (see evloop.h). Each
+ * controller has a timerfd for its next deadline (the end of the green, or an
+ * actuated controller's next check), each of its lanes has an eventfd that
+ * vehicles post as they leave the intersection, and the all-red gap is one
+ * more timerfd. Everything here runs on the loop thread.
+ */
+struct driver_lane_t {
+	struct evloop_source_t notify;
+	struct controller_driver_t *driver;
+	dir_t lane;
+	/* How many vehicles have left since the lane was last signalled? */
+	unsigned int left;
+};
+
+struct controller_driver_t {
+	struct light_controller_t *controller;
+	struct evloop_source_t timer;
+	struct driver_lane_t lanes[NUM_DIRECTIONS];
+	/* Which lanes are green, and when is the minimum green over? */
+	unsigned int open;
+	simtime_t min_deadline;
+	/* ->phase_vehicles when the timer was last armed (for the gap-out). */
+	int admitted;
+};
+
+static struct {
+	struct evloop_t loop;
+	struct controller_driver_t drivers[NUM_CONTROLLERS];
+	/* The all-red gap, and the controller that was the last to turn red. */
+	struct evloop_source_t all_red;
+	struct light_controller_t *last;
+	barrier_t *ready;
+} evloop_driver;
+
+/* Let a platoon of vehicles into @lane of @driver's controller. */
+static void driver_signal(struct controller_driver_t *driver, dir_t lane)
+{
+	struct light_controller_t *self = driver->controller;
+
+	driver->lanes[lane].left = 0;
+	mailbox_signal_many(&self->entry[lane], NULL, self->platoon);
+}
+
+/* Arm @driver's timer for its controller's next check. */
+static void driver_arm(struct controller_driver_t *driver, simtime_t now)
+{
+	struct light_controller_t *self = driver->controller;
+
+	driver->admitted = __atomic_load_n(&self->phase_vehicles, __ATOMIC_RELAXED);
+	evloop_timer_arm(&driver->timer,
+	                 controller_wait_deadline(self, driver->open, now, driver->min_deadline));
+}
+
+/* Turn @self green (phase_start() with the event loop). */
+static void driver_green(struct light_controller_t *self)
+{
+	struct controller_driver_t *driver = &evloop_driver.drivers[controller_index(self)];
+	simtime_t now = monotonic_now();
+	simtime_t green_max = self->green_interval + (self->actuated ? self->green_extension : 0);
+
+	driver->open = self->open_lanes;
+	self->red_deadline = now + green_max;
+	driver->min_deadline = now + self->intersection_gap;
+
+	log_controller(log_clock(), LOG_CONTROLLER_GREEN, self);
+	__atomic_store_n(&self->phases, self->phases + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->green, true, __ATOMIC_RELAXED);
+	stats_green(self, __builtin_popcount(driver->open), green_max);
+	__atomic_or_fetch(&phases.unrecorded, 1U << controller_index(self), __ATOMIC_RELAXED);
+
+	for (int lane = 0; lane < NUM_DIRECTIONS; lane++)
+		if (driver->open & (1U << lane))
+			driver_signal(driver, lane);
+	driver_arm(driver, now);
+}
+
+/* Turn @driver's controller red, and start the all-red gap if it's the last. */
+static void driver_red(struct controller_driver_t *driver)
+{
+	struct light_controller_t *self = driver->controller;
+
+	/* This doesn't wait for a vehicle that is still crossing (see sync.h). */
+	driver->open = 0;
+	for (size_t i = 0; i < ARRAY_LENGTH(self->id); i++)
+		mailbox_retract(&self->entry[HEADING_START(self->id[i])]);
+
+	log_controller(log_clock(), LOG_CONTROLLER_RED, self);
+	__atomic_store_n(&self->green, false, __ATOMIC_RELAXED);
+
+	if (__atomic_sub_fetch(&phases.active, 1, __ATOMIC_ACQ_REL))
+		return;
+	evloop_driver.last = self;
+	log_controller(log_clock(), LOG_ALL_RED, self);
+	evloop_timer_arm(&evloop_driver.all_red, monotonic_now() + ALL_RED_GAP);
+}
+
+static void driver_timer_ready(struct evloop_source_t *source)
+{
+	struct controller_driver_t *driver = container_of(source, struct controller_driver_t, timer);
+	struct light_controller_t *self = driver->controller;
+	simtime_t now = monotonic_now();
+	bool crossed;
+
+	/* Re-armed since epoll saw it, or the light has already turned red. */
+	if (!evloop_source_take(source) || !driver->open)
+		return;
+
+	if (now < self->red_deadline) {
+		/* Gap-out -- nobody came, so don't waste the rest of the green. */
+		crossed = __atomic_load_n(&self->phase_vehicles, __ATOMIC_RELAXED) != driver->admitted;
+		if (!self->actuated || crossed || controller_demand(self, driver->open) ||
+		    now < driver->min_deadline) {
+			driver_arm(driver, now);
+			return;
+		}
+		stats_green_cut(self, __builtin_popcount(driver->open), self->red_deadline - now);
+		self->red_deadline = now;
+	}
+	driver_red(driver);
+}
+
+static void driver_lane_ready(struct evloop_source_t *source)
+{
+	struct driver_lane_t *lane = container_of(source, struct driver_lane_t, notify);
+	struct controller_driver_t *driver = lane->driver;
+
+	/*
+	 * Only refill the lane once its whole platoon has left (just like the
+	 * receipt in light_start()), so that nobody can be holding it -- with
+	 * the condvar mailbox, signalling a lane that a vehicle is crossing would
+	 * block the whole loop until it has crossed.
+	 */
+	lane->left += evloop_source_take(source);
+	if (!(driver->open & (1U << lane->lane)) || lane->left < driver->controller->platoon)
+		return;
+	driver_signal(driver, lane->lane);
+	driver_arm(driver, monotonic_now());
+}
+
+static void driver_all_red_ready(struct evloop_source_t *source)
+{
+	if (!evloop_source_take(source))
+		return;
+
+	/* Every vehicle let through in this phase has counted itself by now. */
+	phase_record();
+	phase_start(phase_next(evloop_driver.last));
+}
+
+/* Tell the event loop (if any) that a vehicle has left @lane of @master. */
+static void controller_notify(struct light_controller_t *master, dir_t lane)
+{
+	if (phases.event_loop)
+		evloop_event_post(&evloop_driver.drivers[controller_index(master)].lanes[lane].notify);
+}
+
+static int evloop_driver_init(barrier_t *ready)
+{
+	if (evloop_init(&evloop_driver.loop) < 0)
+		return -1;
+	evloop_driver.ready = ready;
+	if (evloop_timer_init(&evloop_driver.all_red, driver_all_red_ready) < 0 ||
+	    evloop_add(&evloop_driver.loop, &evloop_driver.all_red) < 0)
+		return -1;
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		struct controller_driver_t *driver = &evloop_driver.drivers[i];
+		struct light_controller_t *self = ALL_CONTROLLERS[i];
+
+		*driver = (struct controller_driver_t) { .controller = self };
+		for (int lane = 0; lane < NUM_DIRECTIONS; lane++)
+			driver->lanes[lane] = (struct driver_lane_t) {
+				.notify.fd = -1,
+				.driver = driver,
+				.lane = lane,
+			};
+
+		if (evloop_timer_init(&driver->timer, driver_timer_ready) < 0 ||
+		    evloop_add(&evloop_driver.loop, &driver->timer) < 0)
+			return -1;
+		for (size_t j = 0; j < ARRAY_LENGTH(self->id); j++) {
+			struct driver_lane_t *lane = &driver->lanes[HEADING_START(self->id[j])];
+
+			if (evloop_event_init(&lane->notify, driver_lane_ready) < 0 ||
+			    evloop_add(&evloop_driver.loop, &lane->notify) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void evloop_driver_free(void)
+{
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		struct controller_driver_t *driver = &evloop_driver.drivers[i];
+
+		evloop_source_free(&driver->timer);
+		for (int lane = 0; lane < NUM_DIRECTIONS; lane++)
+			evloop_source_free(&driver->lanes[lane].notify);
+	}
+	evloop_source_free(&evloop_driver.all_red);
+	evloop_free(&evloop_driver.loop);
+}
+
+static void *evloop_driver_start(void *arg)
+{
+	(void) arg;
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++)
+		log_controller(log_clock(), LOG_CONTROLLER_READY, ALL_CONTROLLERS[i]);
+
+	barrier_wait(evloop_driver.ready);
+	phase_start(phase_next(NULL));
+
+	/* Until realtime_run() calls evloop_stop(). */
+	evloop_run(&evloop_driver.loop);
+	return NULL;
+}
+
+/* Called by a vehicle as soon as it has arrived at the lights. */
+static void vehicle_arrived(vehicle_t vehicle, struct light_controller_t *master)
+{
+	VEHICLES.arrived[vehicle] = monotonic_now();
+	VEHICLES.status[vehicle] = VEHICLE_WAITING;
+	__atomic_add_fetch(&master->waiting[HEADING_START(VEHICLES.heading[vehicle])], 1,
+	                   __ATOMIC_RELAXED);
+}
+
+/* Called by a vehicle as soon as it has been let into the intersection. */
+static void vehicle_admitted(vehicle_t vehicle, struct light_controller_t *master)
+{
+	dir_t lane = HEADING_START(VEHICLES.heading[vehicle]);
+
+	__atomic_sub_fetch(&master->waiting[lane], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&master->crossing[lane], 1, __ATOMIC_RELAXED);
+	VEHICLES.admitted[vehicle] = monotonic_now();
+	VEHICLES.red_deadline[vehicle] = master->red_deadline;
+	VEHICLES.status[vehicle] = VEHICLE_CROSSING;
+	__atomic_add_fetch(&master->phase_vehicles, 1, __ATOMIC_RELAXED);
+}
+
+/* Called by a vehicle once it has left the intersection again. */
+static void vehicle_left(vehicle_t vehicle, struct light_controller_t *master)
+{
+	VEHICLES.left[vehicle] = monotonic_now();
+	VEHICLES.status[vehicle] = VEHICLE_DONE;
+	__atomic_sub_fetch(&master->crossing[HEADING_START(VEHICLES.heading[vehicle])], 1,
+	                   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&master->passed, 1, __ATOMIC_RELAXED);
+}
+
+/* Do threaded vehicles queue up in arrival order (see traffic_params)? */
+static bool fifo_lanes;
+
 static void *vehicle_start(void *arg)
 {
-	struct vehicle_t *self = arg;
-	struct light_controller_t *master = HEADING_CONTROLLERS[self->heading];
-	dir_t lane = HEADING_START(self->heading);
+	vehicle_t self = PTR_TO_VEHICLE(arg);
+	struct light_controller_t *master = HEADING_CONTROLLERS[VEHICLES.heading[self]];
+	dir_t lane = HEADING_START(VEHICLES.heading[self]);
+	simtime_t wait_start;
 
-	printf("Vehicle %d %s has arrived at the intersection.\n",
-	       self->id, heading_to_string(self->heading));
+	vehicle_arrived(self, master);
+	log_vehicle(log_clock(), LOG_VEHICLE_ARRIVED, self);
 
-	mailbox_wait_lock(&master->entry[lane]);
+	wait_start = log_clock();
+	if (fifo_lanes)
+		mailbox_wait_fifo(&master->entry[lane]);
+	else
+		mailbox_wait_lock(&master->entry[lane]);
+	log_wait(wait_start, LOG_LANE_WAIT, VEHICLES.heading[self], 0);
+	vehicle_admitted(self, master);
 
-	printf("Vehicle %d %s is proceeding through the intersection.\n",
-	       self->id, heading_to_string(self->heading));
-	sleep(master->intersection_gap);
+	log_vehicle(log_clock(), LOG_VEHICLE_PROCEEDING, self);
+	sleep_for(master->intersection_gap);
+	vehicle_left(self, master);
+	log_vehicle(log_clock(), LOG_VEHICLE_LEFT, self);
 
-	mailbox_unlock(&master->entry[lane]);
+	if (fifo_lanes)
+		mailbox_release(&master->entry[lane]);
+	else
+		mailbox_unlock(&master->entry[lane]);
+	controller_notify(master, lane);
 
-	free(self);
+	stats_vehicle(self);
 	return NULL;
 }
 
-static void readint(const char *prompt, int *value)
+/*
+ * A vehicle run as a lightweight task rather than a thread. This is the same
+ * as vehicle_start(), but split into a state machine (driven by the vehicle's
+ * status) so that waiting for the lights and crossing the intersection don't
+ * block a worker thread. The tasks are indexed by vehicle, so the vehicle
+ * doesn't need to be stored in them.
+ */
+struct vehicle_task_t {
+	struct task_t task;
+	struct mailbox_waiter_t waiter;
+};
+
+static struct vehicle_task_t *vehicle_tasks;
+
+/* Posted by each vehicle task once it is done. */
+static sem_t vehicle_tasks_done;
+
+static void vehicle_task_wake(struct mailbox_waiter_t *waiter)
 {
-	printf("Enter %s (int): ", prompt);
-	if (scanf("%d", value) != 1)
-		bail("expected integer input to prompt!");
+	struct vehicle_task_t *self = container_of(waiter, struct vehicle_task_t, waiter);
+	sched_wake(&self->task);
 }
 
-int main(void)
+static void vehicle_task_run(struct task_t *task)
 {
-	int num_vehicles, max_arrival_gap, intersection_gap;
+	struct vehicle_task_t *self = container_of(task, struct vehicle_task_t, task);
+	vehicle_t vehicle = self - vehicle_tasks;
+	struct light_controller_t *master = HEADING_CONTROLLERS[VEHICLES.heading[vehicle]];
+	dir_t lane = HEADING_START(VEHICLES.heading[vehicle]);
+
+	switch (VEHICLES.status[vehicle]) {
+	case VEHICLE_ARRIVING:
+		vehicle_arrived(vehicle, master);
+		log_vehicle(log_clock(), LOG_VEHICLE_ARRIVED, vehicle);
+
+		/* If we have to wait, we'll be woken in VEHICLE_WAITING. */
+		if (!mailbox_park(&master->entry[lane], &self->waiter))
+			return;
+		/* fallthrough */
 
-	int next_vehicle_id[NUM_DIRECTIONS * NUM_DIRECTIONS] = { 0 };
-	time_t last_vehicle_spawn[NUM_DIRECTIONS * NUM_DIRECTIONS] = { 0 };
+	case VEHICLE_WAITING:
+		vehicle_admitted(vehicle, master);
+		log_vehicle(log_clock(), LOG_VEHICLE_PROCEEDING, vehicle);
+
+		sched_sleep(&self->task, master->intersection_gap);
+		return;
+
+	case VEHICLE_CROSSING:
+		vehicle_left(vehicle, master);
+		log_vehicle(log_clock(), LOG_VEHICLE_LEFT, vehicle);
+		mailbox_release(&master->entry[lane]);
+		controller_notify(master, lane);
+		stats_vehicle(vehicle);
+		sem_post(&vehicle_tasks_done);
+		return;
+	}
+}
+
+/* Prompt for the value of @param (if it wasn't given on the command line). */
+static void readparam(struct param_set_t *set, int param)
+{
+	const struct param_info_t *info = &PARAM_INFO[param];
+	double seconds;
+	int value;
+
+	if (info->integer) {
+		printf("Enter %s (int): ", info->prompt);
+		if (scanf("%d", &value) != 1)
+			bail("expected integer input to prompt!");
+		param_set_add(set, param, value);
+	} else {
+		/* A (possibly fractional) number of seconds. */
+		printf("Enter %s (seconds): ", info->prompt);
+		if (scanf("%lf", &seconds) != 1 || seconds < 0)
+			bail("expected non-negative number of seconds to prompt!");
+		param_set_add(set, param, seconds);
+	}
+}
+
+typedef char snapshot_controllers_check[NUM_CONTROLLERS <= SNAPSHOT_MAX_CONTROLLERS ? 1 : -1];
+
+/* How far has realtime_run() got with spawning the vehicles? */
+static struct {
+	uint64_t spawned, total;
+} realtime;
+
+/* snapshot_start() callback -- copy out the live state of the controllers. */
+static void realtime_snapshot(struct snapshot_state_t *state)
+{
+	simtime_t now = monotonic_now();
+
+	state->spawned = __atomic_load_n(&realtime.spawned, __ATOMIC_RELAXED);
+	state->total = realtime.total;
+	state->num_controllers = NUM_CONTROLLERS;
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		struct light_controller_t *controller = ALL_CONTROLLERS[i];
+		struct snapshot_controller_t *out = &state->controllers[i];
+
+		snprintf(out->name, sizeof(out->name), "(%s, %s)",
+		         heading_to_string(controller->id[0]), heading_to_string(controller->id[1]));
+		out->green = __atomic_load_n(&controller->green, __ATOMIC_RELAXED);
+		if (out->green)
+			out->green_left = __atomic_load_n(&controller->red_deadline,
+			                                  __ATOMIC_RELAXED) - now;
+		if (out->green_left < 0)
+			out->green_left = 0;
+		out->phases = __atomic_load_n(&controller->phases, __ATOMIC_RELAXED);
+		out->phase_vehicles = __atomic_load_n(&controller->phase_vehicles, __ATOMIC_RELAXED);
+		out->passed = __atomic_load_n(&controller->passed, __ATOMIC_RELAXED);
+
+		for (int j = 0; j < SNAPSHOT_LANES; j++) {
+			struct snapshot_lane_t *lane = &out->lanes[j];
+			dir_t dir = HEADING_START(controller->id[j]);
+
+			snprintf(lane->name, sizeof(lane->name), "%s",
+			         heading_to_string(controller->id[j]));
+			lane->waiting = __atomic_load_n(&controller->waiting[dir], __ATOMIC_RELAXED);
+			lane->crossing = __atomic_load_n(&controller->crossing[dir], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Run the simulation in real time. Vehicles either get their own thread
+ * (@nworkers == 0) or are run as lightweight tasks on @nworkers threads, and
+ * the controllers either get a thread each or are all driven by one event
+ * loop (@event_loop).
+ */
+static int realtime_run(const struct traffic_params *params, int nworkers, bool event_loop)
+{
+	int spawned = 0;
+	simtime_t next, start, end;
+	struct arrivals_t arrivals;
+	struct task_t **tasks = NULL;
+	size_t tasks_cap = 0;
 
 	barrier_t ready_barrier;
 	pthread_t controllers[ARRAY_LENGTH(ALL_CONTROLLERS)] = { 0 };
+	pthread_t driver;
 	pthread_t *vehicles = NULL;
 
-	/* Seed PRNG. */
-	srand48(time(NULL) ^ getpid());
-
-	readint("the total number of vehicles", &num_vehicles);
-	readint("vehicles arrival rate", &max_arrival_gap);
-	readint("minimum interval between two consecutive vehicles", &intersection_gap);
+	if (nworkers) {
+		if (sem_init(&vehicle_tasks_done, 0, 0) < 0)
+			bail("sem_init(vehicle_tasks_done) failed");
+		if (sched_init(nworkers) < 0)
+			bail("sched_init(%d) failed", nworkers);
+	}
 
-	readint("green time for forward-moving vehicles on trunk road",
-			&trunk_fwd_light.green_interval);
-	readint("green time for vehicles on minor road",
-			&minor_fwd_light.green_interval);
-	readint("green time for right-turning vehicles on trunk road",
-			&trunk_right_light.green_interval);
+	/* We need all controllers (or the event loop) and the main thread to be ready. */
+	if (barrier_init(&ready_barrier, event_loop ? 2 : ARRAY_LENGTH(ALL_CONTROLLERS) + 1) < 0)
+		bail("barrier_init(ready) failed");
 
-	/* We need all controllers and the main thread to be ready. */
-	barrier_init(&ready_barrier, ARRAY_LENGTH(ALL_CONTROLLERS) + 1);
+	LOCKSTAT_NAME(&ready_barrier, "controllers", "ready");
 
-	/* Set up the controllers. */
+	/* Set up the controllers (and name their locks, for make LOCKSTAT=1). */
 	for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++) {
 		struct light_controller_t *current = ALL_CONTROLLERS[i];
+		char group[32];
+
 		current->ready = &ready_barrier;
-		current->intersection_gap = intersection_gap;
+		snprintf(group, sizeof(group), "(%s, %s)", heading_to_string(current->id[0]),
+		         heading_to_string(current->id[1]));
+		LOCKSTAT_NAME(&current->wake, group, "wake");
+		for (size_t j = 0; j < ARRAY_LENGTH(current->id); j++)
+			LOCKSTAT_NAME(&current->entry[HEADING_START(current->id[j])], group,
+			              heading_to_string(current->id[j]));
 	}
 
-	/* Spawn light controllers. */
-	for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++) {
-		struct light_controller_t *current = ALL_CONTROLLERS[i];
-		if (pthread_create(&controllers[i], NULL, light_start, current) < 0)
-			bail("pthread_create(controller[%ld]) failed", i);
+	phases.concurrent = params->concurrent_phases;
+	phases.event_loop = event_loop;
+	phase_sched_init(&phases.sched);
+	fifo_lanes = params->fifo_lanes;
+
+	/* Spawn light controllers (or the event loop, which starts the first phase). */
+	if (event_loop) {
+		if (evloop_driver_init(&ready_barrier) < 0)
+			bail("evloop_driver_init failed");
+		if ((errno = pthread_create(&driver, NULL, evloop_driver_start, NULL)))
+			bail("pthread_create(driver) failed");
+	} else {
+		for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++) {
+			struct light_controller_t *current = ALL_CONTROLLERS[i];
+			if ((errno = pthread_create(&controllers[i], NULL, light_start, current)))
+				bail("pthread_create(controller[%ld]) failed", i);
+		}
 	}
 
 	/* Wait until all controllers are ready ... */
 	barrier_wait(&ready_barrier);
 	/* ... then trigger the default state. */
-	mailbox_signal(&trunk_fwd_light.wake, NULL);
+	if (!event_loop)
+		phase_start(phase_next(NULL));
 
-	/* Spawn vehicle threads. */
-	vehicles = calloc(num_vehicles, sizeof(*vehicles));
-	if (!vehicles)
-		bail("calloc(vehicles) failed");
-	for (ssize_t i = 0; i < num_vehicles; i++) {
-		int delay;
-		struct vehicle_t *current;
+	/*
+	 * Spawn vehicles. Each heading has its own arrival generator, so we just
+	 * sleep until the next batch of arrivals is due and then inject the whole
+	 * batch at once.
+	 */
+	if (vehicles_init(params->num_vehicles) < 0)
+		bail("vehicles_init(%d) failed", params->num_vehicles);
+	if (!nworkers) {
+		vehicles = calloc(params->num_vehicles, sizeof(*vehicles));
+		if (!vehicles)
+			bail("calloc(vehicles) failed");
+	} else {
+		vehicle_tasks = calloc(params->num_vehicles, sizeof(*vehicle_tasks));
+		tasks = calloc(NUM_VALID_HEADINGS, sizeof(*tasks));
+		if (!vehicle_tasks || !tasks)
+			bail("calloc(tasks) failed");
+		tasks_cap = NUM_VALID_HEADINGS;
+	}
+	if (arrivals_init(&arrivals, params, 0) < 0)
+		bail("arrivals_init failed");
 
-		current = malloc(sizeof(*current));
-		if (!current)
-			bail("malloc(vehicle_t[%ld]) failed", i);
+	realtime.total = params->num_vehicles;
+	if (params->snapshot && snapshot_start(params->snapshot, realtime_snapshot) < 0)
+		bail("snapshot_start(%s) failed", params->snapshot);
+	start = monotonic_now();
 
-		current->heading = random_heading();
-		current->id = next_vehicle_id[current->heading]++;
+	while ((next = arrivals_next(&arrivals)) >= 0) {
+		struct arrival_t *batch;
+		size_t len;
 
-		/*
-		 * Delay thread spawning based on when the last vehicle (with the same
-		 * heading) was spawned. This is all single-threaded, as required by
-		 * the assignment description (to be more physically accurate you would
-		 * have a separate thread for each possible heading, or some other
-		 * scheduling system to not block spawning other headings if the
-		 * current one needs a longer delay).
-		 */
-		if (last_vehicle_spawn[current->heading] < time(NULL))
-			/* Last vehicle spawned >1s ago -- [0,max_arrival_gap). */
-			delay = (1 + max_arrival_gap) * drand48();
-		else
-			/* Last vehicle spawned <=1s ago -- [1,max_arrival_gap). */
-			delay = 1 + (max_arrival_gap * drand48());
+		sleep_until(start + next);
+		len = arrivals_poll(&arrivals, next, &batch);
 
-		sleep(delay);
-		last_vehicle_spawn[current->heading] = time(NULL);
+		if (nworkers && len > tasks_cap) {
+			tasks = realloc(tasks, len * sizeof(*tasks));
+			if (!tasks)
+				bail("realloc(tasks) failed");
+			tasks_cap = len;
+		}
+		for (size_t i = 0; i < len; i++, spawned++) {
+			vehicle_t current = vehicle_new(batch[i].id, batch[i].heading);
 
-		if (pthread_create(&vehicles[i], NULL, vehicle_start, current) < 0)
-			bail("pthread_create(vehicle[%ld]) failed", i);
+			if (nworkers) {
+				vehicle_tasks[current] = (struct vehicle_task_t) {
+					.task.run = vehicle_task_run,
+					.waiter.wake = vehicle_task_wake,
+				};
+				tasks[i] = &vehicle_tasks[current].task;
+			} else {
+				if ((errno = pthread_create(&vehicles[spawned], NULL, vehicle_start,
+				                            VEHICLE_TO_PTR(current))))
+					bail("pthread_create(vehicle[%d]) failed", spawned);
+			}
+		}
+		if (nworkers)
+			sched_wake_many(tasks, len);
+		__atomic_store_n(&realtime.spawned, spawned, __ATOMIC_RELAXED);
 	}
+	arrivals_free(&arrivals);
+	free(tasks);
 
 	/* Wait for all the vehicles to pass. */
-	for (ssize_t i = 0; i < num_vehicles; i++)
-		pthread_join(vehicles[i], NULL);
-	free(vehicles);
-
-	/* Kill the controllers (first cancel, then join). */
-	for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++)
-		pthread_cancel(controllers[i]);
-	for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++)
-		pthread_join(controllers[i], NULL);
-
-	printf("Main thread: There are no more vehicles to serve. "
-	       "The simulation will end now.\n");
+	if (nworkers) {
+		for (ssize_t i = 0; i < params->num_vehicles; i++)
+			while (sem_wait(&vehicle_tasks_done) < 0 && errno == EINTR)
+				;
+		sched_shutdown();
+		sem_destroy(&vehicle_tasks_done);
+		free(vehicle_tasks);
+		vehicle_tasks = NULL;
+	} else {
+		for (ssize_t i = 0; i < params->num_vehicles; i++)
+			pthread_join(vehicles[i], NULL);
+		free(vehicles);
+	}
+	snapshot_stop();
+	vehicles_free();
+
+	/*
+	 * Stop the controllers. The event loop just returns once asked to, but
+	 * the controller threads have to be cancelled (first cancel, then join).
+	 */
+	if (event_loop) {
+		evloop_stop(&evloop_driver.loop);
+		pthread_join(driver, NULL);
+		evloop_driver_free();
+		phases.event_loop = false;
+	} else {
+		for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++)
+			pthread_cancel(controllers[i]);
+		for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++)
+			pthread_join(controllers[i], NULL);
+	}
+
+	/*
+	 * Drop the receipts left in the mailboxes, and free the pools. Any green
+	 * phase we interrupted didn't last its full green_interval, but still
+	 * counts towards the vehicles per green.
+	 */
+	phase_record();
+	end = monotonic_now();
+	for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++) {
+		struct light_controller_t *current = ALL_CONTROLLERS[i];
+		if (current->red_deadline > end)
+			stats_green_cut(current, __builtin_popcount(current->open_lanes),
+			                current->red_deadline - end);
+		for (size_t j = 0; j < ARRAY_LENGTH(current->entry); j++)
+			mailbox_retract(&current->entry[j]);
+		arcsem_pool_drain(&current->receipts);
+	}
+	lockstat_dump(stderr);
+	barrier_destroy(&ready_barrier);
+
 	return 0;
 }
+
+/*
+ * Only hand out the arrivals of a run (to record them with -R), rather than
+ * running it. The arrivals are polled GENERATE_WINDOW at a time, so that each
+ * batch is just long enough to amortise the poll.
+ */
+#define GENERATE_WINDOW	SECONDS(1)
+
+static int generate_run(const struct traffic_params *params)
+{
+	struct arrivals_t arrivals;
+	struct arrival_t *batch;
+	simtime_t next;
+
+	if (arrivals_init(&arrivals, params, 0) < 0)
+		bail("arrivals_init failed");
+	while ((next = arrivals_next(&arrivals)) >= 0)
+		arrivals_poll(&arrivals, next + GENERATE_WINDOW, &batch);
+	arrivals_free(&arrivals);
+	return 0;
+}
+
+/* How many seeds does -O score each plan over by default? */
+#define OPTIMISE_REPLICATIONS	8
+
+/* Command-line options that apply to every run (see apply_point()). */
+static struct {
+	int nworkers, width, height;
+	bool virtual_time, event_loop;
+	simtime_t green_extension;
+	int platoon;
+	simtime_t heading_gaps[NUM_HEADINGS];
+	/* Everything but the prompted parameters. */
+	struct traffic_params params;
+} options = {
+	.green_extension = -1,
+	.platoon = 1,
+};
+
+/* Set up the controllers and @params for a run with the parameters at @point. */
+static void apply_point(const struct param_point_t *point, struct traffic_params *params)
+{
+	simtime_t max_arrival_gap = SECONDS(point->values[PARAM_ARRIVAL_GAP]);
+	simtime_t intersection_gap = SECONDS(point->values[PARAM_INTERSECTION_GAP]);
+
+	*params = options.params;
+	params->num_vehicles = point->values[PARAM_VEHICLES];
+	trunk_fwd_light.green_interval = SECONDS(point->values[PARAM_TRUNK_GREEN]);
+	minor_fwd_light.green_interval = SECONDS(point->values[PARAM_MINOR_GREEN]);
+	trunk_right_light.green_interval = SECONDS(point->values[PARAM_RIGHT_GREEN]);
+
+	for (size_t i = 0; i < ARRAY_LENGTH(ALL_CONTROLLERS); i++) {
+		ALL_CONTROLLERS[i]->intersection_gap = intersection_gap;
+		ALL_CONTROLLERS[i]->actuated = options.green_extension >= 0;
+		ALL_CONTROLLERS[i]->green_extension =
+			options.green_extension < 0 ? 0 : options.green_extension;
+		ALL_CONTROLLERS[i]->platoon = options.platoon;
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(params->max_arrival_gap); i++)
+		params->max_arrival_gap[i] = options.heading_gaps[i] < 0 ?
+		                             max_arrival_gap : options.heading_gaps[i];
+
+	/* A trace only has so many vehicles in it. */
+	if (params->replay && params->replay->count < (uint64_t) params->num_vehicles)
+		params->num_vehicles = params->replay->count;
+}
+
+/*
+ * A single run of a sweep, -O or -K (in its own process, see sweep_map()).
+ * These always run in virtual time, and nothing is logged. Fills in the wait
+ * for every heading too, if @headings isn't NULL.
+ */
+static int batch_point(const struct param_point_t *point, struct stats_summary_t *summary,
+                       struct stats_summary_t headings[NUM_VALID_HEADINGS])
+{
+	struct traffic_params params;
+	int ret;
+
+	apply_point(point, &params);
+	if (log_init(LOG_FORMAT_NONE) < 0 || stats_init() < 0)
+		return -1;
+
+	if (options.width)
+		ret = network_run(&params, options.width, options.height, options.nworkers);
+	else
+		ret = virtual_run(&params);
+
+	log_shutdown();
+	stats_summary(summary);
+	if (headings)
+		stats_summary_headings(headings);
+	stats_free();
+	return ret;
+}
+
+/* sweep_run() callback. */
+static int sweep_point(const struct param_point_t *point, struct stats_summary_t *summary)
+{
+	return batch_point(point, summary, NULL);
+}
+
+/* optimise_run() callback -- every replication has its own seed. */
+static int optimise_point(const struct param_point_t *point, int replication,
+                          struct stats_summary_t *summary)
+{
+	/* We're in a forked child, so this doesn't affect any other run. */
+	options.params.seed += replication;
+	return sweep_point(point, summary);
+}
+
+/* replicate_run() callback -- with the same seeds as the replications of -O. */
+static int replicate_point(const struct param_point_t *point, int replication,
+                           struct replication_t *result)
+{
+	options.params.seed += replication;
+	return batch_point(point, &result->total, result->headings);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-V | [-E] [-F] [-T [-w <workers>]] | -N <width>x<height> [-w <workers>]]\n"
+	                "       [-L <format>] [-A <extension>] [-C] [-P <platoon>] [-M <name>]\n"
+	                "       [-s <seed>] [-R <trace> [-G] | -r <trace>] [-D <schedule>]\n"
+	                "       [-a <heading>=<gap>]... [-f <config>] [-o <param>=<values>]...\n"
+	                "       [-j <jobs>]\n"
+	                "       [-O <objective> [-n <replications>] | -K <replications> [-c <ci>]]\n",
+	        argv0);
+	fprintf(stderr, "  -V  run the simulation in virtual time (no real sleeping)\n");
+	fprintf(stderr, "  -N  simulate a grid of intersections in virtual time, with the\n"
+	                "      given number of vehicles arriving at each of them\n");
+	fprintf(stderr, "  -T  run vehicles as lightweight tasks rather than threads\n");
+	fprintf(stderr, "  -E  drive all of the light controllers from a single event loop,\n"
+	                "      rather than a thread each (not with -V or -N)\n");
+	fprintf(stderr, "  -F  let vehicle threads into each lane strictly in the order they\n"
+	                "      arrived (vehicles are always queued that way with -T, -V or -N)\n");
+	fprintf(stderr, "  -w  number of worker threads for -T or -N (default: one per CPU)\n");
+	fprintf(stderr, "  -L  log format: text (default), binary, coltrace (a columnar trace of\n"
+	                "      every event, for ./tracejson), coltrace-packed (the same, but\n"
+	                "      delta-coded) or none\n");
+	fprintf(stderr, "  -A  demand-actuated lights: skip controllers with nobody waiting,\n"
+	                "      end a green early once the traffic dries up, and allow a busy\n"
+	                "      green to run up to <extension> seconds past its green time\n");
+	fprintf(stderr, "  -C  let lanes of different controllers that don't conflict be green\n"
+	                "      together, picking the phases from the vehicles waiting\n");
+	fprintf(stderr, "  -P  let up to <platoon> vehicles into each lane per signal from\n"
+	                "      the controller, rather than one at a time (default: 1)\n");
+	fprintf(stderr, "  -M  publish the live state of the intersection to the shared-memory\n"
+	                "      segment /<name> while it runs, for ./monitor <name> (not with\n"
+	                "      -V or -N)\n");
+	fprintf(stderr, "  -s  seed for the random arrivals and routes (default: from the time\n"
+	                "      and pid, printed at the start of the run)\n");
+	fprintf(stderr, "  -R  record the arrivals to a binary trace (not with -N)\n");
+	fprintf(stderr, "  -r  replay the arrivals from a binary trace instead of generating\n"
+	                "      them (at every intersection with -N)\n");
+	fprintf(stderr, "  -G  only generate the arrivals and record them with -R, without\n"
+	                "      running the simulation\n");
+	fprintf(stderr, "  -D  generate the arrivals in bulk as one stream for the whole\n"
+	                "      intersection, with the headings in proportion to their arrival\n"
+	                "      rates and gaps that are uniform, poisson (exponential),\n"
+	                "      poisson:<profile> (with the rate scaled by a file of\n"
+	                "      \"<start> <multiple>\" lines over the run) or empirical:<counts>\n"
+	                "      (drawn from a file of \"<gap> <count>\" lines), in seconds\n");
+	fprintf(stderr, "  -a  maximum arrival gap for one heading in seconds (e.g. n2s=2.5),\n"
+	                "      overriding the prompted arrival rate\n");
+	fprintf(stderr, "  -f  read parameters from a config file (one <param> = <values> per\n"
+	                "      line), rather than prompting for them\n");
+	fprintf(stderr, "  -o  set a parameter (vehicles, arrival_gap, intersection_gap,\n"
+	                "      trunk_green, minor_green or right_green), rather than prompting\n"
+	                "      for it. <values> is a comma-separated list of values or ranges\n"
+	                "      (<first>:<last>:<step>), and with more than one value for\n"
+	                "      anything, every combination is run in virtual time and the\n"
+	                "      results are printed as a table\n");
+	fprintf(stderr, "  -j  how many runs of a sweep to run at once (default: one per CPU)\n");
+	fprintf(stderr, "  -O  search for the green times that minimise the mean or p95 wait,\n"
+	                "      starting from the given ones, in virtual time\n");
+	fprintf(stderr, "  -n  how many replications (seeds) to score each plan of -O over\n"
+	                "      (at least 2, default: %d)\n", OPTIMISE_REPLICATIONS);
+	fprintf(stderr, "  -K  run up to <replications> (at least 2) independent replications\n"
+	                "      (seeds) in virtual time, -j at once, and print the mean wait\n"
+	                "      for every heading with its 95%% confidence interval\n");
+	fprintf(stderr, "  -c  stop -K early once the confidence interval of the mean wait is\n"
+	                "      within +/- <ci> seconds\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ret, njobs = 0, replications = OPTIMISE_REPLICATIONS, monte_carlo = 0;
+	double ci_target = 0;
+	bool seeded = false, tasks = false, optimise = false, generate = false;
+	enum optimise_objective_t objective;
+	const char *record_path = NULL, *replay_path = NULL;
+	struct arrival_trace_t record, replay;
+	struct schedule_spec_t schedule;
+	enum log_format_t log_format = LOG_FORMAT_TEXT;
+	struct param_set_t set = { 0 };
+	struct param_point_t point;
+	struct traffic_params params;
+
+	for (size_t i = 0; i < ARRAY_LENGTH(options.heading_gaps); i++)
+		options.heading_gaps[i] = -1;
+
+	while ((opt = getopt(argc, argv, "VTEFN:w:L:A:CP:M:s:R:r:GD:a:f:o:j:O:n:K:c:")) != -1) {
+		char *sep;
+		heading_t heading;
+
+		switch (opt) {
+		case 'V':
+			options.virtual_time = true;
+			break;
+		case 'T':
+			tasks = true;
+			break;
+		case 'E':
+			options.event_loop = true;
+			break;
+		case 'F':
+			options.params.fifo_lanes = true;
+			break;
+		case 'N':
+			if (sscanf(optarg, "%dx%d", &options.width, &options.height) != 2 ||
+			    options.width < 1 || options.height < 1)
+				usage(argv[0]);
+			break;
+		case 'w':
+			options.nworkers = atoi(optarg);
+			if (options.nworkers < 1)
+				usage(argv[0]);
+			break;
+		case 'L':
+			if (!log_format_from_string(optarg, &log_format))
+				usage(argv[0]);
+			break;
+		case 'A':
+			options.green_extension = SECONDS(atof(optarg));
+			if (options.green_extension < 0)
+				usage(argv[0]);
+			break;
+		case 'C':
+			options.params.concurrent_phases = true;
+			break;
+		case 'P':
+			options.platoon = atoi(optarg);
+			if (options.platoon < 1)
+				usage(argv[0]);
+			break;
+		case 'M':
+			options.params.snapshot = optarg;
+			break;
+		case 's':
+			options.params.seed = strtoull(optarg, &sep, 0);
+			if (*sep)
+				usage(argv[0]);
+			seeded = true;
+			break;
+		case 'R':
+			record_path = optarg;
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 'G':
+			generate = true;
+			break;
+		case 'D':
+			if (options.params.schedule) {
+				schedule_spec_free(&schedule);
+				options.params.schedule = NULL;
+			}
+			if (schedule_spec_parse(&schedule, optarg) < 0)
+				usage(argv[0]);
+			options.params.schedule = &schedule;
+			break;
+		case 'a':
+			sep = strchr(optarg, '=');
+			if (!sep)
+				usage(argv[0]);
+			*sep++ = '\0';
+			if (!string_to_heading(optarg, &heading))
+				usage(argv[0]);
+			options.heading_gaps[heading] = SECONDS(atof(sep));
+			if (options.heading_gaps[heading] < 0)
+				usage(argv[0]);
+			break;
+		case 'f':
+			if (param_set_load(&set, optarg) < 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			if (param_set_parse(&set, optarg) < 0)
+				usage(argv[0]);
+			break;
+		case 'j':
+			njobs = atoi(optarg);
+			if (njobs < 1)
+				usage(argv[0]);
+			break;
+		case 'O':
+			if (!optimise_objective_from_string(optarg, &objective))
+				usage(argv[0]);
+			optimise = true;
+			break;
+		case 'n':
+			replications = atoi(optarg);
+			if (replications < 2)
+				usage(argv[0]);
+			break;
+		case 'K':
+			monte_carlo = atoi(optarg);
+			if (monte_carlo < 2)
+				usage(argv[0]);
+			break;
+		case 'c':
+			ci_target = atof(optarg);
+			if (ci_target <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((options.virtual_time || options.width) && (tasks || options.event_loop))
+		usage(argv[0]);
+	if (record_path && (replay_path || options.width))
+		usage(argv[0]);
+	if (options.params.schedule && replay_path)
+		usage(argv[0]);
+	if (generate && (!record_path || options.virtual_time || tasks || options.event_loop ||
+	                 options.params.snapshot || optimise || monte_carlo))
+		usage(argv[0]);
+	if (options.params.snapshot && (options.virtual_time || options.width))
+		usage(argv[0]);
+	if (ci_target > 0 && !monte_carlo)
+		usage(argv[0]);
+	if (!tasks && !options.width)
+		options.nworkers = 0;
+	else if (!options.nworkers && (options.nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		options.nworkers = 1;
+	if (!njobs && (njobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		njobs = 1;
+
+	/* Seed PRNG (and say so, so that the run can be repeated). */
+	if (!seeded)
+		options.params.seed = (uint64_t) time(NULL) ^ getpid();
+	fprintf(stderr, "Random seed: %" PRIu64 "\n", options.params.seed);
+
+	for (int i = 0; i < NUM_PARAMS; i++)
+		if (!set.count[i])
+			readparam(&set, i);
+
+	if (replay_path) {
+		if (arrival_trace_open(&replay, replay_path) < 0)
+			bail("arrival_trace_open(%s) failed", replay_path);
+		options.params.replay = &replay;
+	}
+
+	/* Replaying a trace would make every replication the same. */
+	if (monte_carlo) {
+		if (optimise || tasks || options.event_loop || record_path || replay_path ||
+		    options.params.snapshot || param_set_points(&set) > 1)
+			usage(argv[0]);
+		param_set_point(&set, 0, &point);
+		param_set_free(&set);
+		ret = replicate_run(&point, monte_carlo, ci_target, njobs, replicate_point, stdout);
+		return ret < 0;
+	}
+
+	if (optimise) {
+		if (tasks || options.event_loop || record_path || options.params.snapshot ||
+		    param_set_points(&set) > 1)
+			usage(argv[0]);
+		param_set_point(&set, 0, &point);
+		param_set_free(&set);
+		ret = optimise_run(&point, objective, replications, njobs, optimise_point, stdout);
+		if (replay_path)
+			arrival_trace_close(&replay);
+		return ret < 0;
+	}
+
+	/*
+	 * More than one value for anything is a sweep -- every run uses the same
+	 * seed, so the differences between them are down to the parameters.
+	 */
+	if (param_set_points(&set) > 1) {
+		if (tasks || options.event_loop || record_path || options.params.snapshot)
+			usage(argv[0]);
+		ret = sweep_run(&set, njobs, sweep_point, stdout);
+		if (replay_path)
+			arrival_trace_close(&replay);
+		param_set_free(&set);
+		return ret < 0;
+	}
+
+	param_set_point(&set, 0, &point);
+	param_set_free(&set);
+	if (record_path) {
+		if (arrival_trace_create(&record, record_path) < 0)
+			bail("arrival_trace_create(%s) failed", record_path);
+		options.params.record = &record;
+	}
+	apply_point(&point, &params);
+
+	if (generate) {
+		uint64_t written;
+
+		ret = generate_run(&params);
+		written = record.written;
+		if (arrival_trace_close(&record) < 0)
+			bail("writing arrival trace %s failed", record_path);
+		fprintf(stderr, "Generated %" PRIu64 " arrivals\n", written);
+		return ret;
+	}
+
+	/* Before any other threads exist, so that they all leave SIGUSR1 to it. */
+	if (!options.width && !options.virtual_time && lockstat_init() < 0)
+		bail("lockstat_init failed");
+
+	/* Everything from here on is narrated by the log writer thread. */
+	if (log_init(log_format) < 0)
+		bail("log_init failed");
+	if (stats_init() < 0)
+		bail("stats_init failed");
+
+	if (options.width)
+		ret = network_run(&params, options.width, options.height, options.nworkers);
+	else if (options.virtual_time)
+		ret = virtual_run(&params);
+	else
+		ret = realtime_run(&params, options.nworkers, options.event_loop);
+
+	log_shutdown();
+	if (record_path && arrival_trace_close(&record) < 0)
+		bail("writing arrival trace %s failed", record_path);
+	if (replay_path)
+		arrival_trace_close(&replay);
+	if (options.params.schedule)
+		schedule_spec_free(&schedule);
+
+	/* Only the narration gets this -- it would corrupt a binary log or trace. */
+	if (log_format == LOG_FORMAT_TEXT || log_format == LOG_FORMAT_NONE) {
+		printf("Main thread: There are no more vehicles to serve. "
+		       "The simulation will end now.\n");
+		fflush(stdout);
+	}
+
+	/* The report goes to stderr, so it doesn't get mixed up with -L binary. */
+	stats_report(stderr);
+	stats_free();
+	return ret;
+}
@@ -20,10 +20,13 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "sync.h"
+#include "timeutil.h"
 
 /* Helper to deal with fatal errors. */
 #define bail(fmt, ...)														\
@@ -57,6 +60,23 @@ typedef int heading_t;
 #define PACK_HEADING(start, end)	((heading_t)((start)*NUM_DIRECTIONS + (end)))
 #define HEADING_START(packed)		((dir_t)((packed) / NUM_DIRECTIONS))
 #define HEADING_END(packed)			((dir_t)((packed) % NUM_DIRECTIONS))
+#define NUM_HEADINGS				(NUM_DIRECTIONS * NUM_DIRECTIONS)
+
+/*
+ * Index of each heading in VALID_HEADINGS (HEADING_IDX_NORTH_SOUTH and so on),
+ * and the total number of valid headings.
+ */
+enum {
+#	define HEADING_GENERIC(start, end, name) HEADING_IDX_##start##_##end,
+#	include "heading-list.h"
+	NUM_VALID_HEADINGS,
+};
+
+/* How many light controllers make up the intersection? */
+#define NUM_CONTROLLERS 3
+
+/* How long are all lights red between two controllers? */
+#define ALL_RED_GAP SECONDS(2)
 
 /* Meta-structure for each controller. */
 struct light_controller_t {
@@ -65,10 +85,55 @@ struct light_controller_t {
 	/* What is the next controller in the sequence? */
 	struct light_controller_t *next;
 
-	/* How long between cars entrying the intersection (in seconds)? */
-	int intersection_gap;
-	/* How long does this light stay green (in seconds)? */
-	int green_interval;
+	/* How long between cars entrying the intersection (in nanoseconds)? */
+	simtime_t intersection_gap;
+	/* How long does this light stay green (in nanoseconds)? */
+	simtime_t green_interval;
+
+	/*
+	 * When does the current green phase end? Written before the lanes are
+	 * signalled, so a vehicle that has been let through can read it.
+	 */
+	simtime_t red_deadline;
+	/* How many vehicles have been let through in the current green phase? */
+	int phase_vehicles;
+
+	/*
+	 * Demand-actuated timing. An actuated controller turns red as soon as
+	 * nobody has been waiting at its lights for one intersection_gap (but
+	 * stays green for at least one intersection_gap), stays green for up to
+	 * green_extension past green_interval while vehicles keep coming, and
+	 * hands over to the next controller in the ring that has anybody waiting.
+	 */
+	bool actuated;
+	simtime_t green_extension;
+	/* How many vehicles are waiting in each lane of entry[]? */
+	int waiting[NUM_DIRECTIONS];
+
+	/*
+	 * Live state for -M (see snapshot.h) -- is the light green, how many
+	 * green phases has it had, how many vehicles from each lane are in the
+	 * intersection, and how many have crossed altogether?
+	 */
+	bool green;
+	uint64_t phases;
+	int crossing[NUM_DIRECTIONS];
+	uint64_t passed;
+
+	/*
+	 * How many vehicles each lane lets in per signal. A platoon of them
+	 * crosses one after the other (each still holding the lane for an
+	 * intersection_gap) without waking the controller in between.
+	 */
+	unsigned int platoon;
+
+	/*
+	 * Which lanes of entry[] (a bitmask of dir_t) does the current phase
+	 * turn green? Normally both, but with concurrent phases (see phase.h) a
+	 * controller may only turn one of them green. Written by whoever wakes
+	 * the controller, before it's woken.
+	 */
+	unsigned int open_lanes;
 
 	/*
 	 * Barrier to indicate that all lights are ready. We can't use
@@ -97,14 +162,144 @@ struct light_controller_t {
 	 * HEADING_START().
 	 */
 	signal_mailbox_t entry[NUM_DIRECTIONS];
+
+	/*
+	 * Recycled receipts for the crossing loop, so that letting a vehicle
+	 * through doesn't need a malloc() and sem_init() every time.
+	 */
+	arcsem_pool_t receipts;
+};
+
+/* Both of @controller's lanes (a bitmask of dir_t). */
+#define CONTROLLER_LANES(controller)											\
+	((1U << HEADING_START((controller)->id[0])) | (1U << HEADING_START((controller)->id[1])))
+
+/*
+ * A vehicle is a handle into VEHICLES, which holds the state of every vehicle
+ * in the run as a structure of arrays (one column per field). The columns are
+ * allocated once at the start of a run, so there is no allocation per vehicle,
+ * a vehicle costs 52 bytes, and scanning one field of every vehicle only
+ * touches that field.
+ */
+typedef uint32_t vehicle_t;
+#define VEHICLE_NONE	((vehicle_t) UINT32_MAX)
+
+/* Pass a vehicle through a void * (event data or thread argument). */
+#define VEHICLE_TO_PTR(vehicle)	((void *) (uintptr_t) (vehicle))
+#define PTR_TO_VEHICLE(ptr)		((vehicle_t) (uintptr_t) (ptr))
+
+/* Where is the vehicle up to? */
+enum vehicle_status_t {
+	VEHICLE_ARRIVING,
+	VEHICLE_WAITING,
+	VEHICLE_CROSSING,
+	VEHICLE_DONE,
 };
 
-/* Meta-structure for a vehicle -- thread has the responsibility to free it. */
-struct vehicle_t {
+struct vehicle_arena_t {
+	uint32_t capacity;
+	/* How many vehicles have been handed out (only ever modified atomically). */
+	uint32_t count;
+
 	/* Vehicle identifier (unique for a given heading). */
-	int id;
-	/* What is the (start, end) of the vehicle. */
-	heading_t heading;
+	int32_t *id;
+	/* What is the (start, end) of the vehicle (a heading_t)? */
+	uint8_t *heading;
+	/* An enum vehicle_status_t. */
+	uint8_t *status;
+
+	/*
+	 * When did the vehicle arrive at the lights, enter the intersection and
+	 * leave it again? And when did the light that let it through turn red?
+	 */
+	simtime_t *arrived, *admitted, *left;
+	simtime_t *red_deadline;
+
+	/*
+	 * Road network engine only -- which intersection is the vehicle at, and
+	 * how many has it crossed so far? And at which intersection, with which
+	 * heading, did it enter the network (which, with the id, identifies it)?
+	 */
+	int32_t *intersection;
+	uint8_t *hops;
+	int32_t *origin;
+	uint8_t *origin_heading;
+
+	/* Next vehicle queued in the same lane (virtual-time engines only). */
+	vehicle_t *next;
 };
 
+/* The vehicles of the current run (defined in vehicle.c). */
+extern struct vehicle_arena_t VEHICLES;
+
+/* Make room for @capacity vehicles (dropping any from a previous run). */
+int vehicles_init(uint32_t capacity);
+void vehicles_free(void);
+/* Hand out a new vehicle (safe to call from any thread). */
+vehicle_t vehicle_new(int id, heading_t heading);
+
+struct arrival_trace_t;
+struct schedule_spec_t;
+
+/*
+ * Parameters for a simulation run. The per-controller parameters are stored in
+ * the light_controller_t themselves.
+ */
+struct traffic_params {
+	/* How many vehicles are spawned in total? */
+	int num_vehicles;
+	/*
+	 * Upper bound on the gap between two vehicle arrivals with the same
+	 * heading (in nanoseconds), indexed by heading.
+	 */
+	simtime_t max_arrival_gap[NUM_HEADINGS];
+	/*
+	 * Should lanes of different controllers that don't conflict be green at
+	 * the same time (see phase.h)? Otherwise the controllers take turns.
+	 */
+	bool concurrent_phases;
+	/* Every random decision of the run is derived from this (see rng.h). */
+	uint64_t seed;
+	/*
+	 * Generate the arrivals from this schedule (see schedule.h), rather than
+	 * with a generator for each heading.
+	 */
+	const struct schedule_spec_t *schedule;
+	/* Arrival traces to replay instead of generating arrivals, and to record. */
+	const struct arrival_trace_t *replay;
+	struct arrival_trace_t *record;
+	/* Shared-memory segment to publish the live state to (real time only). */
+	const char *snapshot;
+	/*
+	 * Do threaded vehicles queue up for their lane in the order they arrived
+	 * (see mailbox_wait_fifo())? Vehicle tasks and the virtual-time engines
+	 * always do.
+	 */
+	bool fifo_lanes;
+};
+
+/* The intersection and its headings (defined in traffic.c). */
+extern const heading_t VALID_HEADINGS[NUM_VALID_HEADINGS];
+extern struct light_controller_t *ALL_CONTROLLERS[NUM_CONTROLLERS];
+extern struct light_controller_t *HEADING_CONTROLLERS[NUM_HEADINGS];
+
+/* Helpers shared between the engines (defined in traffic.c). */
+const char *heading_to_string(heading_t heading);
+/* Index of @controller in ALL_CONTROLLERS. */
+int controller_index(const struct light_controller_t *controller);
+
+/*
+ * Run the whole simulation in virtual time (see virtual.c). This has the same
+ * controller and vehicle semantics as the threaded engine, but nothing ever
+ * actually sleeps.
+ */
+int virtual_run(const struct traffic_params *params);
+
+/*
+ * Run a @width by @height grid of intersections in virtual time (see
+ * network.c), split between @npartitions threads.
+ */
+int network_run(const struct traffic_params *params, int width, int height,
+                int npartitions);
+
 #endif /* !TRAFFIC_H */
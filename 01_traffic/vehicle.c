@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The vehicle arena. All of the columns live in a single anonymous mapping,
+ * each starting on its own cache line, so untouched pages cost nothing and a
+ * run with millions of vehicles is just one mmap().
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "traffic.h"
+
+#define CACHELINE	64
+
+struct vehicle_arena_t VEHICLES;
+
+static struct {
+	void *base;
+	size_t len;
+} mapping;
+
+/* Carve a column of @capacity @size-byte fields out of the mapping at *@offset. */
+static void *column(size_t *offset, uint32_t capacity, size_t size)
+{
+	void *start = (char *) mapping.base + *offset;
+
+	*offset += ((size_t) capacity * size + CACHELINE - 1) & ~(size_t) (CACHELINE - 1);
+	return start;
+}
+
+/* Lay out every column of VEHICLES, returning the total size. */
+static size_t layout(uint32_t capacity)
+{
+	size_t offset = 0;
+
+	VEHICLES.id = column(&offset, capacity, sizeof(*VEHICLES.id));
+	VEHICLES.heading = column(&offset, capacity, sizeof(*VEHICLES.heading));
+	VEHICLES.status = column(&offset, capacity, sizeof(*VEHICLES.status));
+	VEHICLES.arrived = column(&offset, capacity, sizeof(*VEHICLES.arrived));
+	VEHICLES.admitted = column(&offset, capacity, sizeof(*VEHICLES.admitted));
+	VEHICLES.left = column(&offset, capacity, sizeof(*VEHICLES.left));
+	VEHICLES.red_deadline = column(&offset, capacity, sizeof(*VEHICLES.red_deadline));
+	VEHICLES.intersection = column(&offset, capacity, sizeof(*VEHICLES.intersection));
+	VEHICLES.hops = column(&offset, capacity, sizeof(*VEHICLES.hops));
+	VEHICLES.origin = column(&offset, capacity, sizeof(*VEHICLES.origin));
+	VEHICLES.origin_heading = column(&offset, capacity, sizeof(*VEHICLES.origin_heading));
+	VEHICLES.next = column(&offset, capacity, sizeof(*VEHICLES.next));
+	return offset;
+}
+
+int vehicles_init(uint32_t capacity)
+{
+	vehicles_free();
+	if (capacity == VEHICLE_NONE) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	/* The first pass only works out the size. */
+	mapping.len = layout(capacity);
+	if (!mapping.len)
+		mapping.len = 1;
+	mapping.base = mmap(NULL, mapping.len, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping.base == MAP_FAILED) {
+		mapping.base = NULL;
+		return -1;
+	}
+
+	layout(capacity);
+	VEHICLES.capacity = capacity;
+	VEHICLES.count = 0;
+	return 0;
+}
+
+void vehicles_free(void)
+{
+	if (mapping.base)
+		munmap(mapping.base, mapping.len);
+	mapping.base = NULL;
+	VEHICLES = (struct vehicle_arena_t) { 0 };
+}
+
+vehicle_t vehicle_new(int id, heading_t heading)
+{
+	vehicle_t vehicle = __atomic_fetch_add(&VEHICLES.count, 1, __ATOMIC_RELAXED);
+
+	if (vehicle >= VEHICLES.capacity) {
+		errno = ENOSPC;
+		bail("vehicle arena is full (%u vehicles)", VEHICLES.capacity);
+	}
+
+	VEHICLES.id[vehicle] = id;
+	VEHICLES.heading[vehicle] = heading;
+	VEHICLES.status[vehicle] = VEHICLE_ARRIVING;
+	VEHICLES.arrived[vehicle] = 0;
+	VEHICLES.admitted[vehicle] = 0;
+	VEHICLES.left[vehicle] = 0;
+	VEHICLES.red_deadline[vehicle] = 0;
+	VEHICLES.intersection[vehicle] = 0;
+	VEHICLES.hops[vehicle] = 0;
+	VEHICLES.origin[vehicle] = 0;
+	VEHICLES.origin_heading[vehicle] = heading;
+	VEHICLES.next[vehicle] = VEHICLE_NONE;
+	return vehicle;
+}
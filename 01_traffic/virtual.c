@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Virtual-time (discrete-event) engine. Rather than having threads sleep in
+ * real time, every state change is a timestamped event in a priority queue
+ * and we just jump the clock forward to the next event. The semantics mirror
+ * light_start() and vehicle_start() in traffic.c:
+ *
+ *  - A controller is woken by the previous one, stays green for its
+ *    green_interval and then turns red. After the ALL_RED_GAP the next
+ *    controller in the ring is woken (or, with concurrent phases, every
+ *    controller with a lane in the next phase).
+ *  - While a controller is green, each of its two lanes lets one vehicle at a
+ *    time into the intersection. A vehicle holds its lane for its
+ *    intersection_gap, and a vehicle that entered before the light turned red
+ *    is allowed to finish crossing.
+ *  - Vehicles are spawned by the same per-heading arrival generators (see
+ *    arrival.c), polled at the same times, so a given seed produces the same
+ *    arrivals in both engines.
+ *
+ * The only intentional difference is that vehicles waiting in the same lane
+ * are admitted in FIFO order, whereas the threaded engine admits whichever
+ * thread pthread_cond_signal() happens to pick.
+ *
+ * Everything belonging to one intersection lives in a struct vintersection,
+ * so that the road network engine (see network.c) can run many of them off
+ * each of its event queues.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrival.h"
+#include "eventq.h"
+#include "log.h"
+#include "stats.h"
+#include "traffic.h"
+#include "virtual.h"
+
+int vsim_init(struct vsim *sim)
+{
+	*sim = (struct vsim) { 0 };
+	return eventq_init(&sim->events);
+}
+
+void vsim_free(struct vsim *sim)
+{
+	eventq_free(&sim->events);
+}
+
+void vsim_schedule(struct vsim *sim, simtime_t when, int type, void *data)
+{
+	if (eventq_push(&sim->events, when, type, data) < 0)
+		bail("eventq_push failed");
+}
+
+static struct vcontroller *vcontroller_of(struct vintersection *intersection,
+                                          heading_t heading)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(intersection->controllers); i++)
+		if (intersection->controllers[i].conf == HEADING_CONTROLLERS[heading])
+			return &intersection->controllers[i];
+	return NULL;
+}
+
+/* Let the next vehicle in @vlane into the intersection (if permitted). */
+static void try_admit(struct vsim *sim, struct vlane *vlane)
+{
+	struct vcontroller *ctrl = vlane->ctrl;
+	vehicle_t vehicle = vlane->head;
+
+	if (!ctrl->green || sim->now >= ctrl->red_deadline)
+		return;
+	if (!(ctrl->open & (1U << (vlane - ctrl->lanes))))
+		return;
+	if (vlane->crossing != VEHICLE_NONE || vehicle == VEHICLE_NONE)
+		return;
+
+	vlane->head = VEHICLES.next[vehicle];
+	if (vlane->head == VEHICLE_NONE)
+		vlane->tail = VEHICLE_NONE;
+	vlane->waiting--;
+	vlane->crossing = vehicle;
+	VEHICLES.status[vehicle] = VEHICLE_CROSSING;
+	VEHICLES.admitted[vehicle] = sim->now;
+	VEHICLES.red_deadline[vehicle] = ctrl->red_deadline;
+	ctrl->phase_vehicles++;
+
+	log_vehicle(sim->now, LOG_VEHICLE_PROCEEDING, vehicle);
+	vsim_schedule(sim, sim->now + ctrl->conf->intersection_gap, EV_LEAVE, vlane);
+}
+
+/* Is anybody waiting in @lanes (a bitmask of dir_t) of @ctrl? */
+static bool has_demand(const struct vcontroller *ctrl, unsigned int lanes)
+{
+	for (int lane = 0; lane < NUM_DIRECTIONS; lane++)
+		if ((lanes & (1U << lane)) && ctrl->lanes[lane].head != VEHICLE_NONE)
+			return true;
+	return false;
+}
+
+/* Is anybody waiting at or crossing from @ctrl's green lanes? */
+static bool is_busy(const struct vcontroller *ctrl)
+{
+	for (int lane = 0; lane < NUM_DIRECTIONS; lane++)
+		if ((ctrl->open & (1U << lane)) && ctrl->lanes[lane].crossing != VEHICLE_NONE)
+			return true;
+	return has_demand(ctrl, ctrl->open);
+}
+
+/*
+ * An actuated controller has nobody to let through -- give up the green if
+ * nobody turns up within one intersection_gap (see light_start()).
+ */
+static void schedule_gap(struct vsim *sim, struct vcontroller *ctrl)
+{
+	simtime_t when = sim->now + ctrl->conf->intersection_gap;
+
+	if (when < ctrl->min_deadline)
+		when = ctrl->min_deadline;
+	if (when >= ctrl->red_deadline)
+		return;
+	ctrl->gap_deadline = when;
+	vsim_schedule(sim, when, EV_GAP, ctrl);
+}
+
+/* Turn @lanes (a bitmask of dir_t) of @ctrl green. */
+static void controller_green(struct vsim *sim, struct vcontroller *ctrl, unsigned int lanes)
+{
+	const struct light_controller_t *conf = ctrl->conf;
+	simtime_t green_max = conf->green_interval + (conf->actuated ? conf->green_extension : 0);
+
+	ctrl->green = true;
+	ctrl->open = lanes;
+	ctrl->red_deadline = sim->now + green_max;
+	ctrl->min_deadline = sim->now + conf->intersection_gap;
+	stats_green(conf, __builtin_popcount(lanes), green_max);
+
+	log_controller(sim->now, LOG_CONTROLLER_GREEN, conf);
+	vsim_schedule(sim, ctrl->red_deadline, EV_RED, ctrl);
+
+	try_admit(sim, &ctrl->lanes[HEADING_START(conf->id[0])]);
+	try_admit(sim, &ctrl->lanes[HEADING_START(conf->id[1])]);
+	if (conf->actuated && !is_busy(ctrl))
+		schedule_gap(sim, ctrl);
+}
+
+/* Same choice as phase_next() in traffic.c. */
+static phase_t phase_next(struct vintersection *intersection)
+{
+	struct vcontroller *last = intersection->last, *next;
+	int demand[NUM_SIGNAL_GROUPS];
+
+	if (!intersection->concurrent) {
+		if (!last)
+			return CONTROLLER_PHASE(0);
+		next = last->next;
+		if (last->conf->actuated) {
+			for (int i = 0; i < NUM_CONTROLLERS && !has_demand(next, CONTROLLER_LANES(next->conf)); i++)
+				next = next->next;
+			if (!has_demand(next, CONTROLLER_LANES(next->conf)))
+				next = last->next;
+		}
+		return CONTROLLER_PHASE(next - intersection->controllers);
+	}
+
+	for (int i = 0; i < NUM_SIGNAL_GROUPS; i++)
+		demand[i] = intersection->controllers[GROUP_CONTROLLER(i)].lanes[GROUP_DIRECTION(i)].waiting;
+	return phase_pick(&intersection->phases, demand);
+}
+
+static void on_green(struct vsim *sim, struct vintersection *intersection)
+{
+	phase_t phase = phase_next(intersection);
+
+	intersection->phase = phase;
+	intersection->active = 0;
+	for (int i = 0; i < NUM_CONTROLLERS; i++)
+		if (phase_lanes(phase, i))
+			intersection->active++;
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++)
+		if (phase_lanes(phase, i))
+			controller_green(sim, &intersection->controllers[i], phase_lanes(phase, i));
+}
+
+static void on_red(struct vsim *sim, struct vcontroller *ctrl)
+{
+	const struct light_controller_t *conf = ctrl->conf;
+
+	/* Stale EV_RED for a phase that has already gapped out. */
+	if (!ctrl->green || sim->now != ctrl->red_deadline)
+		return;
+
+	ctrl->green = false;
+	stats_red(conf, ctrl->phase_vehicles);
+	ctrl->phase_vehicles = 0;
+
+	log_controller(sim->now, LOG_CONTROLLER_RED, conf);
+
+	/* The last controller of the phase to turn red starts the all-red gap. */
+	if (--ctrl->intersection->active)
+		return;
+	ctrl->intersection->last = ctrl;
+	log_controller(sim->now, LOG_ALL_RED, conf);
+	vsim_schedule(sim, sim->now + ALL_RED_GAP, EV_GREEN, ctrl->intersection);
+}
+
+static void on_gap(struct vsim *sim, struct vcontroller *ctrl)
+{
+	if (!ctrl->green || sim->now != ctrl->gap_deadline || is_busy(ctrl))
+		return;
+
+	/* Gap-out -- nobody came, so don't waste the rest of the green. */
+	stats_green_cut(ctrl->conf, __builtin_popcount(ctrl->open), ctrl->red_deadline - sim->now);
+	ctrl->red_deadline = sim->now;
+	on_red(sim, ctrl);
+}
+
+void vintersection_enter(struct vsim *sim, struct vintersection *intersection,
+                         vehicle_t vehicle)
+{
+	struct vcontroller *ctrl = vcontroller_of(intersection, VEHICLES.heading[vehicle]);
+	struct vlane *vlane = &ctrl->lanes[HEADING_START(VEHICLES.heading[vehicle])];
+
+	VEHICLES.arrived[vehicle] = sim->now;
+	VEHICLES.status[vehicle] = VEHICLE_WAITING;
+	VEHICLES.next[vehicle] = VEHICLE_NONE;
+	log_vehicle(sim->now, LOG_VEHICLE_ARRIVED, vehicle);
+
+	if (vlane->tail != VEHICLE_NONE)
+		VEHICLES.next[vlane->tail] = vehicle;
+	else
+		vlane->head = vehicle;
+	vlane->tail = vehicle;
+	vlane->waiting++;
+	try_admit(sim, vlane);
+}
+
+static void on_arrivals(struct vsim *sim, struct vintersection *intersection)
+{
+	struct arrival_t *batch;
+	size_t len = arrivals_poll(&intersection->arrivals, sim->now, &batch);
+	simtime_t next;
+
+	for (size_t i = 0; i < len; i++) {
+		vehicle_t vehicle = vehicle_new(batch[i].id, batch[i].heading);
+
+		VEHICLES.intersection[vehicle] = intersection->index;
+		VEHICLES.origin[vehicle] = intersection->index;
+		vintersection_enter(sim, intersection, vehicle);
+	}
+
+	next = arrivals_next(&intersection->arrivals);
+	if (next >= 0)
+		vsim_schedule(sim, next, EV_ARRIVALS, intersection);
+}
+
+static void on_leave(struct vsim *sim, struct vlane *vlane)
+{
+	vehicle_t vehicle = vlane->crossing;
+
+	vlane->crossing = VEHICLE_NONE;
+	VEHICLES.left[vehicle] = sim->now;
+	VEHICLES.status[vehicle] = VEHICLE_DONE;
+	log_vehicle(sim->now, LOG_VEHICLE_LEFT, vehicle);
+	stats_vehicle(vehicle);
+
+	if (sim->depart)
+		sim->depart(sim, vlane->ctrl->intersection, vehicle);
+	else
+		sim->finished++;
+
+	try_admit(sim, vlane);
+	if (vlane->ctrl->conf->actuated && vlane->ctrl->green && !is_busy(vlane->ctrl))
+		schedule_gap(sim, vlane->ctrl);
+}
+
+bool vsim_dispatch(struct vsim *sim, const struct event_t *event)
+{
+	switch (event->type) {
+	case EV_GREEN:
+		on_green(sim, event->data);
+		return true;
+	case EV_RED:
+		on_red(sim, event->data);
+		return true;
+	case EV_GAP:
+		on_gap(sim, event->data);
+		return true;
+	case EV_ARRIVALS:
+		on_arrivals(sim, event->data);
+		return true;
+	case EV_LEAVE:
+		on_leave(sim, event->data);
+		return true;
+	}
+	return false;
+}
+
+void vintersection_init(struct vsim *sim, struct vintersection *intersection,
+                        const struct traffic_params *params, int index)
+{
+	*intersection = (struct vintersection) {
+		.index = index,
+		.concurrent = params->concurrent_phases,
+	};
+	phase_sched_init(&intersection->phases);
+
+	/* Set up the controller ring, in the same order as ALL_CONTROLLERS. */
+	for (size_t i = 0; i < ARRAY_LENGTH(intersection->controllers); i++) {
+		struct vcontroller *ctrl = &intersection->controllers[i];
+		const struct light_controller_t *conf = ALL_CONTROLLERS[i];
+
+		ctrl->conf = conf;
+		ctrl->intersection = intersection;
+		for (size_t j = 0; j < ARRAY_LENGTH(intersection->controllers); j++)
+			if (ALL_CONTROLLERS[j] == conf->next)
+				ctrl->next = &intersection->controllers[j];
+		if (!ctrl->next)
+			bail("controller ring is broken");
+		for (size_t j = 0; j < ARRAY_LENGTH(ctrl->lanes); j++) {
+			ctrl->lanes[j].ctrl = ctrl;
+			ctrl->lanes[j].crossing = VEHICLE_NONE;
+			ctrl->lanes[j].head = ctrl->lanes[j].tail = VEHICLE_NONE;
+		}
+
+		log_controller(sim->now, LOG_CONTROLLER_READY, conf);
+	}
+
+	/* Trigger the default state, and start spawning vehicles. */
+	if (arrivals_init(&intersection->arrivals, params, index) < 0)
+		bail("arrivals_init failed");
+	vsim_schedule(sim, sim->now, EV_GREEN, intersection);
+	if (arrivals_next(&intersection->arrivals) >= 0)
+		vsim_schedule(sim, arrivals_next(&intersection->arrivals), EV_ARRIVALS,
+		              intersection);
+}
+
+void vintersection_free(struct vsim *sim, struct vintersection *intersection)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(intersection->controllers); i++) {
+		struct vcontroller *ctrl = &intersection->controllers[i];
+
+		/*
+		 * Take off the part of any green phase that we didn't get to, but
+		 * still count the vehicles it let through.
+		 */
+		if (!ctrl->green)
+			continue;
+		if (ctrl->red_deadline > sim->now)
+			stats_green_cut(ctrl->conf, __builtin_popcount(ctrl->open),
+			                ctrl->red_deadline - sim->now);
+		stats_red(ctrl->conf, ctrl->phase_vehicles);
+		ctrl->phase_vehicles = 0;
+	}
+	arrivals_free(&intersection->arrivals);
+}
+
+int virtual_run(const struct traffic_params *params)
+{
+	struct vsim sim;
+	struct vintersection intersection;
+	struct event_t event;
+
+	if (vsim_init(&sim) < 0)
+		bail("vsim_init failed");
+	if (vehicles_init(params->num_vehicles) < 0)
+		bail("vehicles_init(%d) failed", params->num_vehicles);
+	vintersection_init(&sim, &intersection, params, 0);
+
+	while (sim.finished < params->num_vehicles && eventq_pop(&sim.events, &event)) {
+		sim.now = event.when;
+		vsim_dispatch(&sim, &event);
+	}
+
+	vintersection_free(&sim, &intersection);
+	vsim_free(&sim);
+	vehicles_free();
+	return 0;
+}
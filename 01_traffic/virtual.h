@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019 [450362910]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIRTUAL_H
+#define VIRTUAL_H
+
+#include <stdbool.h>
+
+#include "arrival.h"
+#include "eventq.h"
+#include "phase.h"
+#include "traffic.h"
+
+/*
+ * Building blocks of the virtual-time engine (see virtual.c), shared by the
+ * single-intersection engine and the road network engine (see network.c).
+ */
+
+enum {
+	/* The all-red gap is over, so the intersection's next phase turns green. */
+	EV_GREEN,
+	/* Controller's green_interval (plus any extension) has expired. */
+	EV_RED,
+	/* Actuated controller may have had nobody to let through for a while. */
+	EV_GAP,
+	/* A batch of vehicles may be due to arrive at an intersection. */
+	EV_ARRIVALS,
+	/* Vehicle has finished crossing an intersection. */
+	EV_LEAVE,
+
+	/* Users of struct vsim can define their own events from here on. */
+	NUM_VSIM_EVENTS,
+};
+
+struct vcontroller;
+struct vintersection;
+
+/* A single lane, equivalent to light_controller_t.entry[]. */
+struct vlane {
+	struct vcontroller *ctrl;
+	/* Vehicle in the intersection from this lane (or VEHICLE_NONE). */
+	vehicle_t crossing;
+	/* Vehicles waiting at the lights (FIFO, linked through VEHICLES.next). */
+	vehicle_t head, tail;
+	int waiting;
+};
+
+/* Virtual-time state of a light_controller_t. */
+struct vcontroller {
+	/* Timing parameters and ring order. */
+	const struct light_controller_t *conf;
+	struct vcontroller *next;
+	struct vintersection *intersection;
+
+	bool green;
+	/* Which lanes (a bitmask of dir_t) are green in the current phase? */
+	unsigned int open;
+	simtime_t red_deadline;
+	/* Actuated controllers -- end of the minimum green, and pending gap-out. */
+	simtime_t min_deadline, gap_deadline;
+	/* How many vehicles have been let through in this green phase? */
+	int phase_vehicles;
+	struct vlane lanes[NUM_DIRECTIONS];
+};
+
+/* One intersection -- a ring of controllers, and its own arrivals. */
+struct vintersection {
+	struct vcontroller controllers[NUM_CONTROLLERS];
+	struct arrivals_t arrivals;
+
+	/*
+	 * The phase that is currently green, how many of its controllers have yet
+	 * to turn red, and which one was the last to turn red (NULL at first).
+	 */
+	bool concurrent;
+	struct phase_sched_t phases;
+	phase_t phase;
+	int active;
+	struct vcontroller *last;
+
+	/* Index of the intersection in the network (0 for the lone one). */
+	int index;
+};
+
+/* A single discrete-event simulation (one event queue and clock). */
+struct vsim {
+	struct eventq_t events;
+	simtime_t now;
+	/* How many vehicles have finished their journey? */
+	int finished;
+
+	/*
+	 * Called when @vehicle has left @intersection, which hands the vehicle
+	 * over to the callback. If NULL, the vehicle's journey is over.
+	 */
+	void (*depart)(struct vsim *sim, struct vintersection *intersection,
+	               vehicle_t vehicle);
+};
+
+int vsim_init(struct vsim *sim);
+/* Free the event queue. */
+void vsim_free(struct vsim *sim);
+void vsim_schedule(struct vsim *sim, simtime_t when, int type, void *data);
+/* Handle one of the EV_* events, returning false if @event isn't one. */
+bool vsim_dispatch(struct vsim *sim, const struct event_t *event);
+
+/*
+ * Set up @intersection (with its own arrival generators) and schedule its
+ * first events. The controller timings are shared with ALL_CONTROLLERS.
+ */
+void vintersection_init(struct vsim *sim, struct vintersection *intersection,
+                        const struct traffic_params *params, int index);
+/* Free the arrival generators, and account for an interrupted green. */
+void vintersection_free(struct vsim *sim, struct vintersection *intersection);
+/* @vehicle has arrived at the lights of @intersection. */
+void vintersection_enter(struct vsim *sim, struct vintersection *intersection,
+                         vehicle_t vehicle);
+
+#endif /* !VIRTUAL_H */